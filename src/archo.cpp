@@ -3,8 +3,6 @@
 #include "archo.h"
 #include "signing.h"
 
-uint64_t ZArchO::s_uExecSegLimit = 0;
-
 ZArchO::ZArchO()
 {
 	m_pBase = NULL;
@@ -18,96 +16,304 @@ ZArchO::ZArchO()
 	m_bEncrypted = false;
 	m_b64Bit = false;
 	m_bBigEndian = false;
+	m_uExecSegLimit = 0;
+	m_uEstimatedSignLength = 0;
 	m_bEnoughSpace = true;
 	m_pCodeSignSegment = NULL;
 	m_pLinkEditSegment = NULL;
 	m_uLoadCommandsFreeSpace = 0;
 }
 
-bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
+ZArchInfo::ZArchInfo()
 {
-	if (NULL == pBase || uLength <= 0) {
+	b64Bit = false;
+	bBigEndian = false;
+	bEncrypted = false;
+	bHasUUID = false;
+	memset(arrUUID, 0, sizeof(arrUUID));
+	uFileType = 0;
+	uCPUType = 0;
+	uCPUSubType = 0;
+	uHeaderSize = 0;
+	uCommandCount = 0;
+	uCommandsSize = 0;
+	uLoadCommandsFreeSpace = 0;
+	uExecSegLimit = 0;
+	uMinOSCommand = 0;
+	uPlatform = 0;
+	uMinOS = 0;
+	uLinkEditCommand = 0;
+	uCodeSignCommand = 0;
+	uSignOffset = 0;
+	uSignSize = 0;
+	uInfoPlistOffset = 0;
+	uInfoPlistSize = 0;
+}
+
+// word size of a slice, picks the header, segment and section layouts
+struct ZMachO32Traits
+{
+	typedef mach_header		header_type;
+	typedef segment_command	segment_type;
+	typedef section			section_type;
+	static const uint32_t	uSegmentCommand = LC_SEGMENT;
+	static const bool		b64Bit = false;
+};
+
+struct ZMachO64Traits
+{
+	typedef mach_header_64		header_type;
+	typedef segment_command_64	segment_type;
+	typedef section_64			section_type;
+	static const uint32_t		uSegmentCommand = LC_SEGMENT_64;
+	static const bool			b64Bit = true;
+};
+
+// byte order of a slice, bSwap is set when it differs from the host
+template<bool bSwap>
+struct ZByteOrderTraits
+{
+	static uint32_t Get(uint32_t uValue) { return bSwap ? ZUtil::Swap(uValue) : uValue; }
+	static uint64_t Get(uint64_t uValue) { return bSwap ? ZUtil::Swap(uValue) : uValue; }
+	static const bool bBigEndian = bSwap;
+};
+
+// a string stored inside a load command, empty if the offset is out of the command
+static string GetCommandString(const uint8_t* pLoadCommand, uint32_t uCmdSize, uint32_t uOffset)
+{
+	if (uOffset >= uCmdSize) {
+		return string();
+	}
+	const char* szString = (const char*)(pLoadCommand + uOffset);
+	return string(szString, strnlen(szString, uCmdSize - uOffset));
+}
+
+template<class W, class B>
+static bool ParseLoadCommands(const uint8_t* pBase, uint32_t uLength, ZArchInfo& info)
+{
+	typedef typename W::header_type header_type;
+	typedef typename W::segment_type segment_type;
+	typedef typename W::section_type section_type;
+
+	if (uLength < sizeof(header_type)) {
 		return false;
 	}
 
-	m_pBase = pBase;
-	m_uLength = uLength;
-	m_uCodeLength = (uLength % 16 == 0) ? uLength : uLength + 16 - (uLength % 16);
-	m_pHeader = (mach_header*)m_pBase;
-	if (MH_MAGIC != m_pHeader->magic && MH_CIGAM != m_pHeader->magic && MH_MAGIC_64 != m_pHeader->magic && MH_CIGAM_64 != m_pHeader->magic) {
+	const header_type* pHeader = (const header_type*)pBase;
+	info.b64Bit = W::b64Bit;
+	info.bBigEndian = B::bBigEndian;
+	info.uHeaderSize = sizeof(header_type);
+	info.uFileType = B::Get(pHeader->filetype);
+	info.uCPUType = B::Get((uint32_t)pHeader->cputype);
+	info.uCPUSubType = B::Get((uint32_t)pHeader->cpusubtype);
+	info.uCommandCount = B::Get(pHeader->ncmds);
+	info.uCommandsSize = B::Get(pHeader->sizeofcmds);
+	if (info.uCommandsSize > uLength - info.uHeaderSize) {
 		return false;
 	}
 
-	m_uFileType = BO(m_pHeader->filetype);
-	m_b64Bit = (MH_MAGIC_64 == m_pHeader->magic || MH_CIGAM_64 == m_pHeader->magic) ? true : false;
-	m_bBigEndian = (MH_CIGAM == m_pHeader->magic || MH_CIGAM_64 == m_pHeader->magic) ? true : false;
-	m_uHeaderSize = m_b64Bit ? sizeof(mach_header_64) : sizeof(mach_header);
+	const uint8_t* pCommands = pBase + info.uHeaderSize;
+	uint32_t uOffset = 0;
+	for (uint32_t i = 0; i < info.uCommandCount; i++) {
+		if (info.uCommandsSize - uOffset < sizeof(load_command)) {
+			return false;
+		}
 
-	uint8_t* pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
-		load_command* plc = (load_command*)pLoadCommand;
-		switch (BO(plc->cmd)) {
-		case LC_SEGMENT:
+		const uint8_t* pLoadCommand = pCommands + uOffset;
+		const load_command* plc = (const load_command*)pLoadCommand;
+		uint32_t uCmd = B::Get(plc->cmd);
+		uint32_t uCmdSize = B::Get(plc->cmdsize);
+		if (uCmdSize < sizeof(load_command) || uCmdSize > info.uCommandsSize - uOffset) {
+			return false;
+		}
+
+		switch (uCmd) {
+		case W::uSegmentCommand:
 		{
-			segment_command* seglc = (segment_command*)pLoadCommand;
-			if (0 == strcmp("__TEXT", seglc->segname)) {
-				s_uExecSegLimit = seglc->vmsize;
-				for (uint32_t j = 0; j < BO(seglc->nsects); j++) {
-					section* sect = (section*)((pLoadCommand + sizeof(segment_command)) + sizeof(section) * j);
-					if (0 == strcmp("__text", sect->sectname)) {
-						if (BO(sect->offset) > (BO(m_pHeader->sizeofcmds) + m_uHeaderSize)) {
-							m_uLoadCommandsFreeSpace = BO(sect->offset) - BO(m_pHeader->sizeofcmds) - m_uHeaderSize;
+			if (uCmdSize < sizeof(segment_type)) {
+				return false;
+			}
+			const segment_type* seglc = (const segment_type*)pLoadCommand;
+			uint32_t uSections = B::Get(seglc->nsects);
+			if ((uint64_t)uSections * sizeof(section_type) > uCmdSize - sizeof(segment_type)) {
+				return false;
+			}
+
+			if (0 == strncmp("__TEXT", seglc->segname, 16)) {
+				info.uExecSegLimit = B::Get(seglc->vmsize);
+				for (uint32_t j = 0; j < uSections; j++) {
+					const section_type* sect = (const section_type*)(pLoadCommand + sizeof(segment_type) + sizeof(section_type) * j);
+					uint32_t uSectOffset = B::Get(sect->offset);
+					uint64_t uSectSize = B::Get(sect->size);
+					if (0 == strncmp("__text", sect->sectname, 16)) {
+						if (uSectOffset > info.uCommandsSize + info.uHeaderSize) {
+							info.uLoadCommandsFreeSpace = uSectOffset - info.uCommandsSize - info.uHeaderSize;
+						}
+					} else if (0 == strncmp("__info_plist", sect->sectname, 16)) {
+						if (uSectOffset <= uLength && uSectSize <= uLength - uSectOffset) {
+							info.uInfoPlistOffset = uSectOffset;
+							info.uInfoPlistSize = (uint32_t)uSectSize;
 						}
-					} else if (0 == strcmp("__info_plist", sect->sectname)) {
-						m_strInfoPlist.append((const char*)m_pBase + BO(sect->offset), BO(sect->size));
 					}
 				}
-			} else if (0 == strcmp("__LINKEDIT", seglc->segname)) {
-				m_pLinkEditSegment = pLoadCommand;
+			} else if (0 == strncmp("__LINKEDIT", seglc->segname, 16)) {
+				info.uLinkEditCommand = info.uHeaderSize + uOffset;
 			}
 		}
 		break;
-		case LC_SEGMENT_64:
+		case LC_ENCRYPTION_INFO:
+		case LC_ENCRYPTION_INFO_64:
 		{
-			segment_command_64* seglc = (segment_command_64*)pLoadCommand;
-			if (0 == strcmp("__TEXT", seglc->segname)) {
-				s_uExecSegLimit = seglc->vmsize;
-				for (uint32_t j = 0; j < BO(seglc->nsects); j++) {
-					section_64* sect = (section_64*)((pLoadCommand + sizeof(segment_command_64)) + sizeof(section_64) * j);
-					if (0 == strcmp("__text", sect->sectname)) {
-						if (BO(sect->offset) > (BO(m_pHeader->sizeofcmds) + m_uHeaderSize)) {
-							m_uLoadCommandsFreeSpace = BO(sect->offset) - BO(m_pHeader->sizeofcmds) - m_uHeaderSize;
-						}
-					} else if (0 == strcmp("__info_plist", sect->sectname)) {
-						m_strInfoPlist.append((const char*)m_pBase + BO(sect->offset), BO((uint32_t)sect->size));
-					}
+			if (uCmdSize >= sizeof(encryption_info_command)) {
+				const encryption_info_command* crypt_cmd = (const encryption_info_command*)pLoadCommand;
+				if (B::Get(crypt_cmd->cryptid) >= 1) {
+					info.bEncrypted = true;
 				}
-			} else if (0 == strcmp("__LINKEDIT", seglc->segname)) {
-				m_pLinkEditSegment = pLoadCommand;
 			}
 		}
 		break;
-		case LC_ENCRYPTION_INFO:
-		case LC_ENCRYPTION_INFO_64:
+		case LC_CODE_SIGNATURE:
 		{
-			encryption_info_command* crypt_cmd = (encryption_info_command*)pLoadCommand;
-			if (BO(crypt_cmd->cryptid) >= 1) {
-				m_bEncrypted = true;
+			if (uCmdSize < sizeof(codesignature_command)) {
+				return false;
+			}
+			const codesignature_command* pcslc = (const codesignature_command*)pLoadCommand;
+			info.uCodeSignCommand = info.uHeaderSize + uOffset;
+			info.uSignOffset = B::Get(pcslc->dataoff);
+			info.uSignSize = B::Get(pcslc->datasize);
+			if (info.uSignOffset > uLength || info.uSignSize > uLength - info.uSignOffset) {
+				return false;
 			}
 		}
 		break;
-		case LC_CODE_SIGNATURE:
+		case LC_UUID:
+		{
+			if (uCmdSize >= sizeof(uuid_command)) {
+				memcpy(info.arrUUID, ((const uuid_command*)pLoadCommand)->uuid, sizeof(info.arrUUID));
+				info.bHasUUID = true;
+			}
+		}
+		break;
+		case LC_VERSION_MIN_MACOSX:
+		case LC_VERSION_MIN_IPHONEOS:
+		case LC_VERSION_MIN_TVOS:
+		case LC_VERSION_MIN_WATCHOS:
+		{
+			if (uCmdSize >= sizeof(version_min_command)) {
+				info.uMinOSCommand = uCmd;
+				info.uMinOS = B::Get(((const version_min_command*)pLoadCommand)->version);
+				switch (uCmd) {
+				case LC_VERSION_MIN_MACOSX:
+					info.uPlatform = PLATFORM_MACOS;
+					break;
+				case LC_VERSION_MIN_IPHONEOS:
+					info.uPlatform = PLATFORM_IOS;
+					break;
+				case LC_VERSION_MIN_TVOS:
+					info.uPlatform = PLATFORM_TVOS;
+					break;
+				default:
+					info.uPlatform = PLATFORM_WATCHOS;
+					break;
+				}
+			}
+		}
+		break;
+		case LC_BUILD_VERSION:
+		{
+			if (uCmdSize >= sizeof(build_version_command)) {
+				const build_version_command* pbvc = (const build_version_command*)pLoadCommand;
+				info.uMinOSCommand = uCmd;
+				info.uPlatform = B::Get(pbvc->platform);
+				info.uMinOS = B::Get(pbvc->minos);
+			}
+		}
+		break;
+		case LC_RPATH:
+		{
+			if (uCmdSize >= sizeof(rpath_command)) {
+				info.arrRPaths.push_back(GetCommandString(pLoadCommand, uCmdSize, B::Get(((const rpath_command*)pLoadCommand)->path)));
+			}
+		}
+		break;
+		case LC_ID_DYLIB:
+		case LC_LOAD_DYLIB:
+		case LC_LOAD_WEAK_DYLIB:
 		{
-			codesignature_command* pcslc = (codesignature_command*)pLoadCommand;
-			m_pCodeSignSegment = pLoadCommand;
-			m_uCodeLength = BO(pcslc->dataoff);
-			m_pSignBase = m_pBase + m_uCodeLength;
-			m_uSignLength = ZSign::GetCodeSignatureLength(m_pSignBase);
+			if (uCmdSize >= sizeof(dylib_command)) {
+				string strDylib = GetCommandString(pLoadCommand, uCmdSize, B::Get(((const dylib_command*)pLoadCommand)->dylib.name.offset));
+				if (LC_ID_DYLIB == uCmd) {
+					info.strInstallName = strDylib;
+				} else {
+					info.arrDylibs.push_back(make_pair(strDylib, (LC_LOAD_WEAK_DYLIB == uCmd)));
+				}
+			}
 		}
 		break;
 		}
 
-		pLoadCommand += BO(plc->cmdsize);
+		uOffset += uCmdSize;
+	}
+
+	return true;
+}
+
+bool ZArchO::Parse(const uint8_t* pBase, uint32_t uLength, ZArchInfo& info)
+{
+	info = ZArchInfo();
+	if (NULL == pBase || uLength < sizeof(uint32_t)) {
+		return false;
+	}
+
+	switch (*((const uint32_t*)pBase)) {
+	case MH_MAGIC:
+		return ParseLoadCommands<ZMachO32Traits, ZByteOrderTraits<false>>(pBase, uLength, info);
+	case MH_CIGAM:
+		return ParseLoadCommands<ZMachO32Traits, ZByteOrderTraits<true>>(pBase, uLength, info);
+	case MH_MAGIC_64:
+		return ParseLoadCommands<ZMachO64Traits, ZByteOrderTraits<false>>(pBase, uLength, info);
+	case MH_CIGAM_64:
+		return ParseLoadCommands<ZMachO64Traits, ZByteOrderTraits<true>>(pBase, uLength, info);
+	}
+	return false;
+}
+
+bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
+{
+	if (NULL == pBase || uLength <= 0) {
+		return false;
+	}
+
+	ZArchInfo info;
+	if (!Parse(pBase, uLength, info)) {
+		return false;
+	}
+
+	m_pBase = pBase;
+	m_uLength = uLength;
+	m_uCodeLength = (uLength % 16 == 0) ? uLength : uLength + 16 - (uLength % 16);
+	m_pHeader = (mach_header*)m_pBase;
+	m_uFileType = info.uFileType;
+	m_b64Bit = info.b64Bit;
+	m_bBigEndian = info.bBigEndian;
+	m_bEncrypted = info.bEncrypted;
+	m_uHeaderSize = info.uHeaderSize;
+	m_uExecSegLimit = info.uExecSegLimit;
+	m_uLoadCommandsFreeSpace = info.uLoadCommandsFreeSpace;
+
+	if (info.uInfoPlistSize > 0) {
+		m_strInfoPlist.assign((const char*)m_pBase + info.uInfoPlistOffset, info.uInfoPlistSize);
+	}
+
+	if (info.uLinkEditCommand > 0) {
+		m_pLinkEditSegment = m_pBase + info.uLinkEditCommand;
+	}
+
+	if (info.uCodeSignCommand > 0) {
+		m_pCodeSignSegment = m_pBase + info.uCodeSignCommand;
+		m_uCodeLength = info.uSignOffset;
+		m_pSignBase = m_pBase + m_uCodeLength;
+		m_uSignLength = (info.uSignSize >= sizeof(CS_SuperBlob)) ? ZSign::GetCodeSignatureLength(m_pSignBase) : 0;
 	}
 
 	return true;
@@ -218,6 +424,37 @@ const char* ZArchO::GetFileType(uint32_t uFileType)
 	return "MH_UNKNOWN";
 }
 
+const char* ZArchO::GetPlatform(uint32_t uPlatform)
+{
+	switch (uPlatform) {
+	case PLATFORM_MACOS:
+		return "macos";
+	case PLATFORM_IOS:
+		return "ios";
+	case PLATFORM_TVOS:
+		return "tvos";
+	case PLATFORM_WATCHOS:
+		return "watchos";
+	case PLATFORM_BRIDGEOS:
+		return "bridgeos";
+	case PLATFORM_MACCATALYST:
+		return "maccatalyst";
+	case PLATFORM_IOSSIMULATOR:
+		return "iossimulator";
+	case PLATFORM_TVOSSIMULATOR:
+		return "tvossimulator";
+	case PLATFORM_WATCHOSSIMULATOR:
+		return "watchossimulator";
+	case PLATFORM_DRIVERKIT:
+		return "driverkit";
+	case PLATFORM_VISIONOS:
+		return "visionos";
+	case PLATFORM_VISIONOSSIMULATOR:
+		return "visionossimulator";
+	}
+	return "unknown";
+}
+
 uint32_t ZArchO::BO(uint32_t uValue)
 {
 	return m_bBigEndian ? LE(uValue) : uValue;
@@ -244,62 +481,51 @@ bool ZArchO::IsSigned() const
 
 void ZArchO::PrintInfo()
 {
-	if (NULL == m_pHeader) {
+	ZArchInfo info;
+	if (NULL == m_pHeader || !Parse(m_pBase, m_uLength, info)) {
 		return;
 	}
 
 	ZLog::Print("------------------------------------------------------------------\n");
 	ZLog::Print(">>> MachO Info: \n");
-	ZLog::PrintV("\tFileType: \t%s\n", GetFileType(BO(m_pHeader->filetype)));
+	ZLog::PrintV("\tFileType: \t%s\n", GetFileType(info.uFileType));
 	ZLog::PrintV("\tTotalSize: \t%u (%s)\n", m_uLength, ZUtil::FormatSize(m_uLength).c_str());
-	ZLog::PrintV("\tPlatform: \t%u\n", m_b64Bit ? 64 : 32);
-	ZLog::PrintV("\tCPUArch: \t%s\n", GetArch(BO(m_pHeader->cputype), BO(m_pHeader->cpusubtype)));
-	ZLog::PrintV("\tCPUType: \t0x%x\n", BO(m_pHeader->cputype));
-	ZLog::PrintV("\tCPUSubType: \t0x%x\n", BO(m_pHeader->cpusubtype));
-	ZLog::PrintV("\tBigEndian: \t%d\n", m_bBigEndian);
-	ZLog::PrintV("\tEncrypted: \t%d\n", m_bEncrypted);
-	ZLog::PrintV("\tCommandCount: \t%d\n", BO(m_pHeader->ncmds));
+	ZLog::PrintV("\tPlatform: \t%u\n", info.b64Bit ? 64 : 32);
+	ZLog::PrintV("\tCPUArch: \t%s\n", GetArch(info.uCPUType, info.uCPUSubType));
+	ZLog::PrintV("\tCPUType: \t0x%x\n", info.uCPUType);
+	ZLog::PrintV("\tCPUSubType: \t0x%x\n", info.uCPUSubType);
+	ZLog::PrintV("\tBigEndian: \t%d\n", info.bBigEndian);
+	ZLog::PrintV("\tEncrypted: \t%d\n", info.bEncrypted);
+	ZLog::PrintV("\tCommandCount: \t%d\n", info.uCommandCount);
 	ZLog::PrintV("\tCodeLength: \t%d (%s)\n", m_uCodeLength, ZUtil::FormatSize(m_uCodeLength).c_str());
 	ZLog::PrintV("\tSignLength: \t%d (%s)\n", m_uSignLength, ZUtil::FormatSize(m_uSignLength).c_str());
 	ZLog::PrintV("\tSpareLength: \t%d (%s)\n", m_uLength - m_uCodeLength - m_uSignLength, ZUtil::FormatSize(m_uLength - m_uCodeLength - m_uSignLength).c_str());
 
-	uint8_t* pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
-		load_command* plc = (load_command*)pLoadCommand;
-		if (LC_VERSION_MIN_IPHONEOS == BO(plc->cmd)) {
-			ZLog::PrintV("\tMIN_IPHONEOS: \t0x%x\n", *((uint32_t*)(pLoadCommand + sizeof(load_command))));
-		} else if (LC_RPATH == BO(plc->cmd)) {
-			ZLog::PrintV("\tLC_RPATH: \t%s\n", (char*)(pLoadCommand + sizeof(load_command) + 4));
-		}
-		pLoadCommand += BO(plc->cmdsize);
+	if (LC_VERSION_MIN_IPHONEOS == info.uMinOSCommand) {
+		ZLog::PrintV("\tMIN_IPHONEOS: \t0x%x\n", info.uMinOS);
+	} else if (LC_BUILD_VERSION == info.uMinOSCommand) {
+		ZLog::PrintV("\tMinOS: \t%s %u.%u.%u\n", GetPlatform(info.uPlatform), info.uMinOS >> 16, (info.uMinOS >> 8) & 0xff, info.uMinOS & 0xff);
+	}
+	for (const string& strRPath : info.arrRPaths) {
+		ZLog::PrintV("\tLC_RPATH: \t%s\n", strRPath.c_str());
 	}
 
 	bool bHasWeakDylib = false;
 	ZLog::PrintV("\tLC_LOAD_DYLIB: \n");
-	pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
-		load_command* plc = (load_command*)pLoadCommand;
-		if (LC_LOAD_DYLIB == BO(plc->cmd)) {
-			dylib_command* dlc = (dylib_command*)pLoadCommand;
-			const char* szDylib = (const char*)(pLoadCommand + BO(dlc->dylib.name.offset));
-			ZLog::PrintV("\t\t\t%s\n", szDylib);
-		} else if (LC_LOAD_WEAK_DYLIB == BO(plc->cmd)) {
+	for (const pair<string, bool>& dylib : info.arrDylibs) {
+		if (dylib.second) {
 			bHasWeakDylib = true;
+		} else {
+			ZLog::PrintV("\t\t\t%s\n", dylib.first.c_str());
 		}
-		pLoadCommand += BO(plc->cmdsize);
 	}
 
 	if (bHasWeakDylib) {
 		ZLog::PrintV("\tLC_LOAD_WEAK_DYLIB: \n");
-		pLoadCommand = m_pBase + m_uHeaderSize;
-		for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
-			load_command* plc = (load_command*)pLoadCommand;
-			if (LC_LOAD_WEAK_DYLIB == BO(plc->cmd)) {
-				dylib_command* dlc = (dylib_command*)pLoadCommand;
-				const char* szDylib = (const char*)(pLoadCommand + BO(dlc->dylib.name.offset));
-				ZLog::PrintV("\t\t\t%s (weak)\n", szDylib);
+		for (const pair<string, bool>& dylib : info.arrDylibs) {
+			if (dylib.second) {
+				ZLog::PrintV("\t\t\t%s (weak)\n", dylib.first.c_str());
 			}
-			pLoadCommand += BO(plc->cmdsize);
 		}
 	}
 
@@ -324,6 +550,99 @@ void ZArchO::PrintInfo()
 	ZLog::Print("------------------------------------------------------------------\n");
 }
 
+void ZArchO::MarkDirty(uint32_t uOffset, uint32_t uSize)
+{
+	if (uSize > 0) {
+		m_arrDirtyRanges.push_back(make_pair(uOffset, uSize));
+	}
+}
+
+// Page hashes of the existing signature. Pages covered by m_arrDirtyRanges are rehashed, the __TEXT
+// pages are always verified and the others spot-checked, on a forced sign additionally at uVerifyRate
+// percent. A forced sign only reuses them when asked to with uVerifyRate. Empty when unusable.
+void ZArchO::GetReusableCodeSlots(bool bForce, uint32_t uVerifyRate, string& strCodeSlots1, string& strCodeSlots256)
+{
+	if (bForce && 0 == uVerifyRate) {
+		ZLog::Debug(">>> CodeSlots: \trehashed (forced)\n");
+		return;
+	}
+
+	uint8_t* pCodeSlots1Data = NULL;
+	uint8_t* pCodeSlots256Data = NULL;
+	uint32_t uCodeSlots1DataLength = 0;
+	uint32_t uCodeSlots256DataLength = 0;
+	ZSign::GetCodeSignatureExistsCodeSlotsData(m_pSignBase, m_uCodeLength, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength);
+
+	set<uint32_t> setDirtyPages;
+	for (const pair<uint32_t, uint32_t>& range : m_arrDirtyRanges) {
+		for (uint32_t i = range.first / 4096; i <= (range.first + range.second - 1) / 4096; i++) {
+			setDirtyPages.insert(i);
+		}
+	}
+
+	// __TEXT starts at file offset 0 and holds all the executable code, a patch there must never slip through
+	uint32_t uExecSegPages = (uint32_t)((m_uExecSegLimit + 4095) / 4096);
+	if (!bForce) {
+		uVerifyRate = 0;
+	}
+	ZSign::ReuseCodeSlots(m_pBase, m_uCodeLength, pCodeSlots1Data, uCodeSlots1DataLength, 20, setDirtyPages, uExecSegPages, uVerifyRate, strCodeSlots1);
+	ZSign::ReuseCodeSlots(m_pBase, m_uCodeLength, pCodeSlots256Data, uCodeSlots256DataLength, 32, setDirtyPages, uExecSegPages, uVerifyRate, strCodeSlots256);
+	ZLog::DebugV(">>> CodeSlots: \t%s (%u dirty pages)\n", !strCodeSlots256.empty() ? "reused" : "rehashed", (uint32_t)setDirtyPages.size());
+}
+
+void ZArchO::BuildSpecialSlots(ZSignAsset* pSignAsset, 
+	const string& strBundleId, 
+	string& strRequirementsSlot, 
+	string& strEntitlementsSlot, 
+	string& strDerEntitlementsSlot)
+{
+	string strEmptyEntitlements = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict/>\n</plist>\n";
+	ZSign::SlotBuildRequirements(strBundleId, pSignAsset->m_strSubjectCN, strRequirementsSlot);
+	ZSign::SlotBuildEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : strEmptyEntitlements, strEntitlementsSlot);
+	ZSign::SlotBuildDerEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : "", strDerEntitlementsSlot);
+}
+
+// Bounds of the superblob BuildCodeSignature produces, known before any page is hashed. Only the
+// special slot count and the CMS are uncertain, everything else is exact.
+void ZArchO::GetCodeSignatureBounds(ZSignAsset* pSignAsset, 
+	const string& strBundleId, 
+	const string& strRequirementsSlot, 
+	const string& strEntitlementsSlot, 
+	const string& strDerEntitlementsSlot, 
+	uint32_t& uMinLength, 
+	uint32_t& uMaxLength)
+{
+	// the entitlements (-5) and requirements (-2) hashes pin the special slot count from below,
+	// Info.plist, CodeResources and the der entitlements may add to it.
+	uint32_t uMinSpecialSlots = !strEntitlementsSlot.empty() ? 5 : (!strRequirementsSlot.empty() ? 2 : 0);
+	uint32_t uMaxSpecialSlots = IsExecute() ? 7 : 5;
+	uint32_t uBlobCount = (pSignAsset->m_bSHA256Only ? 1 : 2) + (pSignAsset->m_bAdhoc ? 0 : 1);
+	uBlobCount += (strRequirementsSlot.empty() ? 0 : 1) + (strEntitlementsSlot.empty() ? 0 : 1) + (strDerEntitlementsSlot.empty() ? 0 : 1);
+	uMinLength = sizeof(CS_SuperBlob) + uBlobCount * sizeof(CS_BlobIndex);
+	uMinLength += (uint32_t)(strRequirementsSlot.size() + strEntitlementsSlot.size() + strDerEntitlementsSlot.size());
+	uMaxLength = uMinLength;
+	uMinLength += ZSign::GetCodeDirectoryLength(m_uCodeLength, 32, uMinSpecialSlots, strBundleId, pSignAsset->m_strTeamId);
+	uMaxLength += ZSign::GetCodeDirectoryLength(m_uCodeLength, 32, uMaxSpecialSlots, strBundleId, pSignAsset->m_strTeamId);
+	if (!pSignAsset->m_bSHA256Only) {
+		uMinLength += ZSign::GetCodeDirectoryLength(m_uCodeLength, 20, uMinSpecialSlots, strBundleId, pSignAsset->m_strTeamId);
+		uMaxLength += ZSign::GetCodeDirectoryLength(m_uCodeLength, 20, uMaxSpecialSlots, strBundleId, pSignAsset->m_strTeamId);
+	}
+	if (!pSignAsset->m_bAdhoc) {
+		uMinLength += 8 + pSignAsset->GetCMSMinLength();
+		uMaxLength += 8 + pSignAsset->GetCMSMaxLength();
+	}
+}
+
+void ZArchO::EstimateCodeSignatureLength(ZSignAsset* pSignAsset, const string& strBundleId, uint32_t& uMinLength, uint32_t& uMaxLength)
+{
+	string strRequirementsSlot;
+	string strEntitlementsSlot;
+	string strDerEntitlementsSlot;
+	BuildSpecialSlots(pSignAsset, strBundleId, strRequirementsSlot, strEntitlementsSlot, strDerEntitlementsSlot);
+	GetCodeSignatureBounds(pSignAsset, strBundleId, strRequirementsSlot, strEntitlementsSlot, strDerEntitlementsSlot, uMinLength, uMaxLength);
+	m_uEstimatedSignLength = uMaxLength;
+}
+
 bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset, 
 	bool bForce, 
 	const string& strBundleId, 
@@ -336,11 +655,7 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 	string strRequirementsSlot;
 	string strEntitlementsSlot;
 	string strDerEntitlementsSlot;
-
-	string strEmptyEntitlements = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict/>\n</plist>\n";
-	ZSign::SlotBuildRequirements(strBundleId, pSignAsset->m_strSubjectCN, strRequirementsSlot);
-	ZSign::SlotBuildEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : strEmptyEntitlements, strEntitlementsSlot);
-	ZSign::SlotBuildDerEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : "", strDerEntitlementsSlot);
+	BuildSpecialSlots(pSignAsset, strBundleId, strRequirementsSlot, strEntitlementsSlot, strDerEntitlementsSlot);
 
 	string strRequirementsSlotSHA1;
 	string strRequirementsSlotSHA256;
@@ -369,13 +684,9 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 		ZSHA::SHA(strDerEntitlementsSlot, strDerEntitlementsSlotSHA1, strDerEntitlementsSlotSHA256);
 	}
 
-	uint8_t* pCodeSlots1Data = NULL;
-	uint8_t* pCodeSlots256Data = NULL;
-	uint32_t uCodeSlots1DataLength = 0;
-	uint32_t uCodeSlots256DataLength = 0;
-	if (!bForce) {
-		ZSign::GetCodeSignatureExistsCodeSlotsData(m_pSignBase, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength);
-	}
+	string strCodeSlots1;
+	string strCodeSlots256;
+	GetReusableCodeSlots(bForce, pSignAsset->m_uVerifyRate, strCodeSlots1, strCodeSlots256);
 
 	uint64_t uExecSegFlags = 0;
 	if (MH_EXECUTE == m_uFileType) {
@@ -389,151 +700,84 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 		uExecSegFlags |= CS_EXECSEG_MAIN_BINARY | CS_EXECSEG_ALLOW_UNSIGNED;
 	}
 
-	string strCodeDirectorySlot;
-	string strAltnateCodeDirectorySlot;
-	if (!pSignAsset->m_bSHA256Only) {
-		ZSign::SlotBuildCodeDirectory(false,
+	// slot order: code directory, requirements, entitlements, der entitlements, alternate code directory, cms
+	uint32_t uCodeSignBlobCount = pSignAsset->m_bSHA256Only ? 1 : 2;
+	uCodeSignBlobCount += strRequirementsSlot.empty() ? 0 : 1;
+	uCodeSignBlobCount += strEntitlementsSlot.empty() ? 0 : 1;
+	uCodeSignBlobCount += strDerEntitlementsSlot.empty() ? 0 : 1;
+	uCodeSignBlobCount += pSignAsset->m_bAdhoc ? 0 : 1; //adhoc remove cms signature slot
+
+	uint32_t uMinLength = 0;
+	uint32_t uMaxLength = 0;
+	GetCodeSignatureBounds(pSignAsset, strBundleId, strRequirementsSlot, strEntitlementsSlot, strDerEntitlementsSlot, uMinLength, uMaxLength);
+	ZSuperBlob superBlob(strOutput, uCodeSignBlobCount, uMaxLength);
+
+	ZCodePageMemo pageMemo;
+	auto buildCodeDirectory = [&](bool bAlternate, uint32_t uSlotType) -> bool {
+		return ZSign::SlotBuildCodeDirectory(bAlternate,
 			m_pBase,
 			m_uCodeLength,
-			pCodeSlots1Data,
-			uCodeSlots1DataLength,
-			s_uExecSegLimit,
+			(uint8_t*)(bAlternate ? strCodeSlots256 : strCodeSlots1).data(),
+			(uint32_t)(bAlternate ? strCodeSlots256 : strCodeSlots1).size(),
+			m_uExecSegLimit,
 			uExecSegFlags,
 			strBundleId,
 			pSignAsset->m_strTeamId,
-			strInfoSHA1,
-			strRequirementsSlotSHA1,
-			strCodeResourcesSHA1,
-			strEntitlementsSlotSHA1,
-			strDerEntitlementsSlotSHA1,
+			bAlternate ? strInfoSHA256 : strInfoSHA1,
+			bAlternate ? strRequirementsSlotSHA256 : strRequirementsSlotSHA1,
+			bAlternate ? strCodeResourcesSHA256 : strCodeResourcesSHA1,
+			bAlternate ? strEntitlementsSlotSHA256 : strEntitlementsSlotSHA1,
+			bAlternate ? strDerEntitlementsSlotSHA256 : strDerEntitlementsSlotSHA1,
 			IsExecute(),
 			pSignAsset->m_bAdhoc,
-			strCodeDirectorySlot);
-	}
-
-	ZSign::SlotBuildCodeDirectory(true,
-		m_pBase,
-		m_uCodeLength,
-		pCodeSlots256Data,
-		uCodeSlots256DataLength,
-		s_uExecSegLimit,
-		uExecSegFlags,
-		strBundleId,
-		pSignAsset->m_strTeamId,
-		strInfoSHA256,
-		strRequirementsSlotSHA256,
-		strCodeResourcesSHA256,
-		strEntitlementsSlotSHA256,
-		strDerEntitlementsSlotSHA256,
-		IsExecute(),
-		pSignAsset->m_bAdhoc,
-		strAltnateCodeDirectorySlot);
-	if (pSignAsset->m_bSHA256Only) {
-		// SHA256-based code directory is usually the alternate; however, make it the primary (and only)
-		// code directory if `m_bUseSHA256Only == true`.
-		strAltnateCodeDirectorySlot.swap(strCodeDirectorySlot);
-	}
-
-	string strCMSSignatureSlot;
-	if (!pSignAsset->m_bAdhoc) { //adhoc remove cms signature slot
-		ZSign::SlotBuildCMSSignature(pSignAsset, strCodeDirectorySlot, strAltnateCodeDirectorySlot, strCMSSignatureSlot);
-	}
-
-	uint32_t uCodeDirectorySlotLength = (uint32_t)strCodeDirectorySlot.size();
-	uint32_t uRequirementsSlotLength = (uint32_t)strRequirementsSlot.size();
-	uint32_t uEntitlementsSlotLength = (uint32_t)strEntitlementsSlot.size();
-	uint32_t uDerEntitlementsLength = (uint32_t)strDerEntitlementsSlot.size();
-	uint32_t uAltnateCodeDirectorySlotLength = (uint32_t)strAltnateCodeDirectorySlot.size();
-	uint32_t uCMSSignatureSlotLength = (uint32_t)strCMSSignatureSlot.size();
-
-	uint32_t uCodeSignBlobCount = 0;
-	uCodeSignBlobCount += (uCodeDirectorySlotLength > 0) ? 1 : 0;
-	uCodeSignBlobCount += (uRequirementsSlotLength > 0) ? 1 : 0;
-	uCodeSignBlobCount += (uEntitlementsSlotLength > 0) ? 1 : 0;
-	uCodeSignBlobCount += (uDerEntitlementsLength > 0) ? 1 : 0;
-	uCodeSignBlobCount += (uAltnateCodeDirectorySlotLength > 0) ? 1 : 0;
-	uCodeSignBlobCount += (uCMSSignatureSlotLength > 0) ? 1 : 0;
-
-	uint32_t uSuperBlobHeaderLength = sizeof(CS_SuperBlob) + uCodeSignBlobCount * sizeof(CS_BlobIndex);
-	uint32_t uCodeSignLength = uSuperBlobHeaderLength +
-		uCodeDirectorySlotLength +
-		uRequirementsSlotLength +
-		uEntitlementsSlotLength +
-		uDerEntitlementsLength +
-		uAltnateCodeDirectorySlotLength +
-		uCMSSignatureSlotLength;
-
-	vector<CS_BlobIndex> arrBlobIndexes;
-	if (uCodeDirectorySlotLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_CODEDIRECTORY);
-		blob.offset = BE(uSuperBlobHeaderLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	if (uRequirementsSlotLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_REQUIREMENTS);
-		blob.offset = BE(uSuperBlobHeaderLength + uCodeDirectorySlotLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	if (uEntitlementsSlotLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_ENTITLEMENTS);
-		blob.offset = BE(uSuperBlobHeaderLength + uCodeDirectorySlotLength + uRequirementsSlotLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	if (uDerEntitlementsLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_DER_ENTITLEMENTS);
-		blob.offset = BE(uSuperBlobHeaderLength + uCodeDirectorySlotLength + uRequirementsSlotLength + uEntitlementsSlotLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	if (uAltnateCodeDirectorySlotLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_ALTERNATE_CODEDIRECTORIES);
-		blob.offset = BE(uSuperBlobHeaderLength + uCodeDirectorySlotLength + uRequirementsSlotLength + uEntitlementsSlotLength + uDerEntitlementsLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	if (uCMSSignatureSlotLength > 0) {
-		CS_BlobIndex blob;
-		blob.type = BE((uint32_t)CSSLOT_SIGNATURESLOT);
-		blob.offset = BE(uSuperBlobHeaderLength + uCodeDirectorySlotLength + uRequirementsSlotLength + uEntitlementsSlotLength + uDerEntitlementsLength + uAltnateCodeDirectorySlotLength);
-		arrBlobIndexes.push_back(blob);
-	}
-
-	CS_SuperBlob superblob;
-	superblob.magic = BE((uint32_t)CSMAGIC_EMBEDDED_SIGNATURE);
-	superblob.length = BE(uCodeSignLength);
-	superblob.count = BE(uCodeSignBlobCount);
-
-	strOutput.clear();
-	strOutput.reserve(uCodeSignLength);
-	strOutput.append((const char*)&superblob, sizeof(superblob));
-	for (size_t i = 0; i < arrBlobIndexes.size(); i++) {
-		CS_BlobIndex& blob = arrBlobIndexes[i];
-		strOutput.append((const char*)&blob, sizeof(blob));
-	}
-	strOutput += strCodeDirectorySlot;
-	strOutput += strRequirementsSlot;
-	strOutput += strEntitlementsSlot;
-	strOutput += strDerEntitlementsSlot;
-	strOutput += strAltnateCodeDirectorySlot;
-	strOutput += strCMSSignatureSlot;
+			&pageMemo,
+			uSlotType,
+			superBlob);
+	};
+
+	// SHA256-based code directory is usually the alternate; however, make it the primary (and only)
+	// code directory if `m_bUseSHA256Only == true`.
+	bool bRet = buildCodeDirectory(pSignAsset->m_bSHA256Only, CSSLOT_CODEDIRECTORY);
+	if (!strRequirementsSlot.empty()) {
+		bRet = bRet && superBlob.AddSlot(CSSLOT_REQUIREMENTS, strRequirementsSlot);
+	}
+	if (!strEntitlementsSlot.empty()) {
+		bRet = bRet && superBlob.AddSlot(CSSLOT_ENTITLEMENTS, strEntitlementsSlot);
+	}
+	if (!strDerEntitlementsSlot.empty()) {
+		bRet = bRet && superBlob.AddSlot(CSSLOT_DER_ENTITLEMENTS, strDerEntitlementsSlot);
+	}
+	if (!pSignAsset->m_bSHA256Only) {
+		bRet = bRet && buildCodeDirectory(true, CSSLOT_ALTERNATE_CODEDIRECTORIES);
+	}
+	if (pageMemo.IsInited()) {
+		ZLog::DebugV(">>> PageMemo: \t%u pages deduplicated (%u zero-filled)\n", pageMemo.GetDedupPages(), pageMemo.GetZeroPages());
+	}
+	if (bRet && !pSignAsset->m_bAdhoc) { // without a cms the slot is left out, as before
+		ZSign::SlotBuildCMSSignature(pSignAsset, superBlob);
+	}
+	if (!bRet || !superBlob.Finish()) {
+		strOutput.clear();
+		return false;
+	}
 
 	if (ZLog::IsDebug()) {
+		uint32_t uCodeDirectorySlotLength = 0;
+		uint32_t uAltnateCodeDirectorySlotLength = 0;
+		uint32_t uCMSSignatureSlotLength = 0;
+		const uint8_t* pCodeDirectorySlot = superBlob.GetSlot(CSSLOT_CODEDIRECTORY, uCodeDirectorySlotLength);
+		const uint8_t* pAltnateCodeDirectorySlot = superBlob.GetSlot(CSSLOT_ALTERNATE_CODEDIRECTORIES, uAltnateCodeDirectorySlotLength);
+		const uint8_t* pCMSSignatureSlot = superBlob.GetSlot(CSSLOT_SIGNATURESLOT, uCMSSignatureSlotLength);
 		ZFile::WriteFile("./.zsign_debug/Requirements.slot.new", strRequirementsSlot);
 		ZFile::WriteFile("./.zsign_debug/Entitlements.slot.new", strEntitlementsSlot);
 		ZFile::WriteFile("./.zsign_debug/Entitlements.der.slot.new", strDerEntitlementsSlot);
 		ZFile::WriteFile("./.zsign_debug/Entitlements.plist.new", strEntitlementsSlot.data() + 8, strEntitlementsSlot.size() - 8);
-		ZFile::WriteFile("./.zsign_debug/CodeDirectory_SHA1.slot.new", strCodeDirectorySlot);
-		ZFile::WriteFile("./.zsign_debug/CodeDirectory_SHA256.slot.new", strAltnateCodeDirectorySlot);
-		ZFile::WriteFile("./.zsign_debug/CMSSignature.slot.new", strCMSSignatureSlot);
-		ZFile::WriteFile("./.zsign_debug/CMSSignature.der.new", strCMSSignatureSlot.data() + 8, strCMSSignatureSlot.size() - 8);
+		ZFile::WriteFile("./.zsign_debug/CodeDirectory_SHA1.slot.new", (const char*)pCodeDirectorySlot, uCodeDirectorySlotLength);
+		ZFile::WriteFile("./.zsign_debug/CodeDirectory_SHA256.slot.new", (const char*)pAltnateCodeDirectorySlot, uAltnateCodeDirectorySlotLength);
+		if (uCMSSignatureSlotLength > 8) {
+			ZFile::WriteFile("./.zsign_debug/CMSSignature.slot.new", (const char*)pCMSSignatureSlot, uCMSSignatureSlotLength);
+			ZFile::WriteFile("./.zsign_debug/CMSSignature.der.new", (const char*)pCMSSignatureSlot + 8, uCMSSignatureSlotLength - 8);
+		}
 		ZFile::WriteFile("./.zsign_debug/CodeSignature.blob.new", strOutput);
 	}
 
@@ -545,25 +789,22 @@ bool ZArchO::Sign(ZSignAsset* pSignAsset,
 					const string& strBundleId, 
 					const string& strInfoSHA1, 
 					const string& strInfoSHA256, 
-					const string& strCodeResourcesData)
+					const string& strCodeResourcesSHA1,
+					const string& strCodeResourcesSHA256,
+					string& strCodeSignBlob)
 {
+	strCodeSignBlob.clear();
 	if (NULL == m_pSignBase) {
 		m_bEnoughSpace = false;
 		ZLog::Warn(">>> Can't find CodeSignature segment!\n");
 		return false;
 	}
 
-	string strCodeResourcesSHA1;
-	string strCodeResourcesSHA256;
-	if (strCodeResourcesData.empty()) {
-		strCodeResourcesSHA1.append(20, 0);
-		strCodeResourcesSHA256.append(32, 0);
+	if (strCodeResourcesSHA1.empty() || strCodeResourcesSHA256.empty()) {
+		BuildCodeSignature(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, string(20, 0), string(32, 0), strCodeSignBlob);
 	} else {
-		ZSHA::SHA(strCodeResourcesData, strCodeResourcesSHA1, strCodeResourcesSHA256);
+		BuildCodeSignature(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256, strCodeSignBlob);
 	}
-
-	string strCodeSignBlob;
-	BuildCodeSignature(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256, strCodeSignBlob);
 	if (strCodeSignBlob.empty()) {
 		ZLog::Error(">>> Build CodeSignature failed!\n");
 		return false;
@@ -572,20 +813,23 @@ bool ZArchO::Sign(ZSignAsset* pSignAsset,
 	int nSpaceLength = (int)m_uLength - (int)m_uCodeLength - (int)strCodeSignBlob.size();
 	if (nSpaceLength < 0) {
 		m_bEnoughSpace = false;
+		m_uEstimatedSignLength = max(m_uEstimatedSignLength, (uint32_t)strCodeSignBlob.size()); // what a realloc has to make room for
 		ZLog::WarnV(">>> No enough CodeSignature space (now: %d, need: %d).\n", (int)m_uLength - (int)m_uCodeLength, (int)strCodeSignBlob.size());
 		return false;
 	}
 
-	memcpy(m_pBase + m_uCodeLength, strCodeSignBlob.data(), strCodeSignBlob.size());
-	//memset(m_pBase + m_uCodeLength + strCodeSignBlob.size(), 0, nSpaceLength);
+	// the caller writes the blob at m_uCodeLength, into the mapping or through the file
 	return true;
 }
 
-uint32_t ZArchO::ReallocCodeSignSpace(const string& strNewFile)
+// grows __LINKEDIT and the LC_CODE_SIGNATURE blob in the load commands only,
+// the caller extends the file to the returned length.
+uint32_t ZArchO::ReallocCodeSignSpace()
 {
-	ZFile::RemoveFile(strNewFile.c_str());
-
 	uint32_t uNewLength = m_uCodeLength + ZUtil::ByteAlign(((m_uCodeLength / 4096) + 1) * (20 + 32), 4096) + 16384; //16K May Be Enough
+	if (m_uCodeLength + m_uEstimatedSignLength > uNewLength) { // large entitlements
+		uNewLength = m_uCodeLength + ZUtil::ByteAlign(m_uEstimatedSignLength, 4096);
+	}
 	if (NULL == m_pLinkEditSegment || uNewLength <= m_uLength) {
 		return 0;
 	}
@@ -627,18 +871,7 @@ uint32_t ZArchO::ReallocCodeSignSpace(const string& strNewFile)
 		m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + sizeof(codesignature_command));
 	}
 	pcslc->datasize = BO(uNewLength - m_uCodeLength);
-
-	if (!ZFile::AppendFile(strNewFile.c_str(), (const char*)m_pBase, m_uLength)) {
-		return 0;
-	}
-
-	string strPadding;
-	strPadding.append(uNewLength - m_uLength, 0);
-	if (!ZFile::AppendFile(strNewFile.c_str(), strPadding)) {
-		ZFile::RemoveFile(strNewFile.c_str());
-		return 0;
-	}
-
+	MarkDirty(0, m_uHeaderSize + BO(m_pHeader->sizeofcmds));
 	return uNewLength;
 }
 
@@ -658,6 +891,7 @@ bool ZArchO::InjectDylib(bool bWeakInject, const char* szDylibFile)
 			if (0 == strcmp(szDylib, szDylibFile)) {
 				if ((bWeakInject && (LC_LOAD_WEAK_DYLIB != uLoadType)) || (!bWeakInject && (LC_LOAD_DYLIB != uLoadType))) {
 					dlc->cmd = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
+					MarkDirty((uint32_t)(pLoadCommand - m_pBase), sizeof(dylib_command));
 					const char* oldLoadType = bWeakInject ? "LC_LOAD_DYLIB" : "LC_LOAD_WEAK_DYLIB";
 					const char* newLoadType = bWeakInject ? "LC_LOAD_WEAK_DYLIB" : "LC_LOAD_DYLIB";
 					ZLog::WarnV(">>>\t\t %s -> %s\n", oldLoadType, newLoadType);
@@ -693,6 +927,7 @@ bool ZArchO::InjectDylib(bool bWeakInject, const char* szDylibFile)
 
 	m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) + 1);
 	m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + uDylibCommandSize);
+	MarkDirty(0, m_uHeaderSize + BO(m_pHeader->sizeofcmds));
 
 	return true;
 }
@@ -739,4 +974,5 @@ void ZArchO::RemoveDylibs(set<string> setDylibs)
 	memset(pLoadCommand, 0, old_load_command_size);
 	memcpy(pLoadCommand, new_load_command_data, new_load_command_size);
 	free(new_load_command_data);
+	MarkDirty(0, m_uHeaderSize + old_load_command_size);
 }
@@ -2,6 +2,38 @@
 #include "mach-o.h"
 #include "openssl.h"
 
+// what zsign reads from the header and load commands of one slice, filled by a single walk
+struct ZArchInfo
+{
+	ZArchInfo();
+
+	bool		b64Bit;
+	bool		bBigEndian;
+	bool		bEncrypted;
+	bool		bHasUUID;
+	uint8_t		arrUUID[16];
+	uint32_t	uFileType;
+	uint32_t	uCPUType;
+	uint32_t	uCPUSubType;
+	uint32_t	uHeaderSize;
+	uint32_t	uCommandCount;
+	uint32_t	uCommandsSize;
+	uint32_t	uLoadCommandsFreeSpace;
+	uint64_t	uExecSegLimit;
+	uint32_t	uMinOSCommand;		// LC_VERSION_MIN_* or LC_BUILD_VERSION, 0 if none
+	uint32_t	uPlatform;			// PLATFORM_*, 0 if unknown
+	uint32_t	uMinOS;				// xxxx.yy.zz nibbles
+	uint32_t	uLinkEditCommand;	// offsets of the load commands from the slice start, 0 if missing
+	uint32_t	uCodeSignCommand;
+	uint32_t	uSignOffset;		// LC_CODE_SIGNATURE dataoff/datasize
+	uint32_t	uSignSize;
+	uint32_t	uInfoPlistOffset;	// __TEXT,__info_plist
+	uint32_t	uInfoPlistSize;
+	string			strInstallName;
+	vector<string>	arrRPaths;
+	vector<pair<string, bool>> arrDylibs; // (path, weak) in load order
+};
+
 class ZArchO
 {
 public:
@@ -9,6 +41,10 @@ public:
 
 public:
 	bool Init(uint8_t* pBase, uint32_t uLength);
+	static bool Parse(const uint8_t* pBase, uint32_t uLength, ZArchInfo& info);
+	static const char* GetFileType(uint32_t uFileType);
+	static const char* GetArch(int cpuType, int cpuSubType);
+	static const char* GetPlatform(uint32_t uPlatform);
 
 public:
 	bool Sign(ZSignAsset* pSignAsset, 
@@ -16,19 +52,34 @@ public:
 				const string& strBundleId, 
 				const string& strInfoSHA1, 
 				const string& strInfoSHA256, 
-				const string& strCodeResourcesData);
+				const string& strCodeResourcesSHA1,
+				const string& strCodeResourcesSHA256,
+				string& strCodeSignBlob);
 
 	void PrintInfo();
 	bool IsExecute();
 	bool IsSigned() const;
 	bool InjectDylib(bool bWeakInject, const char* szDylibFile);
 	void RemoveDylibs(set<string> setDylibs);
-	uint32_t ReallocCodeSignSpace(const string& strNewFile);
+	uint32_t ReallocCodeSignSpace();
+	void EstimateCodeSignatureLength(ZSignAsset* pSignAsset, const string& strBundleId, uint32_t& uMinLength, uint32_t& uMaxLength);
+	void MarkDirty(uint32_t uOffset, uint32_t uSize);
 
 private:
 	uint32_t	BO(uint32_t uVal);
-	const char* GetFileType(uint32_t uFileType);
-	const char* GetArch(int cpuType, int cpuSubType);
+	void		GetReusableCodeSlots(bool bForce, uint32_t uVerifyRate, string& strCodeSlots1, string& strCodeSlots256);
+	void		BuildSpecialSlots(ZSignAsset* pSignAsset, 
+									const string& strBundleId, 
+									string& strRequirementsSlot, 
+									string& strEntitlementsSlot, 
+									string& strDerEntitlementsSlot);
+	void		GetCodeSignatureBounds(ZSignAsset* pSignAsset, 
+										const string& strBundleId, 
+										const string& strRequirementsSlot, 
+										const string& strEntitlementsSlot, 
+										const string& strDerEntitlementsSlot, 
+										uint32_t& uMinLength, 
+										uint32_t& uMaxLength);
 	bool		BuildCodeSignature(ZSignAsset* pSignAsset, 
 									bool bForce, 
 									const string& strBundleId, 
@@ -55,7 +106,7 @@ public:
 	uint32_t		m_uFileType;
 	mach_header*	m_pHeader;
 	uint32_t		m_uHeaderSize;
-
-private:
-	static uint64_t s_uExecSegLimit;
+	uint64_t		m_uExecSegLimit;
+	uint32_t		m_uEstimatedSignLength;
+	vector<pair<uint32_t, uint32_t>> m_arrDirtyRanges; // (offset, size) of bytes changed since the file was opened
 };
@@ -2,6 +2,8 @@
 #include "base64.h"
 #include "common.h"
 #include "macho.h"
+#include "coderes.h"
+#include "pool.h"
 #include "sys/stat.h"
 #include "sys/types.h"
 
@@ -11,6 +13,7 @@ ZBundle::ZBundle()
 	m_bForceSign = false;
 	m_bWeakInject = false;
 	m_bIconsChanged = false;  // NEW: Initialize icon change flag
+	m_bIncremental = false;
 }
 
 bool ZBundle::FindAppFolder(const string& strFolder, string& strAppFolder)
@@ -20,7 +23,7 @@ bool ZBundle::FindAppFolder(const string& strFolder, string& strAppFolder)
 		return true;
 	}
 
-	ZFile::EnumFolder(strFolder.c_str(), true, [&](bool bFolder, const string& strPath) {
+	bool bEnum = m_tree.EnumFolder(strFolder, true, [&](bool bFolder, const string& strPath) {
 		string strName = ZUtil::GetBaseName(strPath.c_str());
 		if ("__MACOSX" == strName) {
 			return true;
@@ -36,17 +39,36 @@ bool ZBundle::FindAppFolder(const string& strFolder, string& strAppFolder)
 		return false;
 	});
 
-	return (!strAppFolder.empty());
+	return (bEnum && !strAppFolder.empty());
+}
+
+const ZBundle::BundleInfo* ZBundle::GetBundleInfo(const string& strFolder)
+{
+	lock_guard<mutex> lock(m_mtxBundleInfo);
+	auto it = m_mapBundleInfo.find(strFolder);
+	if (it != m_mapBundleInfo.end()) {
+		return it->second.bValid ? &it->second : NULL;
+	}
+
+	BundleInfo& info = m_mapBundleInfo[strFolder];
+	info.bValid = false;
+	info.bBinary = false;
+	if (ZFile::ReadFileV(info.strData, "%s/Info.plist", strFolder.c_str()) && info.jvInfo.read_plist(info.strData, NULL, &info.bBinary)) {
+		ZSHA::SHABase64(info.strData, info.strSHA1, info.strSHA256);
+		info.bValid = true;
+		return &info;
+	}
+	return NULL;
 }
 
 bool ZBundle::GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bGetName)
 {
-	string strInfoPlistData;
-	string strInfoPlistPath = strFolder + "/Info.plist";
-	ZFile::ReadFile(strInfoPlistPath.c_str(), strInfoPlistData);
+	const BundleInfo* pInfo = GetBundleInfo(strFolder);
+	if (NULL == pInfo) {
+		return false;
+	}
 
-	jvalue jvInfo;
-	jvInfo.read_plist(strInfoPlistData);
+	const jvalue& jvInfo = pInfo->jvInfo;
 	string strBundleId = jvInfo["CFBundleIdentifier"];
 	string strBundleExe = jvInfo["CFBundleExecutable"];
 	string strBundleVersion = jvInfo["CFBundleVersion"];
@@ -54,15 +76,11 @@ bool ZBundle::GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bG
 		return false;
 	}
 
-	string strInfoSHA1;
-	string strInfoSHA256;
-	ZSHA::SHABase64(strInfoPlistData, strInfoSHA1, strInfoSHA256);
-
 	jvNode["bundle_id"] = strBundleId;
 	jvNode["bundle_version"] = strBundleVersion;
 	jvNode["bundle_executable"] = strBundleExe;
-	jvNode["sha1"] = strInfoSHA1;
-	jvNode["sha256"] = strInfoSHA256;
+	jvNode["sha1"] = pInfo->strSHA1;
+	jvNode["sha256"] = pInfo->strSHA256;
 	if (!jvNode.has("path")) {
 		jvNode["path"] = strFolder.substr(m_strAppFolder.size() + 1);
 	}
@@ -80,48 +98,60 @@ bool ZBundle::GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bG
 
 bool ZBundle::GetObjectsToSign(const string& strFolder, jvalue& jvInfo)
 {
-	vector<string> allBundles;
-	
-	std::function<void(const string&)> findAllBundles = [&](const string& currentPath) {
-		ZFile::EnumFolder(currentPath.c_str(), false, NULL, [&](bool bFolder, const string& strPath) {
-			if (bFolder) {
-				if (ZFile::IsPathSuffix(strPath, ".app") ||
-					ZFile::IsPathSuffix(strPath, ".appex") ||
-					ZFile::IsPathSuffix(strPath, ".framework") ||
-					ZFile::IsPathSuffix(strPath, ".xctest")) {
-					allBundles.push_back(strPath);
-					findAllBundles(strPath);
-				} else {
-					findAllBundles(strPath);
-				}
+	// bundles and loose dylibs in a single pass over the tree
+	vector<string> arrBundles;
+	vector<string> arrDylibs;
+	bool bEnum = m_tree.EnumFolder(strFolder, true, NULL, [&](bool bFolder, const string& strPath) {
+		if (bFolder) {
+			if (m_tree.IsBundle(strPath)) {
+				arrBundles.push_back(strPath);
 			}
-			return false;
-		});
-	};
-	
-	findAllBundles(strFolder);
-	
-	sort(allBundles.begin(), allBundles.end(), [](const string& a, const string& b) {
-		size_t depthA = count(a.begin(), a.end(), '/');
-		size_t depthB = count(b.begin(), b.end(), '/');
-		// deeper paths first
-		return depthA > depthB;
+		} else if (ZFile::IsPathSuffix(strPath, ".dylib")) {
+			arrDylibs.push_back(strPath);
+		}
+		return false;
 	});
-	
-	for (const string& bundlePath : allBundles) {
+	if (!bEnum) {
+		ZLog::ErrorV(">>> Can't enumerate folder! %s\n", strFolder.c_str());
+		return false;
+	}
+
+	// every node lists the dylibs and bundles it directly contains, a bundle without a usable
+	// Info.plist is treated like a plain folder
+	map<string, jvalue> mapNodes;
+	for (const string& strBundle : arrBundles) {
 		jvalue jvNode;
-		if (GetSignFolderInfo(bundlePath, jvNode)) {
-			jvInfo["folders"].push_back(jvNode);
+		if (GetSignFolderInfo(strBundle, jvNode)) {
+			mapNodes[strBundle] = jvNode;
 		}
 	}
-	
-	ZFile::EnumFolder(strFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
-		if (!bFolder && ZFile::IsPathSuffix(strPath, ".dylib")) {
-			jvInfo["files"].push_back(strPath.substr(m_strAppFolder.size() + 1));
+
+	auto GetOwnerNode = [&](const string& strPath) -> jvalue& {
+		for (size_t pos = strPath.rfind('/'); string::npos != pos && pos > strFolder.size(); pos = strPath.rfind('/', pos - 1)) {
+			auto it = mapNodes.find(strPath.substr(0, pos));
+			if (it != mapNodes.end()) {
+				return it->second;
+			}
 		}
-		return false;
+		return jvInfo;
+	};
+
+	for (const string& strDylib : arrDylibs) {
+		GetOwnerNode(strDylib)["files"].push_back(strDylib.substr(m_strAppFolder.size() + 1));
+	}
+
+	// deeper bundles first, so each node is complete before it is copied into its parent
+	stable_sort(arrBundles.begin(), arrBundles.end(), [](const string& a, const string& b) {
+		return count(a.begin(), a.end(), '/') > count(b.begin(), b.end(), '/');
 	});
-	
+
+	for (const string& strBundle : arrBundles) {
+		auto it = mapNodes.find(strBundle);
+		if (it != mapNodes.end()) {
+			GetOwnerNode(strBundle)["folders"].push_back(it->second);
+		}
+	}
+
 	return true;
 }
 
@@ -131,11 +161,11 @@ bool ZBundle::HasIconsChanged(const string& strFolder, const jvalue& jvCachedInf
 	bool bIconsChanged = false;
 
 	// Read current Info.plist to get icon information
-	jvalue jvInfo;
-	if (jvInfo.read_plist_from_file("%s/Info.plist", strFolder.c_str())) {
+	const BundleInfo* pInfo = GetBundleInfo(strFolder);
+	if (NULL != pInfo) {
 		// Get icon files from Info.plist
 		vector<string> iconFiles;
-		GetIconFilesFromPlist(jvInfo, iconFiles);
+		GetIconFilesFromPlist(pInfo->jvInfo, iconFiles);
 
 		// Check if any icon files have changed
 		for (const string& iconFile : iconFiles) {
@@ -345,6 +375,7 @@ bool ZBundle::ForceAssetsCarRegeneration(const string& strFolder)
 	// Always try to remove Assets.car to ensure new icons are used
 	// This forces the system to use the new icon files instead of cached compiled icons
 	if (ZFile::RemoveFile(strAssetsCarPath.c_str())) {
+		m_tree.Remove(strAssetsCarPath);
 		ZLog::PrintV(">>> Removed old Assets.car - new icons will be used\n");
 		return true;
 	} else {
@@ -353,10 +384,10 @@ bool ZBundle::ForceAssetsCarRegeneration(const string& strFolder)
 	}
 }
 
-bool ZBundle::GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes)
+bool ZBundle::GenerateCodeResources(const string& strFolder, string& strCodeResData)
 {
 	set<string> setFiles;
-	ZFile::EnumFolder(strFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
+	bool bEnum = m_tree.EnumFolder(strFolder, true, NULL, [&](bool bFolder, const string& strPath) {
 		if (!bFolder) {
 			string strNode = strPath.substr(strFolder.size() + 1);
 			ZUtil::StringReplace(strNode, "\\", "/");
@@ -364,10 +395,15 @@ bool ZBundle::GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes)
 		}
 		return false;
 	});
+	if (!bEnum) {
+		return false;
+	}
 
-	jvalue jvInfo;
-	jvInfo.read_plist_from_file("%s/Info.plist", strFolder.c_str());
-	string strBundleExe = jvInfo["CFBundleExecutable"];
+	string strBundleExe;
+	const BundleInfo* pInfo = GetBundleInfo(strFolder);
+	if (NULL != pInfo) {
+		strBundleExe = pInfo->jvInfo["CFBundleExecutable"].as_string();
+	}
 
 #ifdef _WIN32
 	iconv ic;
@@ -377,75 +413,181 @@ bool ZBundle::GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes)
 	setFiles.erase("_CodeSignature/CodeResources");
 	setFiles.erase(strBundleExe);
 	
-	jvCodeRes.clear();
-	jvCodeRes["files"] = jvalue(jvalue::E_OBJECT);
-	jvCodeRes["files2"] = jvalue(jvalue::E_OBJECT);
+	// digests are shared job-wide by path relative to the app folder,
+	// so files of nested bundles are only hashed once.
+	string strDigestPrefix;
+	if (strFolder.size() > m_strAppFolder.size()) {
+		strDigestPrefix = strFolder.substr(m_strAppFolder.size() + 1) + "/";
+		ZUtil::StringReplace(strDigestPrefix, "\\", "/");
+	}
 
-	for (string strKey : setFiles) {
-		string strFile = strFolder + "/" + strKey;
-		string strSHA1Base64;
-		string strSHA256Base64;
-		ZSHA::SHABase64File(strFile.c_str(), strSHA1Base64, strSHA256Base64);
+	// collect the sorted file list first, hash the unknown files on the pool,
+	// then emit the records in sorted order.
+	vector<string> arrKeys(setFiles.begin(), setFiles.end());
+	vector<pair<string, string>> arrDigests(arrKeys.size());
+	vector<size_t> arrPending;
+	for (size_t i = 0; i < arrKeys.size(); i++) {
+		if (!GetFileDigest(strDigestPrefix + arrKeys[i], arrDigests[i].first, arrDigests[i].second)) {
+			arrPending.push_back(i);
+		}
+	}
 
+	// files whose size/mtime/inode still match the previous job's manifest keep their digests
+	vector<uint8_t> arrHashed(arrPending.size(), 0);
+	size_t uFailed = 0;
+	bool bHashed = ZThreadPool::ParallelFor(arrPending.size(), [&](size_t n) {
+		size_t i = arrPending[n];
+		string strFile = strFolder + "/" + arrKeys[i];
+		auto itTrusted = m_mapTrustedDigests.find(strDigestPrefix + arrKeys[i]);
+		if (GetManifestDigest(strDigestPrefix + arrKeys[i], strFile, arrDigests[i].first, arrDigests[i].second)) {
+			arrHashed[n] = 2;
+		} else if (itTrusted != m_mapTrustedDigests.end()) { // kept from the ancestor's signature, not recorded
+			arrDigests[i] = itTrusted->second;
+			arrHashed[n] = 3;
+		} else if (ZSHA::SHABase64File(strFile.c_str(), arrDigests[i].first, arrDigests[i].second)) {
+			arrHashed[n] = 1;
+		} else {
+			return false;
+		}
+		return true;
+	}, 0, &uFailed);
+
+	if (!bHashed) {
+		ZLog::ErrorV(">>> Can't hash file! %s/%s\n", strFolder.c_str(), arrKeys[arrPending[uFailed]].c_str());
+		return false;
+	}
+
+	lock_guard<mutex> lock(m_mtxDigests);
+	for (size_t n = 0; n < arrPending.size(); n++) {
+		if (1 == arrHashed[n] || 2 == arrHashed[n]) {
+			size_t i = arrPending[n];
+			m_mapFileDigests[strDigestPrefix + arrKeys[i]] = arrDigests[i];
+		}
+	}
+
+	ZCodeResources codeRes;
+	codeRes.Reserve(arrKeys.size());
+	for (size_t i = 0; i < arrKeys.size(); i++) {
+		string strKey = arrKeys[i];
 #ifdef _WIN32
 		strKey = ic.A2U8(strKey);
 #endif
+		codeRes.AddFile(strKey, arrDigests[i].first, arrDigests[i].second);
+	}
+	codeRes.Write(strCodeResData);
 
-		bool bomit1 = false;
-		bool bomit2 = false;
+	uint32_t uRehashed = (uint32_t)count(arrHashed.begin(), arrHashed.end(), 1);
+	ZLog::DebugV(">>> CodeResources: \t%u files, %u digests reused, %u rehashed\n", (uint32_t)arrKeys.size(), (uint32_t)(arrKeys.size() - uRehashed), uRehashed);
+	return true;
+}
 
-		if (ZFile::IsPathSuffix(strKey, ".lproj/locversion.plist")) {
-			bomit1 = true;
-			bomit2 = true;
-		}
+void ZBundle::SetFileDigest(const string& strFile, const string& strSHA1, const string& strSHA256)
+{
+	jbase64 b64;
+	lock_guard<mutex> lock(m_mtxDigests);
+	pair<string, string>& digest = m_mapFileDigests[strFile];
+	digest.first = b64.encode(strSHA1);
+	digest.second = b64.encode(strSHA256);
+}
 
-		if (ZFile::IsPathSuffix(strKey, ".DS_Store") || "Info.plist" == strKey || "PkgInfo" == strKey) {
-			bomit2 = true;
-		}
+bool ZBundle::GetFileDigest(const string& strFile, string& strSHA1Base64, string& strSHA256Base64)
+{
+	lock_guard<mutex> lock(m_mtxDigests);
+	auto it = m_mapFileDigests.find(strFile);
+	if (it == m_mapFileDigests.end()) {
+		return false;
+	}
+	strSHA1Base64 = it->second.first;
+	strSHA256Base64 = it->second.second;
+	return true;
+}
 
-		if (!bomit1) {
-			if (string::npos != strKey.rfind(".lproj/")) {
-				jvCodeRes["files"][strKey]["hash"] = "data:" + strSHA1Base64;
-				jvCodeRes["files"][strKey]["optional"] = true;
-			} else {
-				jvCodeRes["files"][strKey] = "data:" + strSHA1Base64;
-			}
+bool ZBundle::GetManifestDigest(const string& strFile, const string& strRealFile, string& strSHA1Base64, string& strSHA256Base64) const
+{
+	if (!m_bIncremental) {
+		return false;
+	}
+
+	auto it = m_mapManifest.find(strFile);
+	if (it == m_mapManifest.end()) {
+		return false;
+	}
+
+	int64_t nSize = 0;
+	int64_t nMTime = 0;
+	uint64_t uInode = 0;
+	if (!ZFile::GetFileStat(strRealFile.c_str(), nSize, nMTime, uInode)) {
+		return false;
+	}
+
+	const ManifestEntry& entry = it->second;
+	if (entry.nSize != nSize || entry.nMTime != nMTime || entry.uInode != uInode) {
+		return false;
+	}
+
+	strSHA1Base64 = entry.strSHA1;
+	strSHA256Base64 = entry.strSHA256;
+	return true;
+}
+
+void ZBundle::LoadManifest(const string& strCacheName)
+{
+	m_mapManifest.clear();
+
+	jvalue jvManifest;
+	if (!jvManifest.read_from_file("./.zsign_cache/%s.manifest.json", strCacheName.c_str())) {
+		return;
+	}
+
+	vector<string> arrKeys;
+	jvManifest["files"].get_keys(arrKeys);
+	for (const string& strKey : arrKeys) {
+		jvalue& jvEntry = jvManifest["files"][strKey];
+		ManifestEntry& entry = m_mapManifest[strKey];
+		entry.nSize = jvEntry["size"].as_int64();
+		entry.nMTime = jvEntry["mtime"].as_int64();
+		entry.uInode = (uint64_t)jvEntry["inode"].as_int64();
+		entry.strSHA1 = jvEntry["sha1"].as_string();
+		entry.strSHA256 = jvEntry["sha256"].as_string();
+	}
+}
+
+void ZBundle::SaveManifest(const string& strCacheName)
+{
+	// digests of this job first, then entries from the previous job that are still valid
+	map<string, ManifestEntry> mapManifest;
+	for (auto& it : m_mapFileDigests) {
+		ManifestEntry entry;
+		string strRealFile = m_strAppFolder + "/" + it.first;
+		if (ZFile::GetFileStat(strRealFile.c_str(), entry.nSize, entry.nMTime, entry.uInode)) {
+			entry.strSHA1 = it.second.first;
+			entry.strSHA256 = it.second.second;
+			mapManifest[it.first] = entry;
 		}
+	}
 
-		if (!bomit2) {
-			jvCodeRes["files2"][strKey]["hash"] = "data:" + strSHA1Base64;
-			jvCodeRes["files2"][strKey]["hash2"] = "data:" + strSHA256Base64;
-			if (string::npos != strKey.rfind(".lproj/")) {
-				jvCodeRes["files2"][strKey]["optional"] = true;
+	for (auto& it : m_mapManifest) {
+		if (mapManifest.end() == mapManifest.find(it.first)) {
+			string strSHA1Base64;
+			string strSHA256Base64;
+			string strRealFile = m_strAppFolder + "/" + it.first;
+			if (GetManifestDigest(it.first, strRealFile, strSHA1Base64, strSHA256Base64)) {
+				mapManifest[it.first] = it.second;
 			}
 		}
 	}
 
-	jvCodeRes["rules"]["^.*"] = true;
-	jvCodeRes["rules"]["^.*\\.lproj/"]["optional"] = true;
-	jvCodeRes["rules"]["^.*\\.lproj/"]["weight"] = 1000.0;
-	jvCodeRes["rules"]["^.*\\.lproj/locversion.plist$"]["omit"] = true;
-	jvCodeRes["rules"]["^.*\\.lproj/locversion.plist$"]["weight"] = 1100.0;
-	jvCodeRes["rules"]["^Base\\.lproj/"]["weight"] = 1010.0;
-	jvCodeRes["rules"]["^version.plist$"] = true;
-
-	jvCodeRes["rules2"]["^.*"] = true;
-	jvCodeRes["rules2"][".*\\.dSYM($|/)"]["weight"] = 11.0;
-	jvCodeRes["rules2"]["^(.*/)?\\.DS_Store$"]["omit"] = true;
-	jvCodeRes["rules2"]["^(.*/)?\\.DS_Store$"]["weight"] = 2000.0;
-	jvCodeRes["rules2"]["^.*\\.lproj/"]["optional"] = true;
-	jvCodeRes["rules2"]["^.*\\.lproj/"]["weight"] = 1000.0;
-	jvCodeRes["rules2"]["^.*\\.lproj/locversion.plist$"]["omit"] = true;
-	jvCodeRes["rules2"]["^.*\\.lproj/locversion.plist$"]["weight"] = 1100.0;
-	jvCodeRes["rules2"]["^Base\\.lproj/"]["weight"] = 1010.0;
-	jvCodeRes["rules2"]["^Info\\.plist$"]["omit"] = true;
-	jvCodeRes["rules2"]["^Info\\.plist$"]["weight"] = 20.0;
-	jvCodeRes["rules2"]["^PkgInfo$"]["omit"] = true;
-	jvCodeRes["rules2"]["^PkgInfo$"]["weight"] = 20.0;
-	jvCodeRes["rules2"]["^embedded\\.provisionprofile$"]["weight"] = 20.0;
-	jvCodeRes["rules2"]["^version\\.plist$"]["weight"] = 20.0;
-
-	return true;
+	jvalue jvManifest;
+	jvManifest["files"] = jvalue(jvalue::E_OBJECT);
+	for (auto& it : mapManifest) {
+		jvalue& jvEntry = jvManifest["files"][it.first];
+		jvEntry["size"] = it.second.nSize;
+		jvEntry["mtime"] = it.second.nMTime;
+		jvEntry["inode"] = (int64_t)it.second.uInode;
+		jvEntry["sha1"] = it.second.strSHA1;
+		jvEntry["sha256"] = it.second.strSHA256;
+	}
+	jvManifest.write_to_file("./.zsign_cache/%s.manifest.json", strCacheName.c_str());
 }
 
 void ZBundle::GetChangedFiles(jvalue& jvNode, vector<string>& arrChangedFiles)
@@ -486,37 +628,114 @@ void ZBundle::GetNodeChangedFiles(jvalue& jvNode)
 	}
 }
 
-bool ZBundle::SignNode(jvalue& jvNode)
+void ZBundle::PlanNode(const jvalue& jvNode)
 {
+	// Metadata edits (-b/-n/-r, a new profile or icons) only change the special slots, the entries of the
+	// files they rewrite and the CMS. A binary the previous job signed and nobody touched since keeps its
+	// page hashes, verified like on a cached sign. Every other binary is rehashed on a forced sign.
+	string strFolder = jvNode["path"];
+	BundlePlan& plan = m_mapPlans[strFolder];
+	plan.bResources = m_bForceSign || m_bIconsChanged;
+
+	vector<string> arrBinaries;
 	if (jvNode.has("files")) {
 		for (size_t i = 0; i < jvNode["files"].size(); i++) {
-			string strFile = jvNode["files"][i];
-			ZLog::PrintV(">>> SignFile: \t%s\n", strFile.c_str());
-			ZMachO macho;
-			if (macho.InitV("%s/%s", m_strAppFolder.c_str(), strFile.c_str())) {
-				if (!macho.Sign(m_pSignAsset, m_bForceSign, "", "", "", "")) {
-					return false;
-				}
-			} else {
-				return false;
+			arrBinaries.push_back(jvNode["files"][i]);
+		}
+	}
+	string strBundleExe = jvNode["bundle_executable"];
+	arrBinaries.push_back(("/" == strFolder) ? strBundleExe : (strFolder + "/" + strBundleExe));
+
+	if (plan.bResources) {
+		for (const string& strFile : arrBinaries) {
+			string strSHA1Base64;
+			string strSHA256Base64;
+			if (!GetManifestDigest(strFile, m_strAppFolder + "/" + strFile, strSHA1Base64, strSHA256Base64)) {
+				plan.setRehashFiles.insert(strFile);
 			}
 		}
 	}
-	
+	ZLog::DebugV(">>> Plan: \t%s, CodeResources %s, %u of %u binaries rehashed\n", strFolder.c_str(),
+		plan.bResources ? "regenerated" : "updated", (uint32_t)plan.setRehashFiles.size(), (uint32_t)arrBinaries.size());
+
 	if (jvNode.has("folders")) {
 		for (size_t i = 0; i < jvNode["folders"].size(); i++) {
-			if (!SignNode(jvNode["folders"][i])) {
-				return false;
+			PlanNode(jvNode["folders"][i]);
+		}
+	}
+}
+
+bool ZBundle::SignTree(jvalue& jvRoot)
+{
+	// one task per bundle, each waiting only for the bundles directly nested in it,
+	// so siblings and their subtrees are signed concurrently
+	vector<jvalue*> arrNodes;
+	vector<vector<size_t>> arrDeps;
+	function<size_t(jvalue&)> AddNode = [&](jvalue& jvNode) {
+		vector<size_t> arrChildren;
+		if (jvNode.has("folders")) {
+			for (size_t i = 0; i < jvNode["folders"].size(); i++) {
+				arrChildren.push_back(AddNode(jvNode["folders"][i]));
 			}
 		}
+		arrNodes.push_back(&jvNode);
+		arrDeps.push_back(arrChildren);
+		return arrNodes.size() - 1;
+	};
+	AddNode(jvRoot);
+
+	return ZThreadPool::ParallelGraph(arrDeps, [&](size_t i) {
+		return SignNode(*arrNodes[i]);
+	});
+}
+
+bool ZBundle::SignNode(jvalue& jvNode)
+{
+	string strFolder = jvNode["path"];
+	auto itPlan = m_mapPlans.find(strFolder);
+	if (itPlan == m_mapPlans.end()) {
+		ZLog::ErrorV(">>> Bundle wasn't planned! %s\n", strFolder.c_str());
+		return false;
 	}
+	const BundlePlan& plan = itPlan->second;
 
+	if (jvNode.has("files")) {
+		// loose dylibs don't depend on each other, the first failing one (by list order) is reported
+		const jvalue& jvFiles = jvNode["files"];
+		size_t uFailed = 0;
+		bool bSigned = ZThreadPool::ParallelFor(jvFiles.size(), [&](size_t i) {
+			string strFile = jvFiles[i];
+			ZLog::PrintV(">>> SignFile: \t%s\n", strFile.c_str());
+			ZMachO macho;
+			ZSHAHasher hasher;
+			if (!macho.InitV("%s/%s", m_strAppFolder.c_str(), strFile.c_str())) {
+				return false;
+			}
+
+			if (!macho.Sign(m_pSignAsset, plan.setRehashFiles.count(strFile) > 0, "", "", "", "", "", &hasher)) {
+				return false;
+			}
+
+			string strFileSHA1;
+			string strFileSHA256;
+			hasher.Final(strFileSHA1, strFileSHA256);
+			SetFileDigest(strFile, strFileSHA1, strFileSHA256);
+			return true;
+		}, 0, &uFailed);
+
+		if (!bSigned) {
+			ZLog::ErrorV(">>> SignFile failed! %s\n", jvFiles[uFailed].as_cstr());
+			return false;
+		}
+	}
+	
 	jbase64 b64;
 	string strInfoSHA1;
 	string strInfoSHA256;
-	string strFolder = jvNode["path"];
 	string strBundleId = jvNode["bundle_id"];
 	string strBundleExe = jvNode["bundle_executable"];
+	string strExeKey = ("/" == strFolder) ? strBundleExe : (strFolder + "/" + strBundleExe);
+	string strCodeResKey = ("/" == strFolder) ? "_CodeSignature/CodeResources" : (strFolder + "/_CodeSignature/CodeResources");
 	b64.decode(jvNode["sha1"].as_cstr(), strInfoSHA1);
 	b64.decode(jvNode["sha256"].as_cstr(), strInfoSHA256);
 	if (strBundleId.empty() || strBundleExe.empty() || strInfoSHA1.empty() ||
@@ -546,17 +765,19 @@ bool ZBundle::SignNode(jvalue& jvNode)
 	}
 
 	ZFile::CreateFolderV("%s/_CodeSignature", strBaseFolder.c_str());
+	m_tree.AddFolder(strBaseFolder + "/_CodeSignature");
 	string strCodeResFile = strBaseFolder + "/_CodeSignature/CodeResources";
 
 	jvalue jvCodeRes;
-	bool bForceRegenerate = m_bForceSign || m_bIconsChanged;  // Force regenerate if icons changed globally
+	string strCodeResData;
+	bool bForceRegenerate = plan.bResources;  // Force regenerate if icons changed globally
 	
 	if (!bForceRegenerate) {
 		jvCodeRes.read_plist_from_file(strCodeResFile.c_str());
 	}
 
 	if (bForceRegenerate || jvCodeRes.is_null()) { // create/regenerate
-		if (!GenerateCodeResources(strBaseFolder, jvCodeRes)) {
+		if (!GenerateCodeResources(strBaseFolder, strCodeResData)) {
 			ZLog::ErrorV(">>> Create CodeResources failed! %s\n", strBaseFolder.c_str());
 			return false;
 		}
@@ -566,18 +787,25 @@ bool ZBundle::SignNode(jvalue& jvNode)
 			string strFile = jvNode["changed"][i].as_cstr();
 			string strRealFile = m_strAppFolder + "/" + strFile;
 
-			string strFileSHA1;
-			string strFileSHA256;
-			if (!ZSHA::SHABase64File(strRealFile.c_str(), strFileSHA1, strFileSHA256)) {
-				ZLog::ErrorV(">>> Can't get changed file SHASum! %s", strFile.c_str());
-				return false;
-			}
-
 			string strKey = strFile;
 			if ("/" != strFolder) {
 				strKey = strFile.substr(strFolder.size() + 1);
 			}
 
+			string strFileSHA1;
+			string strFileSHA256;
+			if (!GetFileDigest(strFile, strFileSHA1, strFileSHA256)) { // not produced by us, read it back
+				if (!ZFile::IsFileExists(strRealFile.c_str())) { // e.g. no profile on an ad-hoc sign
+					jvCodeRes["files"].erase(strKey.c_str());
+					jvCodeRes["files2"].erase(strKey.c_str());
+					continue;
+				}
+				if (!ZSHA::SHABase64File(strRealFile.c_str(), strFileSHA1, strFileSHA256)) {
+					ZLog::ErrorV(">>> Can't get changed file SHASum! %s\n", strFile.c_str());
+					return false;
+				}
+			}
+
 			jvCodeRes["files"][strKey] = "data:" + strFileSHA1;
 			jvCodeRes["files2"][strKey]["hash"] = "data:" + strFileSHA1;
 			jvCodeRes["files2"][strKey]["hash2"] = "data:" + strFileSHA256;
@@ -586,33 +814,41 @@ bool ZBundle::SignNode(jvalue& jvNode)
 		}
 	}
 
-	string strCodeResData;
-	jvCodeRes.style_write_plist(strCodeResData);
-	if (!ZFile::WriteFile(strCodeResFile.c_str(), strCodeResData)) {
+	string strCodeResSHA1;
+	string strCodeResSHA256;
+	if (strCodeResData.empty()) { // existing CodeResources, possibly updated
+		jvCodeRes.style_write_plist(strCodeResData);
+	}
+	if (!ZSHA::SHAWriteFile(strCodeResFile.c_str(), strCodeResData, strCodeResSHA1, strCodeResSHA256)) {
 		ZLog::ErrorV("\tWriting CodeResources failed! %s\n", strCodeResFile.c_str());
 		return false;
 	}
+	SetFileDigest(strCodeResKey, strCodeResSHA1, strCodeResSHA256);
+	m_tree.AddFile(strCodeResFile);
 
-	bool bForceSign = m_bForceSign || bForceRegenerate;
-	if ("/" == strFolder) { // inject dylib
+	bool bForceSign = (plan.setRehashFiles.count(strExeKey) > 0) && !IsSubBundleAncestor(strFolder);
+	if ("/" == strFolder) { // inject dylib, a planned reuse only rehashes the load commands it rewrites
 		for (const string& strDylibFile : m_arrInjectDylibs) {
-			if (macho.InjectDylib(m_bWeakInject, strDylibFile.c_str())) {
-				bForceSign = true;
-			}
+			macho.InjectDylib(m_bWeakInject, strDylibFile.c_str());
 		}
 	}
 
-	if (!macho.Sign(m_pSignAsset, bForceSign, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResData)) {
+	ZSHAHasher hasher;
+	if (!macho.Sign(m_pSignAsset, bForceSign, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResSHA1, strCodeResSHA256, &hasher)) {
 		return false;
 	}
 
+	string strExeSHA1;
+	string strExeSHA256;
+	hasher.Final(strExeSHA1, strExeSHA256);
+	SetFileDigest(strExeKey, strExeSHA1, strExeSHA256);
 	return true;
 }
 
-bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string& strNewBundleId)
+bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string& strNewBundleId, vector<PlistRewrite>& arrRewrites)
 {
 	vector<string> arrFolders;
-	ZFile::EnumFolder(m_strAppFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
+	bool bEnum = m_tree.EnumFolder(m_strAppFolder, true, NULL, [&](bool bFolder, const string& strPath) {
 		if (bFolder) {
 			if (ZFile::IsPathSuffix(strPath, ".app") || ZFile::IsPathSuffix(strPath, ".appex")) {
 				arrFolders.push_back(strPath);
@@ -620,18 +856,31 @@ bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string&
 		}
 		return false;
 	});
+	if (!bEnum) {
+		ZLog::ErrorV(">>> Can't enumerate plugins! %s\n", m_strAppFolder.c_str());
+		return false;
+	}
 
 	for (const string& strFolder: arrFolders) {
-		jvalue jvInfo;
-		if (!jvInfo.read_plist_from_file("%s/Info.plist", strFolder.c_str())) {
+		const BundleInfo* pInfo = GetBundleInfo(strFolder);
+		if (NULL == pInfo) {
 			ZLog::WarnV(">>> Can't find Plugin's Info.plist! %s\n", strFolder.c_str());
 			continue;
 		}
 
+		PlistRewrite rewrite;
+		rewrite.strFile = strFolder + "/Info.plist";
+		rewrite.strBundleFolder = strFolder;
+		rewrite.bBinary = pInfo->bBinary;
+		rewrite.jvData = pInfo->jvInfo;
+		jvalue& jvInfo = rewrite.jvData;
+		bool bChanged = false;
+
 		string strOldPIBundleID = jvInfo["CFBundleIdentifier"];
 		string strNewPIBundleID = strOldPIBundleID;
 		ZUtil::StringReplace(strNewPIBundleID, strOldBundleId, strNewBundleId);
 		jvInfo["CFBundleIdentifier"] = strNewPIBundleID;
+		bChanged |= (strOldPIBundleID != strNewPIBundleID);
 		ZLog::PrintV(">>> BundleId: \t%s -> %s, Plugin\n", strOldPIBundleID.c_str(), strNewPIBundleID.c_str());
 
 		if (jvInfo.has("WKCompanionAppBundleIdentifier")) {
@@ -639,6 +888,7 @@ bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string&
 			string strNewWKCBundleID = strOldWKCBundleID;
 			ZUtil::StringReplace(strNewWKCBundleID, strOldBundleId, strNewBundleId);
 			jvInfo["WKCompanionAppBundleIdentifier"] = strNewWKCBundleID;
+			bChanged |= (strOldWKCBundleID != strNewWKCBundleID);
 			ZLog::PrintV(">>> BundleId: \t%s -> %s, Plugin-WKCompanionAppBundleIdentifier\n", strOldWKCBundleID.c_str(), strNewWKCBundleID.c_str());
 		}
 
@@ -649,30 +899,91 @@ bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string&
 					string strNewWKBundleID = strOldWKBundleID;
 					ZUtil::StringReplace(strNewWKBundleID, strOldBundleId, strNewBundleId);
 					jvInfo["NSExtension"]["NSExtensionAttributes"]["WKAppBundleIdentifier"] = strNewWKBundleID;
+					bChanged |= (strOldWKBundleID != strNewWKBundleID);
 					ZLog::PrintV(">>> BundleId: \t%s -> %s, NSExtension-NSExtensionAttributes-WKAppBundleIdentifier\n", strOldWKBundleID.c_str(), strNewWKBundleID.c_str());
 				}
 			}
 		}
 
-		jvInfo.style_write_plist_to_file("%s/Info.plist", strFolder.c_str());
+		if (bChanged) {
+			arrRewrites.push_back(rewrite);
+		}
 	}
+	return true;
+}
 
+bool ZBundle::ApplyPlistRewrites(vector<PlistRewrite>& arrRewrites)
+{
+	// every plist is independent, digests go to the job's table so they are not read back for CodeResources
+	size_t uFailed = 0;
+	bool bWritten = ZThreadPool::ParallelFor(arrRewrites.size(), [&](size_t i) {
+		PlistRewrite& rewrite = arrRewrites[i];
+		string strData;
+		if (rewrite.bBinary) {
+			if (!rewrite.jvData.write_bplist(strData)) {
+				return false;
+			}
+		} else {
+			rewrite.jvData.style_write_plist(strData);
+		}
+
+		string strSHA1;
+		string strSHA256;
+		if (!ZSHA::SHAWriteFile(rewrite.strFile.c_str(), strData, strSHA1, strSHA256)) {
+			return false;
+		}
+		m_tree.AddFile(rewrite.strFile);
+
+		string strKey = rewrite.strFile.substr(m_strAppFolder.size() + 1);
+		ZUtil::StringReplace(strKey, "\\", "/");
+		SetFileDigest(strKey, strSHA1, strSHA256);
+		ZLog::DebugV(">>> Rewritten: \t%s (%s)\n", strKey.c_str(), rewrite.bBinary ? "binary" : "xml");
+
+		if (!rewrite.strBundleFolder.empty()) {
+			jbase64 b64;
+			lock_guard<mutex> lock(m_mtxBundleInfo);
+			BundleInfo& info = m_mapBundleInfo[rewrite.strBundleFolder];
+			info.bValid = true;
+			info.bBinary = rewrite.bBinary;
+			info.jvInfo = rewrite.jvData;
+			info.strData.swap(strData);
+			info.strSHA1 = b64.encode(strSHA1);
+			info.strSHA256 = b64.encode(strSHA256);
+		}
+		return true;
+	}, 0, &uFailed);
+
+	if (!bWritten) {
+		ZLog::ErrorV(">>> Can't write plist! %s\n", arrRewrites[uFailed].strFile.c_str());
+		return false;
+	}
 	return true;
 }
 
 bool ZBundle::ModifyBundleInfo(const string& strBundleId, const string& strBundleVersion, const string& strDisplayName)
 {
-	jvalue jvInfo;
-	if (!jvInfo.read_plist_from_file("%s/Info.plist", m_strAppFolder.c_str())) {
+	// all edits are collected into one rewrite plan first, then the plists are written concurrently
+	const BundleInfo* pInfo = GetBundleInfo(m_strAppFolder);
+	if (NULL == pInfo) {
 		ZLog::ErrorV(">>> Can't find app's Info.plist! %s\n", m_strAppFolder.c_str());
 		return false;
 	}
 
+	vector<PlistRewrite> arrRewrites;
+	PlistRewrite rewrite;
+	rewrite.strFile = m_strAppFolder + "/Info.plist";
+	rewrite.strBundleFolder = m_strAppFolder;
+	rewrite.bBinary = pInfo->bBinary;
+	rewrite.jvData = pInfo->jvInfo;
+	jvalue& jvInfo = rewrite.jvData;
+
 	if (!strBundleId.empty()) {
 		string strOldBundleId = jvInfo["CFBundleIdentifier"];
 		jvInfo["CFBundleIdentifier"] = strBundleId;
 		ZLog::PrintV(">>> BundleId: \t%s -> %s\n", strOldBundleId.c_str(), strBundleId.c_str());
-		ModifyPluginsBundleId(strOldBundleId, strBundleId);
+		if (!ModifyPluginsBundleId(strOldBundleId, strBundleId, arrRewrites)) {
+			return false;
+		}
 	}
 
 	if (!strDisplayName.empty()) {
@@ -692,18 +1003,17 @@ bool ZBundle::ModifyBundleInfo(const string& strBundleId, const string& strBundl
 		jvInfo["CFBundleName"] = strNewDisplayName;
 		jvInfo["CFBundleDisplayName"] = strNewDisplayName;
 
-		jvalue jvInfoStrings;
-		if (jvInfoStrings.read_plist_from_file("%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str())) {
-			jvInfoStrings["CFBundleName"] = strNewDisplayName;
-			jvInfoStrings["CFBundleDisplayName"] = strNewDisplayName;
-			jvInfoStrings.style_write_plist_to_file("%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str());
-		}
-
-		jvInfoStrings.clear();
-		if (jvInfoStrings.read_plist_from_file("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str())) {
-			jvInfoStrings["CFBundleName"] = strNewDisplayName;
-			jvInfoStrings["CFBundleDisplayName"] = strNewDisplayName;
-			jvInfoStrings.style_write_plist_to_file("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str());
+		const char* arrStringsFiles[] = { "zh_CN.lproj/InfoPlist.strings", "zh-Hans.lproj/InfoPlist.strings" };
+		for (const char* szStringsFile : arrStringsFiles) {
+			string strData;
+			PlistRewrite rewriteStrings;
+			rewriteStrings.strFile = m_strAppFolder + "/" + szStringsFile;
+			rewriteStrings.bBinary = false;
+			if (ZFile::ReadFile(rewriteStrings.strFile.c_str(), strData) && rewriteStrings.jvData.read_plist(strData, NULL, &rewriteStrings.bBinary)) {
+				rewriteStrings.jvData["CFBundleName"] = strNewDisplayName;
+				rewriteStrings.jvData["CFBundleDisplayName"] = strNewDisplayName;
+				arrRewrites.push_back(rewriteStrings);
+			}
 		}
 
 #ifdef _WIN32
@@ -721,7 +1031,117 @@ bool ZBundle::ModifyBundleInfo(const string& strBundleId, const string& strBundl
 		ZLog::PrintV(">>> BundleVersion: %s -> %s\n", strOldBundleVersion.c_str(), strBundleVersion.c_str());
 	}
 
-	jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str());
+	arrRewrites.push_back(rewrite);
+	return ApplyPlistRewrites(arrRewrites);
+}
+
+bool ZBundle::IsSubBundleAncestor(const string& strFolder) const
+{
+	if (m_strSubBundle.empty()) {
+		return false;
+	}
+	return ("/" == strFolder) || (m_strSubBundle.size() > strFolder.size() && 0 == m_strSubBundle.compare(0, strFolder.size(), strFolder) && '/' == m_strSubBundle[strFolder.size()]);
+}
+
+void ZBundle::LoadTrustedDigests(const string& strFolder)
+{
+	jvalue jvCodeRes;
+	string strBaseFolder = ("/" == strFolder) ? m_strAppFolder : (m_strAppFolder + "/" + strFolder);
+	if (!jvCodeRes.read_plist_from_file("%s/_CodeSignature/CodeResources", strBaseFolder.c_str())) {
+		ZLog::WarnV(">>> Can't read CodeResources, its files will be rehashed! %s\n", strBaseFolder.c_str());
+		return;
+	}
+
+	string strPrefix = ("/" == strFolder) ? "" : (strFolder + "/");
+	string strSubBundlePrefix = m_strSubBundle + "/";
+	vector<string> arrKeys;
+	jvCodeRes["files2"].get_keys(arrKeys);
+	for (const string& strKey : arrKeys) {
+		string strFile = strPrefix + strKey;
+		if (0 == strFile.compare(0, strSubBundlePrefix.size(), strSubBundlePrefix)) {
+			continue;
+		}
+
+		jvalue& jvEntry = jvCodeRes["files2"][strKey];
+		string strSHA1 = jvEntry["hash"].as_string();
+		string strSHA256 = jvEntry["hash2"].as_string();
+		if (0 == strSHA1.find("data:") && 0 == strSHA256.find("data:")) {
+			m_mapTrustedDigests.insert(make_pair(strFile, make_pair(strSHA1.substr(5), strSHA256.substr(5))));
+		}
+	}
+}
+
+bool ZBundle::SignSubBundle(const string& strSubBundle, bool bEnableCache)
+{
+	// Only the named bundle and the bundles nested in it are signed. Its ancestors get their CodeResources
+	// regenerated with the digests they already list for everything outside of it, and keep their code slots,
+	// so only their special slots and CMS change. Every other bundle is left as it is.
+	m_strSubBundle = strSubBundle;
+	ZUtil::StringReplace(m_strSubBundle, "\\", "/");
+	while (!m_strSubBundle.empty() && '/' == m_strSubBundle.back()) {
+		m_strSubBundle.pop_back();
+	}
+	if (0 == m_strSubBundle.compare(0, 2, "./")) {
+		m_strSubBundle = m_strSubBundle.substr(2);
+	}
+
+	string strSubFolder = m_strAppFolder + "/" + m_strSubBundle;
+	jvalue jvSubNode;
+	if (m_strSubBundle.empty() || !m_tree.IsBundle(strSubFolder) || !GetSignFolderInfo(strSubFolder, jvSubNode)) {
+		ZLog::ErrorV(">>> Invalid sub-bundle! %s\n", strSubBundle.c_str());
+		return false;
+	}
+
+	string strCacheName;
+	ZSHA::SHA1Text(m_strAppFolder, strCacheName);
+	m_bIncremental = bEnableCache && !m_bForceSign;
+	if (m_bIncremental) {
+		LoadManifest(strCacheName);
+	}
+	m_bForceSign = true;
+
+	jvalue jvRoot;
+	jvRoot["path"] = "/";
+	jvRoot["root"] = m_strAppFolder;
+	if (!GetSignFolderInfo(m_strAppFolder, jvRoot, true)) {
+		ZLog::ErrorV(">>> Can't get BundleID, BundleVersion, or BundleExecute in Info.plist! %s\n", m_strAppFolder.c_str());
+		return false;
+	}
+
+	// the sub-bundle with everything nested in it, under the chain of its ancestors
+	if (!GetObjectsToSign(strSubFolder, jvSubNode)) {
+		return false;
+	}
+
+	LoadTrustedDigests("/");
+	for (size_t pos = m_strSubBundle.rfind('/'); string::npos != pos && pos > 0; pos = m_strSubBundle.rfind('/', pos - 1)) {
+		string strFolder = m_strSubBundle.substr(0, pos);
+		jvalue jvNode;
+		if (m_tree.IsBundle(m_strAppFolder + "/" + strFolder) && GetSignFolderInfo(m_strAppFolder + "/" + strFolder, jvNode)) {
+			LoadTrustedDigests(strFolder);
+			jvNode["folders"].push_back(jvSubNode);
+			jvSubNode = jvNode;
+		}
+	}
+	jvRoot["folders"].push_back(jvSubNode);
+
+	PlanNode(jvRoot);
+
+	ZLog::PrintV(">>> Signing: \t%s ...\n", m_strAppFolder.c_str());
+	ZLog::PrintV(">>> SubBundle: \t%s\n", m_strSubBundle.c_str());
+	ZLog::PrintV(">>> BundleId: \t%s\n", jvSubNode["bundle_id"].as_cstr());
+	ZLog::PrintV(">>> TeamId: \t%s\n", m_pSignAsset->m_strTeamId.c_str());
+	ZLog::PrintV(">>> SubjectCN: \t%s\n", m_pSignAsset->m_strSubjectCN.c_str());
+
+	if (!SignTree(jvRoot)) {
+		return false;
+	}
+
+	if (bEnableCache) { // the cached bundle list no longer matches, the next folder job rebuilds it
+		ZFile::CreateFolder("./.zsign_cache");
+		ZFile::RemoveFileV("./.zsign_cache/%s.json", strCacheName.c_str());
+		SaveManifest(strCacheName);
+	}
 	return true;
 }
 
@@ -731,6 +1151,7 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 							const string& strBundleVersion,
 							const string& strDisplayName,
 							const vector<string>& arrInjectDylibs,
+							const string& strSubBundle,
 							bool bForce,
 							bool bWeakInject,
 							bool bEnableCache)
@@ -742,11 +1163,24 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		return false;
 	}
 
+	if (!m_tree.Scan(strFolder)) {
+		ZLog::ErrorV(">>> Can't scan folder! %s\n", strFolder.c_str());
+		return false;
+	}
+
 	if (!FindAppFolder(strFolder, m_strAppFolder)) {
 		ZLog::ErrorV(">>> Can't find app folder! %s\n", strFolder.c_str());
 		return false;
 	}
 
+	if (!strSubBundle.empty()) {
+		if (!strBundleId.empty() || !strDisplayName.empty() || !strBundleVersion.empty() || !arrInjectDylibs.empty()) {
+			ZLog::ErrorV(">>> Can't change bundle info or inject dylibs when signing a sub-bundle!\n");
+			return false;
+		}
+		return SignSubBundle(strSubBundle, bEnableCache);
+	}
+
 	if (!strBundleId.empty() || !strDisplayName.empty() || !strBundleVersion.empty()) {
 		m_bForceSign = true;
 		if (!ModifyBundleInfo(strBundleId, strBundleVersion, strDisplayName)) {
@@ -754,12 +1188,18 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		}
 	}
 
-	ZFile::RemoveFileV("%s/embedded.mobileprovision", m_strAppFolder.c_str());
+	string strProvFile = m_strAppFolder + "/embedded.mobileprovision";
+	ZFile::RemoveFile(strProvFile.c_str());
+	m_tree.Remove(strProvFile);
 	if (!pSignAsset->m_strProvData.empty()) {
-		if (!ZFile::WriteFileV(pSignAsset->m_strProvData, "%s/embedded.mobileprovision", m_strAppFolder.c_str())) { // embedded.mobileprovision
+		string strProvSHA1;
+		string strProvSHA256;
+		if (!ZSHA::SHAWriteFile(strProvFile.c_str(), pSignAsset->m_strProvData, strProvSHA1, strProvSHA256)) { // embedded.mobileprovision
 			ZLog::ErrorV(">>> Can't write embedded.mobileprovision!\n");
 			return false;
 		}
+		SetFileDigest("embedded.mobileprovision", strProvSHA1, strProvSHA256);
+		m_tree.AddFile(strProvFile);
 	}
 
 	if (!arrInjectDylibs.empty()) {
@@ -767,6 +1207,7 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		for (const string& strDylibFile : arrInjectDylibs) {
 			string strFileName = ZUtil::GetBaseName(strDylibFile.c_str());
 			if (ZFile::CopyFileV(strDylibFile.c_str(), "%s/%s", m_strAppFolder.c_str(), strFileName.c_str())) {
+				m_tree.AddFile(m_strAppFolder + "/" + strFileName);
 				m_arrInjectDylibs.push_back("@executable_path/" + strFileName);
 			}
 		}
@@ -774,6 +1215,13 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 
 	string strCacheName;
 	ZSHA::SHA1Text(m_strAppFolder, strCacheName);
+
+	// an explicit -f (or a freshly extracted ipa) always rehashes everything
+	m_bIncremental = bEnableCache && !bForce;
+	if (m_bIncremental) {
+		LoadManifest(strCacheName);
+	}
+
 	if (!ZFile::IsFileExistsV("./.zsign_cache/%s.json", strCacheName.c_str())) {
 		m_bForceSign = true;
 	}
@@ -801,20 +1249,18 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		bIconsChanged = true;
 	}
 
-	if (m_bForceSign) {
-		jvRoot["path"] = "/";
-		jvRoot["root"] = m_strAppFolder;
-		if (!GetSignFolderInfo(m_strAppFolder, jvRoot, true)) {
-			ZLog::ErrorV(">>> Can't get BundleID, BundleVersion, or BundleExecute in Info.plist! %s\n", m_strAppFolder.c_str());
-			return false;
-		}
-		if (!GetObjectsToSign(m_strAppFolder, jvRoot)) {
-			return false;
-		}
-		GetNodeChangedFiles(jvRoot);
-	} else {
-		jvRoot.read_from_file("./.zsign_cache/%s.json", strCacheName.c_str());
+	// the bundle tree is always taken from the scan, a cached one misses bundles added since and
+	// older caches list every nested bundle flat under the root
+	jvRoot["path"] = "/";
+	jvRoot["root"] = m_strAppFolder;
+	if (!GetSignFolderInfo(m_strAppFolder, jvRoot, true)) {
+		ZLog::ErrorV(">>> Can't get BundleID, BundleVersion, or BundleExecute in Info.plist! %s\n", m_strAppFolder.c_str());
+		return false;
+	}
+	if (!GetObjectsToSign(m_strAppFolder, jvRoot)) {
+		return false;
 	}
+	GetNodeChangedFiles(jvRoot);
 
 	string strAppName = jvRoot["name"];
 
@@ -838,6 +1284,8 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 	string provPath = m_strAppFolder + "/embedded.mobileprovision";
 	if (ZFile::IsFileExists(provPath.c_str())) {
 		if (ZFile::RemoveFile(provPath.c_str())) {
+			m_mapFileDigests.erase("embedded.mobileprovision");
+			m_tree.Remove(provPath);
 			ZLog::PrintV(">>> Removed embedded.mobileprovision: %s\n", provPath.c_str());
 		} else {
 			ZLog::WarnV(">>> Failed to remove embedded.mobileprovision: %s\n", provPath.c_str());
@@ -846,10 +1294,12 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		ZLog::PrintV(">>> embedded.mobileprovision not found, nothing to remove: %s\n", provPath.c_str());
 	}
 
-	if (SignNode(jvRoot)) {
+	PlanNode(jvRoot);
+	if (SignTree(jvRoot)) {
 		if (bEnableCache) {
 			ZFile::CreateFolder("./.zsign_cache");
 			jvRoot.style_write_to_file("./.zsign_cache/%s.json", strCacheName.c_str());
+			SaveManifest(strCacheName);
 		}
 		return true;
 	}
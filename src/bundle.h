@@ -2,6 +2,7 @@
 #include "common.h"
 #include "json.h"
 #include "openssl.h"
+#include "tree.h"
 #include <vector>
 
 class ZBundle
@@ -16,15 +17,20 @@ public:
 					const string& strBundleVersion,
 					const string& strDisplayName,
 					const vector<string>& arrDylibFiles,
+					const string& strSubBundle,
 					bool bForce,
 					bool bWeakInject,
 					bool bEnableCache);
 
 private:
+	void PlanNode(const jvalue& jvNode);
 	bool SignNode(jvalue& jvNode);
+	bool SignTree(jvalue& jvRoot);
+	bool SignSubBundle(const string& strSubBundle, bool bEnableCache);
+	bool IsSubBundleAncestor(const string& strFolder) const;
+	void LoadTrustedDigests(const string& strFolder);
 	void GetNodeChangedFiles(jvalue& jvNode);
 	void GetChangedFiles(jvalue& jvNode, vector<string>& arrChangedFiles);
-	bool ModifyPluginsBundleId(const string& strOldBundleId, const string& strNewBundleId);
 	bool ModifyBundleInfo(const string& strBundleId, const string& strBundleVersion, const string& strDisplayName);
 
 private:
@@ -33,20 +39,82 @@ private:
 	bool GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bGetName = false);
 
 private:
-	bool GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes);
+	bool GenerateCodeResources(const string& strFolder, string& strCodeResData);
 	
 	// NEW METHODS: Icon and Assets.car handling functions
 	bool HasIconsChanged(const string& strFolder, const jvalue& jvCachedInfo);
 	void GetIconFilesFromPlist(const jvalue& jvInfo, vector<string>& iconFiles);
 	bool ForceAssetsCarRegeneration(const string& strFolder);
 
+private:
+	void SetFileDigest(const string& strFile, const string& strSHA1, const string& strSHA256);
+	bool GetFileDigest(const string& strFile, string& strSHA1Base64, string& strSHA256Base64);
+	bool GetManifestDigest(const string& strFile, const string& strRealFile, string& strSHA1Base64, string& strSHA256Base64) const;
+	void LoadManifest(const string& strCacheName);
+	void SaveManifest(const string& strCacheName);
+
+private:
+	struct BundleInfo
+	{
+		bool		bValid;
+		bool		bBinary;
+		jvalue		jvInfo;
+		string		strData;
+		string		strSHA1; // base64
+		string		strSHA256;
+	};
+
+	// one plist edited by ModifyBundleInfo, written back in the format it was read in
+	struct PlistRewrite
+	{
+		string		strFile;
+		string		strBundleFolder; // set for a bundle's Info.plist
+		bool		bBinary;
+		jvalue		jvData;
+	};
+
+	// Info.plist of a bundle folder, parsed once per job. Entries stay valid for the whole job,
+	// ApplyPlistRewrites updates them in place and must not race with readers.
+	const BundleInfo* GetBundleInfo(const string& strFolder);
+	bool ModifyPluginsBundleId(const string& strOldBundleId, const string& strNewBundleId, vector<PlistRewrite>& arrRewrites);
+	bool ApplyPlistRewrites(vector<PlistRewrite>& arrRewrites);
+
+private:
+	// What SignNode recomputes for one bundle, planned by PlanNode for the whole tree once the requested
+	// edits are applied. Special slots are always rebuilt, they are only a few hashes of small blobs.
+	struct BundlePlan
+	{
+		bool			bResources; // regenerate CodeResources, otherwise only its "changed" entries are updated
+		set<string>		setRehashFiles; // binaries whose pages are all rehashed, relative to app folder
+	};
+
+private:
+	struct ManifestEntry
+	{
+		int64_t		nSize;
+		int64_t		nMTime;
+		uint64_t	uInode;
+		string		strSHA1;
+		string		strSHA256;
+	};
+
 private:
 	bool			m_bForceSign;
 	bool			m_bWeakInject;
 	bool			m_bIconsChanged;  // NEW: Global flag to force regeneration when icons change
+	bool			m_bIncremental;
 	ZSignAsset*		m_pSignAsset;
 	vector<string>	m_arrInjectDylibs;
+	map<string, pair<string, string>> m_mapFileDigests; // base64 sha1/sha256 of files hashed or written by this job, relative to app folder
+	mutex			m_mtxDigests;
+	map<string, ManifestEntry> m_mapManifest; // file stats and digests recorded by the previous job
+	map<string, BundleInfo> m_mapBundleInfo; // by bundle folder
+	string			m_strSubBundle; // nested bundle re-signed alone, relative to app folder
+	map<string, pair<string, string>> m_mapTrustedDigests; // base64 sha1/sha256 from the existing CodeResources of its ancestors
+	map<string, BundlePlan> m_mapPlans; // by node path, "/" for the root. Read-only while signing
+	mutex			m_mtxBundleInfo;
 
 public:
 	string			m_strAppFolder;
+	ZFileTree		m_tree;
 };
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "coderes.h"
+
+static const char* s_szRules =
+	"\t<key>rules</key>\n"
+	"\t<dict>\n"
+	"\t\t<key>^.*</key>\n"
+	"\t\t<true/>\n"
+	"\t\t<key>^.*\\.lproj/</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>optional</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1000</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^.*\\.lproj/locversion.plist$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>omit</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1100</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^Base\\.lproj/</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1010</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^version.plist$</key>\n"
+	"\t\t<true/>\n"
+	"\t</dict>\n"
+	"\t<key>rules2</key>\n"
+	"\t<dict>\n"
+	"\t\t<key>.*\\.dSYM($|/)</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>11</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^(.*/)?\\.DS_Store$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>omit</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>2000</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^.*</key>\n"
+	"\t\t<true/>\n"
+	"\t\t<key>^.*\\.lproj/</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>optional</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1000</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^.*\\.lproj/locversion.plist$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>omit</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1100</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^Base\\.lproj/</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>1010</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^Info\\.plist$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>omit</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>20</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^PkgInfo$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>omit</key>\n"
+	"\t\t\t<true/>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>20</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^embedded\\.provisionprofile$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>20</real>\n"
+	"\t\t</dict>\n"
+	"\t\t<key>^version\\.plist$</key>\n"
+	"\t\t<dict>\n"
+	"\t\t\t<key>weight</key>\n"
+	"\t\t\t<real>20</real>\n"
+	"\t\t</dict>\n"
+	"\t</dict>\n"
+	"</dict>\n"
+	"</plist>\n";
+
+ZCodeResources::ZCodeResources()
+{
+}
+
+void ZCodeResources::Reserve(size_t uFiles)
+{
+	m_arrFiles.reserve(uFiles);
+}
+
+void ZCodeResources::AddFile(const string& strPath, const string& strSHA1Base64, const string& strSHA256Base64)
+{
+	FileRecord record;
+	record.strPath = strPath;
+	record.strSHA1 = strSHA1Base64;
+	record.strSHA256 = strSHA256Base64;
+	record.bOptional = (string::npos != strPath.rfind(".lproj/"));
+	record.bOmitFiles = false;
+	record.bOmitFiles2 = false;
+
+	if (ZFile::IsPathSuffix(strPath, ".lproj/locversion.plist")) {
+		record.bOmitFiles = true;
+		record.bOmitFiles2 = true;
+	}
+
+	if (ZFile::IsPathSuffix(strPath, ".DS_Store") || "Info.plist" == strPath || "PkgInfo" == strPath) {
+		record.bOmitFiles2 = true;
+	}
+
+	m_arrFiles.push_back(record);
+}
+
+void ZCodeResources::AppendKey(string& strOutput, const char* szIndent, const string& strKey)
+{
+	strOutput += szIndent;
+	strOutput += "<key>";
+	if (string::npos == strKey.find_first_of("&<")) {
+		strOutput += strKey;
+	} else {
+		for (char ch : strKey) {
+			if ('&' == ch) {
+				strOutput += "&amp;";
+			} else if ('<' == ch) {
+				strOutput += "&lt;";
+			} else {
+				strOutput += ch;
+			}
+		}
+	}
+	strOutput += "</key>\n";
+}
+
+void ZCodeResources::AppendData(string& strOutput, const char* szIndent, const string& strBase64)
+{
+	strOutput += szIndent;
+	strOutput += "<data>\n";
+	strOutput += szIndent;
+	strOutput += strBase64;
+	strOutput += "\n";
+	strOutput += szIndent;
+	strOutput += "</data>\n";
+}
+
+void ZCodeResources::Write(string& strOutput)
+{
+	// same key order as the std::map backed jvalue object
+	sort(m_arrFiles.begin(), m_arrFiles.end());
+
+	strOutput.clear();
+	strOutput.reserve(m_arrFiles.size() * 400 + 4096);
+	strOutput += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	strOutput += "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n";
+	strOutput += "<plist version=\"1.0\">\n";
+	strOutput += "<dict>\n";
+
+	size_t uFiles = 0;
+	size_t uFiles2 = 0;
+	for (const FileRecord& record : m_arrFiles) {
+		uFiles += record.bOmitFiles ? 0 : 1;
+		uFiles2 += record.bOmitFiles2 ? 0 : 1;
+	}
+
+	strOutput += "\t<key>files</key>\n";
+	if (uFiles > 0) {
+		strOutput += "\t<dict>\n";
+		for (const FileRecord& record : m_arrFiles) {
+			if (record.bOmitFiles) {
+				continue;
+			}
+
+			AppendKey(strOutput, "\t\t", record.strPath);
+			if (record.bOptional) {
+				strOutput += "\t\t<dict>\n";
+				strOutput += "\t\t\t<key>hash</key>\n";
+				AppendData(strOutput, "\t\t\t", record.strSHA1);
+				strOutput += "\t\t\t<key>optional</key>\n";
+				strOutput += "\t\t\t<true/>\n";
+				strOutput += "\t\t</dict>\n";
+			} else {
+				AppendData(strOutput, "\t\t", record.strSHA1);
+			}
+		}
+		strOutput += "\t</dict>\n";
+	} else {
+		strOutput += "\t<dict/>\n";
+	}
+
+	strOutput += "\t<key>files2</key>\n";
+	if (uFiles2 > 0) {
+		strOutput += "\t<dict>\n";
+		for (const FileRecord& record : m_arrFiles) {
+			if (record.bOmitFiles2) {
+				continue;
+			}
+
+			AppendKey(strOutput, "\t\t", record.strPath);
+			strOutput += "\t\t<dict>\n";
+			strOutput += "\t\t\t<key>hash</key>\n";
+			AppendData(strOutput, "\t\t\t", record.strSHA1);
+			strOutput += "\t\t\t<key>hash2</key>\n";
+			AppendData(strOutput, "\t\t\t", record.strSHA256);
+			if (record.bOptional) {
+				strOutput += "\t\t\t<key>optional</key>\n";
+				strOutput += "\t\t\t<true/>\n";
+			}
+			strOutput += "\t\t</dict>\n";
+		}
+		strOutput += "\t</dict>\n";
+	} else {
+		strOutput += "\t<dict/>\n";
+	}
+
+	strOutput += s_szRules;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+
+// Writes _CodeSignature/CodeResources straight from file records, producing the
+// same XML as jvalue::style_write_plist without building the nested jvalue tree.
+class ZCodeResources
+{
+public:
+	ZCodeResources();
+
+public:
+	void Reserve(size_t uFiles);
+	void AddFile(const string& strPath, const string& strSHA1Base64, const string& strSHA256Base64);
+	void Write(string& strOutput);
+
+private:
+	struct FileRecord
+	{
+		string strPath;
+		string strSHA1;
+		string strSHA256;
+		bool bOptional;
+		bool bOmitFiles;
+		bool bOmitFiles2;
+
+		bool operator<(const FileRecord& other) const { return strPath < other.strPath; }
+	};
+
+private:
+	static void AppendKey(string& strOutput, const char* szIndent, const string& strKey);
+	static void AppendData(string& strOutput, const char* szIndent, const string& strBase64);
+
+private:
+	vector<FileRecord> m_arrFiles;
+};
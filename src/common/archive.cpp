@@ -24,13 +24,14 @@ void Zip::GetModificationTime(const char* path, void* zfi)
 		zi->tmz_date.tm_mon = tm.tm_mon;
 		zi->tmz_date.tm_year = tm.tm_year + 1900;
 #else
-		struct tm* tm = localtime(&st.st_mtime);
-		zi->tmz_date.tm_sec = tm->tm_sec;
-		zi->tmz_date.tm_min = tm->tm_min;
-		zi->tmz_date.tm_hour = tm->tm_hour;
-		zi->tmz_date.tm_mday = tm->tm_mday;
-		zi->tmz_date.tm_mon = tm->tm_mon;
-		zi->tmz_date.tm_year = tm->tm_year + 1900;
+		struct tm tm = { 0 };
+		localtime_r(&st.st_mtime, &tm);
+		zi->tmz_date.tm_sec = tm.tm_sec;
+		zi->tmz_date.tm_min = tm.tm_min;
+		zi->tmz_date.tm_hour = tm.tm_hour;
+		zi->tmz_date.tm_mday = tm.tm_mday;
+		zi->tmz_date.tm_mon = tm.tm_mon;
+		zi->tmz_date.tm_year = tm.tm_year + 1900;
 #endif
 	}
 }
@@ -80,7 +81,7 @@ bool Zip::_CreateFolderToZip(void* hZip, const string& strFolder, const string&
 	return true;
 }
 
-bool Zip::Archive(const string& strFolder, const string& strZipFile, int nZipLevel)
+bool Zip::Archive(const string& strFolder, const string& strZipFile, int nZipLevel, const ZFileTree* pTree)
 {
 	 if (nZipLevel < 0 || nZipLevel > 9) {
 		ZLog::ErrorV(">>> Zip: Invalid compression level: %d\n", nZipLevel);
@@ -94,7 +95,7 @@ bool Zip::Archive(const string& strFolder, const string& strZipFile, int nZipLev
     }
 
 	bool bRet = true;
-	ZFile::EnumFolder(strFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
+	auto callback = [&](bool bFolder, const string& strPath) {
 		string strRelativePath = strPath.substr(strFolder.size() + 1);
 		ZUtil::StringReplace(strRelativePath, "\\", "/");
 
@@ -116,7 +117,13 @@ bool Zip::Archive(const string& strFolder, const string& strZipFile, int nZipLev
 			}
 		}
 		return false;
-	});
+	};
+
+	bool bEnum = (NULL != pTree) ? pTree->EnumFolder(strFolder, true, NULL, callback) : ZFile::EnumFolder(strFolder.c_str(), true, NULL, callback);
+	if (!bEnum) {
+		ZLog::ErrorV(">>> Zip: Failed to read folder: %s\n", strFolder.c_str());
+		bRet = false;
+	}
 
     zipClose(zf, NULL);
 	return bRet;
@@ -1,12 +1,13 @@
 #pragma once
 
 #include "common.h"
+#include "tree.h"
 
 class Zip
 {
 public:
 	
-	static bool Archive(const string& strFolder, const string& strZipFile, int nZipLevel);
+	static bool Archive(const string& strFolder, const string& strZipFile, int nZipLevel, const ZFileTree* pTree = NULL);
 	static bool Extract(const char* zip_file, const char* output_folder);
 
 private:
@@ -36,6 +36,7 @@
 #include <set>
 #include <map>
 #include <mutex>
+#include <atomic>
 #include <vector>
 #include <string>
 #include <memory>
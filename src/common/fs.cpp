@@ -1,10 +1,56 @@
 #include "fs.h"
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 #if !defined(S_ISREG) && defined(S_IFMT) && defined(S_IFREG)
 #define S_ISREG(m) (((m)&S_IFMT) == S_IFREG)
 #endif
 
+mutex ZFile::s_mtxFiles;
 map<void*, void*> ZFile::s_mapFiles;
+atomic<uint32_t> ZFile::s_uIOFlags(ZFile::E_IO_DEFAULT);
+
+// "default", "mmap" (the old read-write mapping without hints) or a comma separated list
+// of seq, willneed, populate, thp and pwrite
+bool ZFile::SetIOStrategy(const char* szStrategy)
+{
+	vector<string> arrNames;
+	ZUtil::StringSplit(szStrategy, ",", arrNames);
+
+	uint32_t uFlags = 0;
+	for (const string& strName : arrNames) {
+		if ("default" == strName) {
+			uFlags |= E_IO_DEFAULT;
+		} else if ("mmap" == strName) {
+			continue; // no flags
+		} else if ("seq" == strName) {
+			uFlags |= E_IO_SEQUENTIAL;
+		} else if ("willneed" == strName) {
+			uFlags |= E_IO_WILLNEED;
+		} else if ("populate" == strName) {
+			uFlags |= E_IO_POPULATE;
+		} else if ("thp" == strName) {
+			uFlags |= E_IO_HUGEPAGE;
+		} else if ("pwrite" == strName) {
+			uFlags |= E_IO_PWRITE;
+		} else {
+			return false;
+		}
+	}
+
+	s_uIOFlags = uFlags;
+	return !arrNames.empty();
+}
 
 bool ZFile::IsRegularFile(const char* path)
 {
@@ -12,26 +58,32 @@ bool ZFile::IsRegularFile(const char* path)
 	return 0 == stat(path, &st) && S_ISREG(st.st_mode);
 }
 
-void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize, bool ro)
+void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize, bool ro, uint32_t flags)
 {
 	void* base = NULL;
 
 #ifdef _WIN32
 
-	HANDLE hFile = ::CreateFileA(path, ro ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE), ro ? FILE_SHARE_READ : (FILE_SHARE_READ | FILE_SHARE_WRITE), NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	// no equivalent of the advice flags here. A read-only view still shares write access,
+	// the signature is written through the file while it is mapped (E_IO_PWRITE).
+	HANDLE hFile = ::CreateFileA(path, ro ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE), FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (INVALID_HANDLE_VALUE != hFile) {
 		if (size <= 0) {
-			size = ::GetFileSize(hFile, NULL);
+			LARGE_INTEGER liSize = { 0 };
+			::GetFileSizeEx(hFile, &liSize);
+			size = (size_t)liSize.QuadPart;
 		}
 
 		if (NULL != psize) {
 			*psize = size;
 		}
 
-		HANDLE hMap = ::CreateFileMapping(hFile, NULL, ro ? PAGE_READONLY : PAGE_READWRITE, 0, (DWORD)size, NULL);
+		uint64_t uMapSize = (uint64_t)size;
+		HANDLE hMap = ::CreateFileMapping(hFile, NULL, ro ? PAGE_READONLY : PAGE_READWRITE, (DWORD)(uMapSize >> 32), (DWORD)uMapSize, NULL);
 		if (NULL != hMap) {
 			base = ::MapViewOfFile(hMap, ro ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, size);
 			if (NULL != base) {
+				lock_guard<mutex> lock(s_mtxFiles);
 				s_mapFiles[base] = hMap;
 			} else {
 				::CloseHandle(hMap);
@@ -60,9 +112,31 @@ void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize
 			*psize = size;
 		}
 
-		base = mmap(NULL, size, ro ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+		int nMapFlags = MAP_SHARED;
+		bool bPopulate = false;
+#ifdef MAP_POPULATE
+		if ((flags & E_IO_POPULATE) && size <= 8 * 1024 * 1024) {
+			nMapFlags |= MAP_POPULATE;
+			bPopulate = true;
+		}
+#endif
+
+		base = mmap(NULL, size, ro ? PROT_READ : PROT_READ | PROT_WRITE, nMapFlags, fd, offset);
 		if (MAP_FAILED == base) {
 			base = NULL;
+		} else {
+			// only hints, a kernel that ignores them still maps the file
+			if (flags & E_IO_SEQUENTIAL) {
+				madvise(base, size, MADV_SEQUENTIAL);
+			}
+			if ((flags & E_IO_WILLNEED) && !bPopulate) {
+				madvise(base, size, MADV_WILLNEED);
+			}
+#ifdef MADV_HUGEPAGE
+			if ((flags & E_IO_HUGEPAGE) && size >= 32 * 1024 * 1024) {
+				madvise(base, size, MADV_HUGEPAGE);
+			}
+#endif
 		}
 		close(fd);
 	}
@@ -72,9 +146,26 @@ void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize
 	return base;
 }
 
+// Drops the resident pages of a shared file mapping. The data stays in the file (or the page cache)
+// and faults back in on the next access, so a long linear pass over a huge file keeps a bounded RSS.
+void ZFile::ReleaseMappedPages(void* base, size_t size)
+{
+#ifdef _WIN32
+	::VirtualUnlock(base, size); // unlocked pages are trimmed from the working set
+#else
+	uintptr_t uPageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t uStart = ((uintptr_t)base + uPageSize - 1) & ~(uPageSize - 1);
+	uintptr_t uEnd = ((uintptr_t)base + size) & ~(uPageSize - 1);
+	if (uEnd > uStart) {
+		madvise((void*)uStart, uEnd - uStart, MADV_DONTNEED);
+	}
+#endif
+}
+
 bool ZFile::UnmapFile(void* base, size_t size)
 {
 #ifdef _WIN32
+	lock_guard<mutex> lock(s_mtxFiles);
 	auto it = s_mapFiles.find(base);
 	if (it != s_mapFiles.end()) {
 		::UnmapViewOfFile(base);
@@ -198,9 +289,8 @@ bool ZFile::IsFolder(const char* szFolder)
 #ifdef _WIN32
 	return ::PathIsDirectoryA(szFolder);
 #else
-	struct stat st;
-	stat(szFolder, &st);
-	return S_ISDIR(st.st_mode);
+	struct stat st = { 0 };
+	return (0 == stat(szFolder, &st) && S_ISDIR(st.st_mode));
 #endif
 }
 
@@ -377,6 +467,131 @@ bool ZFile::CopyFileV(const char* szSrcFile, const char* szDestPath, ...)
 	return CopyFile(szSrcFile, szDestFile);
 }
 
+bool ZFile::CopyFileRange(const char* szSrcFile, int64_t nSrcOffset, const char* szDestFile, int64_t nDestOffset, int64_t nSize)
+{
+#if defined(__linux__) && defined(SYS_copy_file_range)
+	// lets the kernel copy (or reflink) the range without a round trip through user space
+	int src_fd = open(szSrcFile, O_RDONLY);
+	if (-1 != src_fd) {
+		int dest_fd = open(szDestFile, O_CREAT | O_WRONLY, 0644);
+		if (-1 != dest_fd) {
+			loff_t off_in = nSrcOffset;
+			loff_t off_out = nDestOffset;
+			while (nSize > 0) {
+				ssize_t copied = syscall(SYS_copy_file_range, src_fd, &off_in, dest_fd, &off_out, (size_t)nSize, 0);
+				if (copied <= 0) {
+					break; // EXDEV, ENOSYS, ... finished below
+				}
+				nSize -= copied;
+			}
+			nSrcOffset = off_in;
+			nDestOffset = off_out;
+			close(dest_fd);
+		}
+		close(src_fd);
+	}
+	if (nSize <= 0) {
+		return true;
+	}
+#endif
+
+	FILE* src_fp = NULL;
+	FILE* dest_fp = NULL;
+	_fopen64(src_fp, szSrcFile, "rb");
+	_fopen64(dest_fp, szDestFile, "rb+");
+	if (NULL == dest_fp) {
+		_fopen64(dest_fp, szDestFile, "wb+");
+	}
+
+	if (NULL != src_fp && NULL != dest_fp && 0 == _fseeki64(src_fp, nSrcOffset, SEEK_SET) && 0 == _fseeki64(dest_fp, nDestOffset, SEEK_SET)) {
+		char buffer[65536];
+		while (nSize > 0) {
+			size_t bytes_read = fread(buffer, 1, (size_t)min(nSize, (int64_t)sizeof(buffer)), src_fp);
+			if (bytes_read <= 0 || fwrite(buffer, 1, bytes_read, dest_fp) != bytes_read) {
+				break;
+			}
+			nSize -= bytes_read;
+		}
+	}
+
+	if (NULL != src_fp) {
+		fclose(src_fp);
+	}
+	if (NULL != dest_fp) {
+		fclose(dest_fp);
+	}
+
+	if (nSize > 0) {
+		ZLog::ErrorV("CopyFileRange: Failed! %s -> %s, %s\n", szSrcFile, szDestFile, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool ZFile::ResizeFile(const char* szFile, int64_t nSize)
+{
+#ifdef _WIN32
+	bool bRet = false;
+	HANDLE hFile = ::CreateFileA(szFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE != hFile) {
+		LARGE_INTEGER liSize;
+		liSize.QuadPart = nSize;
+		bRet = (::SetFilePointerEx(hFile, liSize, NULL, FILE_BEGIN) && ::SetEndOfFile(hFile));
+		::CloseHandle(hFile);
+	}
+#else
+	bool bRet = (0 == truncate(szFile, nSize));
+#endif
+	if (!bRet) {
+		ZLog::ErrorV("ResizeFile: Failed! %s, %s\n", szFile, strerror(errno));
+	}
+	return bRet;
+}
+
+// pwrite of a block into an existing file, used to write a signature under a read-only mapping
+bool ZFile::WriteFileAt(const char* szFile, int64_t nOffset, const char* szData, size_t sLen)
+{
+	bool bRet = false;
+#ifdef _WIN32
+	HANDLE hFile = ::CreateFileA(szFile, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE != hFile) {
+		LARGE_INTEGER liOffset;
+		liOffset.QuadPart = nOffset;
+		bRet = (TRUE == ::SetFilePointerEx(hFile, liOffset, NULL, FILE_BEGIN));
+		while (bRet && sLen > 0) {
+			DWORD dwWritten = 0;
+			bRet = (TRUE == ::WriteFile(hFile, szData, (DWORD)min(sLen, (size_t)0x40000000), &dwWritten, NULL) && dwWritten > 0);
+			szData += dwWritten;
+			sLen -= dwWritten;
+		}
+		::CloseHandle(hFile);
+	}
+#else
+	int fd = open(szFile, O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		bRet = true;
+		while (sLen > 0) {
+			ssize_t nWritten = pwrite(fd, szData, sLen, (off_t)nOffset);
+			if (nWritten < 0 && EINTR == errno) {
+				continue;
+			}
+			if (nWritten <= 0) {
+				bRet = false;
+				break;
+			}
+			szData += nWritten;
+			sLen -= nWritten;
+			nOffset += nWritten;
+		}
+		close(fd);
+	}
+#endif
+	if (!bRet) {
+		ZLog::ErrorV("WriteFileAt: Failed! %s, %s\n", szFile, strerror(errno));
+	}
+	return bRet;
+}
+
 string ZFile::GetFullPath(const char* szPath)
 {
 	string strPath = szPath;
@@ -433,6 +648,45 @@ int64_t ZFile::GetFileSizeV(const char* szPath, ...)
 	return GetFileSize(szFile);
 }
 
+// Size, mtime in nanoseconds since the epoch and file identity, used to tell whether a file changed
+// since the last job. MSVC's stat() reports st_ino as 0 and whole seconds only, so Windows asks the handle.
+bool ZFile::GetFileStat(const char* szFile, int64_t& nSize, int64_t& nMTime, uint64_t& uInode)
+{
+#ifdef _WIN32
+	HANDLE hFile = ::CreateFileA(szFile, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (INVALID_HANDLE_VALUE == hFile) {
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info = { 0 };
+	BOOL bRet = ::GetFileInformationByHandle(hFile, &info);
+	::CloseHandle(hFile);
+	if (!bRet) {
+		return false;
+	}
+
+	// FILETIME counts 100ns intervals since 1601-01-01
+	uint64_t uFileTime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	nSize = (int64_t)(((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow);
+	nMTime = ((int64_t)uFileTime - 116444736000000000LL) * 100;
+	uInode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+	struct stat st = { 0 };
+	if (0 != stat(szFile, &st)) {
+		return false;
+	}
+
+	nSize = st.st_size;
+	uInode = st.st_ino;
+#if defined(__APPLE__)
+	nMTime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	nMTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+	return true;
+}
+
 string ZFile::GetFileSizeString(const char* szFile)
 {
 	return  ZUtil::FormatSize(GetFileSize(szFile), 1024);
@@ -475,101 +729,343 @@ const char* ZFile::GetTempFolder()
 
 bool ZFile::EnumFolder(const char* szFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback)
 {
-	string strFolder = szFolder;
-	if (strFolder.empty() || NULL == callback) {
+	if (NULL == callback) {
 		return false;
 	}
 
+	walk_folder_callback walkFilter;
+	if (NULL != filter) {
+		walkFilter = [&](const ZFolderEntry& entry) {
+			return filter(entry.IsFolder(), entry.GetPath());
+		};
+	}
+
+	return WalkFolder(szFolder, bRecursive, walkFilter, [&](const ZFolderEntry& entry) {
+		return callback(entry.IsFolder(), entry.GetPath());
+	});
+}
+
+bool ZFile::PathRemoveFileSpec(string& path)
+{
+	size_t pos = path.find_last_of("/\\");
+	if (pos != std::string::npos) {
+		path = path.substr(0, pos);
+		return true;
+	}
+	return false;
+}
+
 #ifdef _WIN32
-	string strFromFolder = strFolder + "\\*";
+#define FOLDER_SEPARATOR "\\"
+#else
+#define FOLDER_SEPARATOR "/"
+#endif
+
+ZFolderNode::ZFolderNode(const shared_ptr<ZFolderNode>& parent, const string& name)
+{
+	pParent = parent;
+	strName = name;
+	nFd = -1;
+}
+
+ZFolderNode::~ZFolderNode()
+{
+	Close();
+}
+
+void ZFolderNode::Close()
+{
+#ifndef _WIN32
+	if (nFd >= 0) {
+		close(nFd);
+		nFd = -1;
+	}
+#endif
+}
+
+const string& ZFolderNode::GetPath() const
+{
+	call_once(m_flagPath, [this]() {
+		m_strPath = (NULL != pParent) ? (pParent->GetPath() + FOLDER_SEPARATOR + strName) : strName;
+	});
+	return m_strPath;
+}
+
+ZFolderEntry::ZFolderEntry(const ZFolderNode* pFolder, const char* szName, bool bFolder)
+{
+	m_pFolder = pFolder;
+	m_szName = szName;
+	m_bFolder = bFolder;
+}
+
+const string& ZFolderEntry::GetPath() const
+{
+	if (m_strPath.empty()) {
+		m_strPath = m_pFolder->GetPath() + FOLDER_SEPARATOR + m_szName;
+	}
+	return m_strPath;
+}
+
+int64_t ZFolderEntry::GetFileSize() const
+{
+#ifdef _WIN32
+	return ZFile::GetFileSize(GetPath().c_str());
+#else
+	struct stat st = { 0 };
+	if (0 != fstatat(m_pFolder->nFd, m_szName, &st, 0)) {
+		return 0;
+	}
+	return st.st_size;
+#endif
+}
+
+// Opens pFolder relative to nAtFd (an open parent), or by its full path when nAtFd < 0, and lists it.
+// The folder stays open for the fstatat calls of its entries; the caller closes it.
+bool ZFile::ReadFolder(ZFolderNode* pFolder, int nAtFd, vector<pair<string, bool>>& arrEntries)
+{
+#ifdef _WIN32
+
+	string strFromFolder = pFolder->GetPath() + "\\*";
 	WIN32_FIND_DATAA fd = { 0 };
 	HANDLE hFind = ::FindFirstFileA(strFromFolder.c_str(), &fd);
 	if (INVALID_HANDLE_VALUE == hFind) {
+		ZLog::ErrorV("ReadFolder: Failed in FindFirstFile! %s, %u\n", pFolder->GetPath().c_str(), (uint32_t)::GetLastError());
 		return false;
 	}
 
-	while (::FindNextFileA(hFind, &fd)) {
+	do {
 		if (0 == strcmp(fd.cFileName, ".") || 0 == strcmp(fd.cFileName, "..")) {
 			continue;
 		}
+		arrEntries.push_back(make_pair(string(fd.cFileName), (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? true : false));
+	} while (::FindNextFileA(hFind, &fd));
 
-		string strName = fd.cFileName;
-		string strPath = strFolder + "\\" + strName;
-		bool bFolder = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? true : false;
+	DWORD dwError = ::GetLastError();
+	::FindClose(hFind);
+	if (ERROR_NO_MORE_FILES != dwError) {
+		ZLog::ErrorV("ReadFolder: Failed in FindNextFile! %s, %u\n", pFolder->GetPath().c_str(), (uint32_t)dwError);
+		return false;
+	}
 
-		if (NULL != filter) {
-			if (filter(bFolder, strPath)) {
-				continue;
-			}
+#else
+
+	if (nAtFd >= 0) {
+		pFolder->nFd = openat(nAtFd, pFolder->strName.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		pFolder->nFd = open(pFolder->GetPath().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (pFolder->nFd < 0) {
+		ZLog::ErrorV("ReadFolder: Failed in open! %s, %s\n", pFolder->GetPath().c_str(), strerror(errno));
+		return false;
+	}
+
+	auto addEntry = [&](const char* szName, uint8_t uType) {
+		if ('.' == szName[0] && (0 == szName[1] || ('.' == szName[1] && 0 == szName[2]))) {
+			return;
 		}
 
-		if (callback(bFolder, strPath)) {
+		bool bFolder = false;
+		if (DT_DIR == uType) {
+			bFolder = true;
+		} else if (DT_UNKNOWN == uType) {
+			struct stat st = { 0 };
+			if (0 == fstatat(pFolder->nFd, szName, &st, 0) && S_ISDIR(st.st_mode)) {
+				bFolder = true;
+			}
+		}
+		arrEntries.push_back(make_pair(string(szName), bFolder));
+	};
+
+#ifdef __linux__
+
+	struct linux_dirent64
+	{
+		uint64_t		d_ino;
+		int64_t			d_off;
+		unsigned short	d_reclen;
+		unsigned char	d_type;
+		char			d_name[1];
+	};
+
+	alignas(8) char buf[32768];
+	while (true) {
+		long nRead = syscall(SYS_getdents64, pFolder->nFd, buf, sizeof(buf));
+		if (nRead < 0) {
+			ZLog::ErrorV("ReadFolder: Failed in getdents64! %s, %s\n", pFolder->GetPath().c_str(), strerror(errno));
+			return false;
+		} else if (0 == nRead) {
 			break;
 		}
 
-		if (bFolder && bRecursive) {
-			EnumFolder(strPath.c_str(), bRecursive, filter, callback);
+		for (long pos = 0; pos < nRead;) {
+			linux_dirent64* d = (linux_dirent64*)(buf + pos);
+			addEntry(d->d_name, d->d_type);
+			pos += d->d_reclen;
 		}
 	}
-	::FindClose(hFind);
 
 #else
 
-	DIR* dir = opendir(szFolder);
+	int fd = dup(pFolder->nFd);
+	DIR* dir = (fd >= 0) ? fdopendir(fd) : NULL;
 	if (NULL == dir) {
+		ZLog::ErrorV("ReadFolder: Failed in fdopendir! %s, %s\n", pFolder->GetPath().c_str(), strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
 		return false;
 	}
-	
-	dirent* ptr = readdir(dir);
-	while (NULL != ptr) {
-		if (0 == strcmp(ptr->d_name, ".") || 0 == strcmp(ptr->d_name, "..")) {
-			ptr = readdir(dir);
-			continue;
-		}
 
-		string strPath = strFolder + "/" + ptr->d_name;
+	dirent* ptr = NULL;
+	errno = 0;
+	while (NULL != (ptr = readdir(dir))) {
+		addEntry(ptr->d_name, ptr->d_type);
+		errno = 0;
+	}
+	int nError = errno;
+	closedir(dir);
+	if (0 != nError) {
+		ZLog::ErrorV("ReadFolder: Failed in readdir! %s, %s\n", pFolder->GetPath().c_str(), strerror(nError));
+		return false;
+	}
 
-		bool bFolder = false;
-		if (DT_DIR == ptr->d_type) {
-			bFolder = true;
-		} else if (DT_UNKNOWN == ptr->d_type) {
-			struct stat st = { 0 };
-			stat(strPath.c_str(), &st);
-			if (S_ISDIR(st.st_mode)) {
-				bFolder = true;
-			}
+#endif
+#endif
+
+	return true;
+}
+
+struct ZWalkState
+{
+	mutex								mtx;
+	condition_variable					cv;
+	deque<shared_ptr<ZFolderNode>>	queue;
+	size_t								uActive;
+	size_t								uMaxQueue;
+	uint32_t							uMaxDepth;
+	atomic<bool>						bStop;
+	atomic<bool>						bFailed;
+};
+
+// Lists pFolder and reports its entries. uDepth counts the folders this thread holds open: pFolder
+// and the ancestors it descended from inline. Subfolders are walked inline while that stays below
+// uMaxDepth and the queue has enough work, otherwise they are queued without a handle and reopened
+// by path. pFolder is closed as soon as its entries and inline subfolders are done.
+void ZFile::WalkFolderNode(const shared_ptr<ZFolderNode>& pFolder, int nAtFd, uint32_t uDepth, bool bRecursive, walk_folder_callback& filter, walk_folder_callback& callback, void* pState)
+{
+	ZWalkState* state = (ZWalkState*)pState;
+
+	vector<pair<string, bool>> arrEntries;
+	if (!ReadFolder(pFolder.get(), nAtFd, arrEntries)) {
+		state->bFailed = true;
+		state->bStop = true;
+		pFolder->Close();
+		return;
+	}
+
+	for (const pair<string, bool>& item : arrEntries) {
+		if (state->bStop) {
+			break;
 		}
 
+		ZFolderEntry entry(pFolder.get(), item.first.c_str(), item.second);
 		if (NULL != filter) {
-			if (filter(bFolder, strPath)) {
-				ptr = readdir(dir);
+			if (filter(entry)) {
 				continue;
 			}
 		}
 
-		if (callback(bFolder, strPath)) {
+		if (callback(entry)) {
+			state->bStop = true;
 			break;
 		}
 
-		if (bFolder && bRecursive) {
-			EnumFolder(strPath.c_str(), bRecursive, filter, callback);
+		if (item.second && bRecursive) {
+			shared_ptr<ZFolderNode> pChild = make_shared<ZFolderNode>(pFolder, item.first);
+			{
+				unique_lock<mutex> lock(state->mtx);
+				if (uDepth >= state->uMaxDepth || state->queue.size() < state->uMaxQueue) {
+					state->queue.push_back(pChild);
+					lock.unlock();
+					state->cv.notify_one();
+					continue;
+				}
+			}
+			WalkFolderNode(pChild, pFolder->nFd, uDepth + 1, bRecursive, filter, callback, pState);
 		}
+	}
+	pFolder->Close();
+}
 
-		ptr = readdir(dir);
+bool ZFile::WalkFolder(const char* szFolder, bool bRecursive, walk_folder_callback filter, walk_folder_callback callback, uint32_t uThreads)
+{
+	string strFolder = szFolder;
+	if (strFolder.empty() || NULL == callback) {
+		return false;
 	}
-	closedir(dir);
 
+#ifdef _WIN32
+	uThreads = 1;
 #endif
+	if (!bRecursive || uThreads < 1) {
+		uThreads = 1;
+	}
 
-	return true;
-}
+	// every worker holds at most uMaxDepth folders open at once, sized from the handle limit so a deep
+	// tree can't exhaust it. With several workers the queue is kept stocked for the idle ones.
+	uint64_t uHandles = 1024;
+#ifndef _WIN32
+	struct rlimit rl;
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl) && RLIM_INFINITY != rl.rlim_cur) {
+		uHandles = (uint64_t)rl.rlim_cur;
+	}
+#endif
 
-bool ZFile::PathRemoveFileSpec(string& path)
-{
-	size_t pos = path.find_last_of("/\\");
-	if (pos != std::string::npos) {
-		path = path.substr(0, pos);
-		return true;
+	ZWalkState state;
+	state.uActive = 0;
+	state.uMaxQueue = (uThreads > 1) ? (uThreads * 4) : 0;
+	state.uMaxDepth = (uint32_t)max((uint64_t)1, min((uint64_t)64, uHandles / 4 / uThreads));
+	state.bStop = false;
+	state.bFailed = false;
+	state.queue.push_back(make_shared<ZFolderNode>(shared_ptr<ZFolderNode>(), strFolder));
+
+	auto worker = [&]() {
+		while (true) {
+			shared_ptr<ZFolderNode> pFolder;
+			{
+				unique_lock<mutex> lock(state.mtx);
+				state.cv.wait(lock, [&]() {
+					return (!state.queue.empty() || 0 == state.uActive || state.bStop);
+				});
+
+				if (state.bStop || state.queue.empty()) {
+					state.cv.notify_all();
+					return;
+				}
+
+				pFolder = state.queue.front();
+				state.queue.pop_front();
+				state.uActive++;
+			}
+
+			WalkFolderNode(pFolder, -1, 1, bRecursive, filter, callback, &state);
+			pFolder.reset();
+
+			{
+				lock_guard<mutex> lock(state.mtx);
+				state.uActive--;
+			}
+			state.cv.notify_all();
+		}
+	};
+
+	vector<thread> arrThreads;
+	for (uint32_t i = 1; i < uThreads; i++) {
+		arrThreads.push_back(thread(worker));
 	}
-	return false;
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
+	}
+	return !state.bFailed;
 }
@@ -3,8 +3,63 @@
 
 typedef function<bool (bool bFolder, const string& strPath)> enum_folder_callback;
 
+// A folder being walked. The full path is only built when somebody asks for it.
+struct ZFolderNode
+{
+	ZFolderNode(const shared_ptr<ZFolderNode>& parent, const string& name);
+	~ZFolderNode();
+
+	const string& GetPath() const;
+	void Close();
+
+	shared_ptr<ZFolderNode>	pParent;
+	string					strName;
+	int						nFd;
+
+private:
+	mutable once_flag		m_flagPath;
+	mutable string			m_strPath;
+};
+
+// One entry reported by ZFile::WalkFolder, valid during the callback only.
+class ZFolderEntry
+{
+public:
+	ZFolderEntry(const ZFolderNode* pFolder, const char* szName, bool bFolder);
+
+public:
+	int				GetFolderFd() const { return m_pFolder->nFd; }
+	const char*		GetName() const { return m_szName; }
+	bool			IsFolder() const { return m_bFolder; }
+	const string&	GetPath() const;
+	int64_t			GetFileSize() const;
+
+private:
+	const ZFolderNode*	m_pFolder;
+	const char*			m_szName;
+	bool				m_bFolder;
+	mutable string		m_strPath;
+};
+
+typedef function<bool (const ZFolderEntry& entry)> walk_folder_callback;
+
 class ZFile
 {
+public:
+	// how Mach-O files are mapped and written, -O selects them for benchmarking
+	enum eIOFlags
+	{
+		E_IO_SEQUENTIAL = 0x01,	// MADV_SEQUENTIAL, deep readahead for the linear hashing pass
+		E_IO_WILLNEED = 0x02,	// MADV_WILLNEED, start reading the whole file when it is mapped
+		E_IO_POPULATE = 0x04,	// MAP_POPULATE files up to 8M instead of faulting them in page by page
+		E_IO_HUGEPAGE = 0x08,	// MADV_HUGEPAGE files from 32M, where the kernel and file system support it
+		E_IO_PWRITE = 0x10,		// map read-only and write the signature through the file
+		E_IO_DEFAULT = E_IO_SEQUENTIAL | E_IO_WILLNEED | E_IO_POPULATE | E_IO_PWRITE,
+	};
+
+	static bool		SetIOStrategy(const char* szStrategy);
+	static uint32_t	GetIOFlags() { return s_uIOFlags; }
+
 public:
 	static bool		ReadFile(const char* szFile, string& strData);
 	static bool		ReadFileV(string& strData, const char* szPath, ...);
@@ -28,23 +83,41 @@ public:
 	static int64_t	GetFileSize(FILE* fp);
 	static int64_t	GetFileSize(const char* szPath);
 	static int64_t	GetFileSizeV(const char* szPath, ...);
+	static bool		GetFileStat(const char* szFile, int64_t& nSize, int64_t& nMTime, uint64_t& uInode);
 	static string	GetFileSizeString(const char* szFile);
 	static bool		IsZipFile(const char* szFile);
 	static bool		CopyFile(const char* szSrcFile, const char* szDestFile);
 	static bool		CopyFileV(const char* szSrcFile, const char* szDestPath, ...);
+	static bool		CopyFileRange(const char* szSrcFile, int64_t nSrcOffset, const char* szDestFile, int64_t nDestOffset, int64_t nSize);
+	static bool		ResizeFile(const char* szFile, int64_t nSize);
+	static bool		WriteFileAt(const char* szFile, int64_t nOffset, const char* szData, size_t sLen);
 	static string	GetFullPath(const char* szPath);
 	static string	GetRealPathV(const char* szPath, ...);
-	static void*	MapFile(const char* path, size_t offset, size_t size, size_t* psize, bool ro);
+	static void*	MapFile(const char* path, size_t offset, size_t size, size_t* psize, bool ro, uint32_t flags = 0);
 	static bool		UnmapFile(void* base, size_t size);
+	static void		ReleaseMappedPages(void* base, size_t size);
 	static bool		IsPathSuffix(const string& strPath, const char* suffix);
 	static const char* GetTempFolder();
+
+	// depth-first walk: filter returning true skips an entry (and its subtree), callback returning true
+	// stops the whole walk. Returns false when a folder couldn't be read, stopping is not a failure.
 	static bool		EnumFolder(const char* szFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback);
 
+	// fd-relative walk: filter returning true skips an entry (and its subtree), callback returning
+	// true stops the walk. With uThreads > 1 folders are listed concurrently, callbacks must be
+	// thread-safe and come in no particular order. Returns false when a folder couldn't be opened
+	// or listed, the walk stops there; a callback stopping it is not a failure.
+	static bool		WalkFolder(const char* szFolder, bool bRecursive, walk_folder_callback filter, walk_folder_callback callback, uint32_t uThreads = 1);
+
 	static bool		PathRemoveFileSpec(string& path);
 
 private:
+	static bool ReadFolder(ZFolderNode* pFolder, int nAtFd, vector<pair<string, bool>>& arrEntries);
+	static void WalkFolderNode(const shared_ptr<ZFolderNode>& pFolder, int nAtFd, uint32_t uDepth, bool bRecursive, walk_folder_callback& filter, walk_folder_callback& callback, void* pState);
 	static int RemoveFolderCallBack(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf);
 
 private:
+	static mutex s_mtxFiles;
 	static map<void*, void*> s_mapFiles;
+	static atomic<uint32_t> s_uIOFlags;
 };
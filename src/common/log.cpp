@@ -1,7 +1,8 @@
 #include "log.h"
 
 
-int ZLog::g_nLogLevel = ZLog::E_INFO;
+atomic<int> ZLog::g_nLogLevel(ZLog::E_INFO);
+mutex ZLog::s_mtxPrint;
 
 void ZLog::_Print(const char* szLog, int nColor)
 {
@@ -9,6 +10,8 @@ void ZLog::_Print(const char* szLog, int nColor)
 		return;
 	}
 
+	lock_guard<mutex> lock(s_mtxPrint);
+
 #ifdef _WIN32
 
 	string strLog = szLog;
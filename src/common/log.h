@@ -33,5 +33,6 @@ public:
 
 private:
 	static void _Print(const char* szLog, int nColor = 0);
-	static int g_nLogLevel;
+	static atomic<int> g_nLogLevel;
+	static mutex s_mtxPrint; // keeps a colored line in one piece when several threads log
 };
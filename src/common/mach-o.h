@@ -129,6 +129,8 @@ typedef int	vm_prot_t;
 
 #define FAT_MAGIC 		0xcafebabe
 #define FAT_CIGAM 		0xbebafeca
+#define FAT_MAGIC_64 	0xcafebabf
+#define FAT_CIGAM_64 	0xbfbafeca
 
 #define MH_MAGIC 		0xfeedface
 #define MH_CIGAM 		0xcefaedfe
@@ -229,6 +231,22 @@ typedef int	vm_prot_t;
 #define LC_LINKER_OPTIMIZATION_HINT 0x0000002E
 #define LC_VERSION_MIN_TVOS         0x0000002F
 #define LC_VERSION_MIN_WATCHOS      0x00000030
+#define LC_NOTE                     0x00000031
+#define LC_BUILD_VERSION            0x00000032
+
+/* platforms of LC_BUILD_VERSION */
+#define PLATFORM_MACOS              1
+#define PLATFORM_IOS                2
+#define PLATFORM_TVOS               3
+#define PLATFORM_WATCHOS            4
+#define PLATFORM_BRIDGEOS           5
+#define PLATFORM_MACCATALYST        6
+#define PLATFORM_IOSSIMULATOR       7
+#define PLATFORM_TVOSSIMULATOR      8
+#define PLATFORM_WATCHOSSIMULATOR   9
+#define PLATFORM_DRIVERKIT          10
+#define PLATFORM_VISIONOS           11
+#define PLATFORM_VISIONOSSIMULATOR  12
 
 /* Constants for the flags field of the segment_command */
 #define	SG_HIGHVM	0x00000001 	/* the file contents for this segment is for
@@ -305,6 +323,16 @@ struct fat_arch
 	uint32_t align;			  /* alignment as a power of 2 */
 };
 
+struct fat_arch_64
+{
+	cpu_type_t cputype;		  /* cpu specifier (int) */
+	cpu_subtype_t cpusubtype; /* machine specifier (int) */
+	uint64_t offset;		  /* file offset to this object file */
+	uint64_t size;			  /* size of this object file */
+	uint32_t align;			  /* alignment as a power of 2 */
+	uint32_t reserved;		  /* reserved */
+};
+
 struct mach_header
 {
 	uint32_t magic;			  /* mach magic number identifier */
@@ -340,6 +368,28 @@ struct uuid_command {
   uint8_t uuid[16];
 };
 
+struct version_min_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t version;	/* X.Y.Z is encoded in nibbles xxxx.yy.zz */
+  uint32_t sdk;
+};
+
+struct build_version_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t platform;	/* PLATFORM_MACOS, PLATFORM_IOS, ... */
+  uint32_t minos;	/* X.Y.Z is encoded in nibbles xxxx.yy.zz */
+  uint32_t sdk;
+  uint32_t ntools;
+};
+
+struct rpath_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t path;	/* offset of the path string */
+};
+
 struct entry_point_command {
   uint32_t cmd;
   uint32_t cmdsize;
@@ -505,6 +555,59 @@ enum eCSFLAGS
 	CS_SEC_CODESIGNATURE_ADHOC = 0x0002,				/* kSecCodeSignatureAdhoc */
 };
 
+/*
+ * Code requirement expression language (Security/requirement.h).
+ */
+enum eReqOP
+{
+	opFalse = 0,					/* unconditionally false */
+	opTrue = 1,						/* unconditionally true */
+	opIdent = 2,					/* match canonical code [string] */
+	opAppleAnchor = 3,				/* signed by Apple as Apple's product */
+	opAnchorHash = 4,				/* match anchor [cert hash] */
+	opInfoKeyValue = 5,				/* *legacy* - use opInfoKeyField [key; value] */
+	opAnd = 6,						/* binary prefix expr AND expr [expr; expr] */
+	opOr = 7,						/* binary prefix expr OR expr [expr; expr] */
+	opCDHash = 8,					/* match hash of CodeDirectory directly [cd hash] */
+	opNot = 9,						/* logical inverse [expr] */
+	opInfoKeyField = 10,			/* Info.plist key field [string; match suffix] */
+	opCertField = 11,				/* Certificate field, existence only [cert index; field name; match suffix] */
+	opTrustedCert = 12,				/* require trust settings to approve one particular cert [cert index] */
+	opTrustedCerts = 13,			/* require trust settings to approve the cert chain */
+	opCertGeneric = 14,				/* Certificate component by OID [cert index; oid; match suffix] */
+	opAppleGenericAnchor = 15,		/* signed by Apple in any capacity */
+	opEntitlementField = 16,		/* entitlement dictionary field [string; match suffix] */
+	opCertPolicy = 17,				/* Certificate policy by OID [cert index; oid; match suffix] */
+	opNamedAnchor = 18,				/* named anchor type */
+	opNamedCode = 19,				/* named subroutine */
+	opPlatform = 20,				/* platform constraint [integer] */
+	opNotarized = 21,				/* has a developer id+ ticket */
+	opCertFieldDate = 22,			/* extension value as timestamp [cert index; field name; match suffix] */
+	opLegacyDevID = 23,				/* meets legacy (pre-notarization required) policy */
+	opFlagMask = 0xFF000000,		/* opcode flags */
+	opGenericFalse = 0x80000000,	/* unknown opcode => always false */
+	opGenericSkip = 0x40000000,		/* unknown opcode => skip */
+};
+
+enum eReqMatch
+{
+	matchExists = 0,				/* anything but explicit "false" - no value stored */
+	matchEqual = 1,					/* equal (CFEqual) */
+	matchContains = 2,				/* partial match (substring) */
+	matchBeginsWith = 3,			/* partial match (initial substring) */
+	matchEndsWith = 4,				/* partial match (terminal substring) */
+	matchLessThan = 5,				/* less than (string with numeric comparison) */
+	matchGreaterThan = 6,			/* greater than (string with numeric comparison) */
+	matchLessEqual = 7,				/* less or equal (string with numeric comparison) */
+	matchGreaterEqual = 8,			/* greater or equal (string with numeric comparison) */
+	matchOn = 9,					/* on (timestamp comparison) */
+	matchBefore = 10,				/* before (timestamp comparison) */
+	matchAfter = 11,				/* after (timestamp comparison) */
+	matchOnOrBefore = 12,			/* on or before (timestamp comparison) */
+	matchOnOrAfter = 13,			/* on or after (timestamp comparison) */
+	matchAbsent = 14,				/* not present (kCFNull) */
+};
+
 #pragma pack(push, 1)
 
 /*
@@ -0,0 +1,325 @@
+#include "pool.h"
+#include <list>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+atomic<uint32_t> ZThreadPool::s_uThreads(0);
+
+// A batch of work offered to the shared pool. Pool workers and the thread that offered it
+// pull units through RunOne, HasWork tells an idle worker whether pulling now gets anything.
+class ZPoolJob
+{
+public:
+	ZPoolJob(uint32_t uMaxWorkers)
+	{
+		m_uMaxWorkers = uMaxWorkers;
+		m_uWorkers = 0;
+	}
+	virtual ~ZPoolJob() {}
+
+	virtual bool HasWork() const = 0;
+	virtual bool RunOne() = 0; // false when no unit could be started
+
+public:
+	uint32_t	m_uMaxWorkers; // pool workers allowed on the job besides its owner
+	uint32_t	m_uWorkers; // pool workers holding the job, guarded by the pool lock
+};
+
+// Never destroyed: the workers are detached and may still wait on it while the process exits.
+struct ZPoolState
+{
+	mutex				mtx;
+	condition_variable	cvWork; // idle workers
+	condition_variable	cvReleased; // owners waiting for workers to let go of their job
+	list<ZPoolJob*>		lstJobs;
+	uint32_t			uWorkers;
+};
+
+static ZPoolState& GetPoolState()
+{
+	static ZPoolState* s_pState = new ZPoolState();
+	return *s_pState;
+}
+
+static ZPoolJob* FindPoolJob(ZPoolState& state)
+{
+	for (ZPoolJob* pJob : state.lstJobs) {
+		if (pJob->m_uWorkers < pJob->m_uMaxWorkers && pJob->HasWork()) {
+			return pJob;
+		}
+	}
+	return NULL;
+}
+
+static void PoolWorker()
+{
+	ZPoolState& state = GetPoolState();
+	unique_lock<mutex> lock(state.mtx);
+	while (true) {
+		ZPoolJob* pJob = NULL;
+		state.cvWork.wait(lock, [&]() {
+			return (NULL != (pJob = FindPoolJob(state)));
+		});
+
+		pJob->m_uWorkers++;
+		lock.unlock();
+		while (pJob->RunOne()) {
+		}
+		lock.lock();
+		pJob->m_uWorkers--;
+		state.cvReleased.notify_all();
+	}
+}
+
+// The owner runs units itself until the job has none left to start, then withdraws it and waits
+// for the workers still inside. Nested calls from a worker therefore never wait for a free worker,
+// and the process runs at most GetThreads() units at once, however deep the calls nest.
+static void RegisterPoolJob(ZPoolJob* pJob)
+{
+	ZPoolState& state = GetPoolState();
+	lock_guard<mutex> lock(state.mtx);
+	for (uint32_t uWorkers = ZThreadPool::GetThreads() - 1; state.uWorkers < uWorkers; state.uWorkers++) {
+		thread(PoolWorker).detach();
+	}
+	state.lstJobs.push_back(pJob);
+	state.cvWork.notify_all();
+}
+
+static void UnregisterPoolJob(ZPoolJob* pJob)
+{
+	ZPoolState& state = GetPoolState();
+	unique_lock<mutex> lock(state.mtx);
+	state.lstJobs.remove(pJob);
+	state.cvReleased.wait(lock, [&]() {
+		return (0 == pJob->m_uWorkers);
+	});
+}
+
+static void NotifyPoolWork()
+{
+	ZPoolState& state = GetPoolState();
+	lock_guard<mutex> lock(state.mtx);
+	state.cvWork.notify_all();
+}
+
+uint32_t ZThreadPool::GetThreads()
+{
+	uint32_t uThreads = s_uThreads.load();
+	if (uThreads > 0) {
+		return uThreads;
+	}
+
+	uThreads = thread::hardware_concurrency();
+	return (uThreads > 0) ? uThreads : 1;
+}
+
+void ZThreadPool::SetThreads(uint32_t uThreads)
+{
+	s_uThreads = uThreads;
+}
+
+class ZForJob : public ZPoolJob
+{
+public:
+	ZForJob(size_t uCount, const function<bool(size_t)>& func, uint32_t uMaxWorkers) : ZPoolJob(uMaxWorkers), m_func(func)
+	{
+		m_uCount = uCount;
+		m_uNext = 0;
+		m_uFailed = SIZE_MAX;
+	}
+
+	virtual bool HasWork() const
+	{
+		return (m_uNext.load() < m_uCount && SIZE_MAX == m_uFailed.load());
+	}
+
+	virtual bool RunOne()
+	{
+		size_t i = m_uNext++;
+		if (i >= m_uCount || i > m_uFailed.load()) {
+			return false;
+		}
+
+		if (!m_func(i)) {
+			size_t uCurrent = m_uFailed.load();
+			while (i < uCurrent && !m_uFailed.compare_exchange_weak(uCurrent, i)) {
+			}
+		}
+		return true;
+	}
+
+public:
+	size_t							m_uCount;
+	const function<bool(size_t)>&	m_func;
+	atomic<size_t>					m_uNext;
+	atomic<size_t>					m_uFailed;
+};
+
+bool ZThreadPool::ParallelFor(size_t uCount, const function<bool(size_t)>& func, uint32_t uThreads, size_t* pFailedIndex)
+{
+	if (0 == uThreads) {
+		uThreads = GetThreads();
+	}
+
+	if (uThreads > uCount) {
+		uThreads = (uint32_t)uCount;
+	}
+
+	if (uThreads <= 1) {
+		for (size_t i = 0; i < uCount; i++) {
+			if (!func(i)) {
+				if (NULL != pFailedIndex) {
+					*pFailedIndex = i;
+				}
+				return false;
+			}
+		}
+		return true;
+	}
+
+	ZForJob job(uCount, func, uThreads - 1);
+	RegisterPoolJob(&job);
+	while (job.RunOne()) {
+	}
+	UnregisterPoolJob(&job);
+
+	if (SIZE_MAX != job.m_uFailed.load()) {
+		if (NULL != pFailedIndex) {
+			*pFailedIndex = job.m_uFailed.load();
+		}
+		return false;
+	}
+	return true;
+}
+
+class ZGraphJob : public ZPoolJob
+{
+public:
+	ZGraphJob(const vector<vector<size_t>>& arrDeps, const function<bool(size_t)>& func, uint32_t uMaxWorkers) : ZPoolJob(uMaxWorkers), m_func(func)
+	{
+		m_uCount = arrDeps.size();
+		m_uRunning = 0;
+		m_uDone = 0;
+		m_uFailed = SIZE_MAX;
+		m_arrWaiting.assign(m_uCount, 0);
+		m_arrDependents.resize(m_uCount);
+		for (size_t i = 0; i < m_uCount; i++) {
+			m_arrWaiting[i] = arrDeps[i].size();
+			for (size_t uDep : arrDeps[i]) {
+				m_arrDependents[uDep].push_back(i);
+			}
+			if (0 == m_arrWaiting[i]) {
+				m_setReady.insert(i);
+			}
+		}
+		m_uReady = m_setReady.size();
+	}
+
+	virtual bool HasWork() const
+	{
+		return (m_uReady.load() > 0);
+	}
+
+	// lowest ready index first, nothing new is started after a failure
+	virtual bool RunOne()
+	{
+		size_t i = 0;
+		{
+			lock_guard<mutex> lock(m_mtx);
+			if (SIZE_MAX != m_uFailed || m_setReady.empty()) {
+				return false;
+			}
+			i = *m_setReady.begin();
+			m_setReady.erase(m_setReady.begin());
+			m_uReady = m_setReady.size();
+			m_uRunning++;
+		}
+
+		bool bRet = m_func(i);
+
+		bool bReady = false;
+		{
+			lock_guard<mutex> lock(m_mtx);
+			m_uRunning--;
+			m_uDone++;
+			if (bRet) {
+				for (size_t uNext : m_arrDependents[i]) {
+					if (0 == --m_arrWaiting[uNext]) {
+						m_setReady.insert(uNext);
+						bReady = true;
+					}
+				}
+			} else {
+				m_uFailed = min(m_uFailed, i);
+				m_setReady.clear();
+			}
+			m_uReady = m_setReady.size();
+		}
+		m_cv.notify_all();
+
+		if (bReady) {
+			NotifyPoolWork();
+		}
+		return true;
+	}
+
+	// the owner runs ready tasks and otherwise sleeps until one becomes ready or nothing is left
+	void Run()
+	{
+		while (true) {
+			if (RunOne()) {
+				continue;
+			}
+
+			unique_lock<mutex> lock(m_mtx);
+			m_cv.wait(lock, [&]() {
+				return (!m_setReady.empty() || 0 == m_uRunning);
+			});
+			if (m_setReady.empty()) {
+				return;
+			}
+		}
+	}
+
+public:
+	size_t							m_uCount;
+	const function<bool(size_t)>&	m_func;
+	mutex							m_mtx;
+	condition_variable				m_cv;
+	vector<size_t>					m_arrWaiting;
+	vector<vector<size_t>>			m_arrDependents;
+	set<size_t>						m_setReady;
+	atomic<size_t>					m_uReady;
+	size_t							m_uRunning;
+	size_t							m_uDone;
+	size_t							m_uFailed;
+};
+
+bool ZThreadPool::ParallelGraph(const vector<vector<size_t>>& arrDeps, const function<bool(size_t)>& func, uint32_t uThreads, size_t* pFailedIndex)
+{
+	if (0 == uThreads) {
+		uThreads = GetThreads();
+	}
+
+	if (uThreads > arrDeps.size()) {
+		uThreads = (uint32_t)arrDeps.size();
+	}
+
+	ZGraphJob job(arrDeps, func, (uThreads > 1) ? (uThreads - 1) : 0);
+	if (uThreads > 1) {
+		RegisterPoolJob(&job);
+	}
+	job.Run();
+	if (uThreads > 1) {
+		UnregisterPoolJob(&job);
+	}
+
+	if (SIZE_MAX != job.m_uFailed) {
+		if (NULL != pFailedIndex) {
+			*pFailedIndex = job.m_uFailed;
+		}
+		return false;
+	}
+	return (job.m_uDone == job.m_uCount);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+
+class ZThreadPool
+{
+public:
+	static uint32_t GetThreads();
+	static void SetThreads(uint32_t uThreads);
+
+	// Both run on one process-wide pool of GetThreads() - 1 workers plus the calling thread,
+	// which keeps working on its own call, so they may be nested from inside func.
+
+	// Runs func(0) ... func(uCount - 1) on up to uThreads workers (0 = GetThreads()).
+	// Indexes are handed out in ascending order. When a call fails, no index above
+	// it is started and the lowest failing index is reported, so the result does
+	// not depend on scheduling.
+	static bool ParallelFor(size_t uCount, const function<bool(size_t)>& func, uint32_t uThreads = 0, size_t* pFailedIndex = NULL);
+
+	// Runs func(i) for every task once all of arrDeps[i] have succeeded, lowest ready index
+	// first. After a failure no new task is started; the lowest failing index is reported.
+	static bool ParallelGraph(const vector<vector<size_t>>& arrDeps, const function<bool(size_t)>& func, uint32_t uThreads = 0, size_t* pFailedIndex = NULL);
+
+private:
+	static atomic<uint32_t> s_uThreads;
+};
@@ -1,6 +1,7 @@
 #include "sha.h"
 #include "base64.h"
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 bool ZSHA::SHA1(uint8_t* data, size_t size, string& strOutput)
 {
@@ -22,6 +23,17 @@ bool ZSHA::SHA256(uint8_t* data, size_t size, string& strOutput)
 	return true;
 }
 
+// digest straight into pOutput (20 or 32 bytes), no string in between
+void ZSHA::SHA1(const uint8_t* data, size_t size, uint8_t* pOutput)
+{
+	::SHA1(data, size, pOutput);
+}
+
+void ZSHA::SHA256(const uint8_t* data, size_t size, uint8_t* pOutput)
+{
+	::SHA256(data, size, pOutput);
+}
+
 bool ZSHA::SHA1(const string& strData, string& strOutput)
 {
 	return ZSHA::SHA1((uint8_t*)strData.data(), strData.size(), strOutput);
@@ -57,9 +69,12 @@ bool ZSHA::SHAFile(const char* szFile, string& strSHA1, string& strSHA256)
 {
 	strSHA1.clear();
 	strSHA256.clear();
-	size_t sSize = 0;
-	uint8_t* pBase = (uint8_t*)ZFile::MapFile(szFile, 0, 0, &sSize, true);
-	// pBase may be NULL, but it's ok, because the file may be empty
+	size_t sSize = SIZE_MAX; // MapFile only sets the size once the file is open
+	uint8_t* pBase = (uint8_t*)ZFile::MapFile(szFile, 0, 0, &sSize, true, ZFile::GetIOFlags());
+	if (NULL == pBase && 0 != sSize) { // NULL is fine for an empty file, not for one we couldn't open or map
+		ZLog::ErrorV("SHAFile: Failed to map file! %s, %s\n", szFile, strerror(errno));
+		return false;
+	}
 	ZSHA::SHA1(pBase, sSize, strSHA1);
 	ZSHA::SHA256(pBase, sSize, strSHA256);
 	if (NULL != pBase && sSize > 0) {
@@ -84,12 +99,49 @@ bool ZSHA::SHABase64File(const char* szFile, string& strSHA1Base64, string& strS
 	jbase64 b64;
 	string strSHA1;
 	string strSHA256;
-	SHAFile(szFile, strSHA1, strSHA256);
+	if (!SHAFile(szFile, strSHA1, strSHA256)) {
+		strSHA1Base64.clear();
+		strSHA256Base64.clear();
+		return false;
+	}
 	strSHA1Base64 = b64.encode(strSHA1);
 	strSHA256Base64 = b64.encode(strSHA256);
 	return (!strSHA1Base64.empty() && !strSHA256Base64.empty());
 }
 
+bool ZSHA::SHAWriteFile(const char* szFile, const string& strData, string& strSHA1, string& strSHA256)
+{
+	strSHA1.clear();
+	strSHA256.clear();
+
+	FILE* fp = NULL;
+	_fopen64(fp, szFile, "wb");
+	if (NULL == fp) {
+		ZLog::ErrorV("SHAWriteFile: Failed in fopen! %s, %s\n", szFile, strerror(errno));
+		return false;
+	}
+
+	// hash each chunk while it is still hot in cache, right before it is written
+	ZSHAHasher hasher;
+	size_t written = 0;
+	size_t to_write = strData.size();
+	while (written < to_write) {
+		size_t chunk = min(to_write - written, (size_t)(1024 * 1024));
+		hasher.Update((const uint8_t*)strData.data() + written, chunk);
+		size_t ret = fwrite(strData.data() + written, 1, chunk, fp);
+		if (ret != chunk) {
+			break;
+		}
+		written += ret;
+	}
+	fclose(fp);
+
+	if (written != to_write) {
+		return false;
+	}
+	return hasher.Final(strSHA1, strSHA256);
+}
+
 void ZSHA::Print(const char* prefix, const uint8_t* hash, uint32_t size, const char* suffix)
 {
 	ZLog::PrintV("%s", prefix);
@@ -131,3 +183,67 @@ void ZSHA::PrintData256(const char* prefix, uint8_t* data, size_t size, const ch
 	ZSHA::SHA256(data, size, strSHASum);
 	Print(prefix, strSHASum, suffix);
 }
+
+ZSHAHasher::ZSHAHasher()
+{
+	m_pSHA1Ctx = EVP_MD_CTX_new();
+	m_pSHA256Ctx = EVP_MD_CTX_new();
+	Reset();
+}
+
+ZSHAHasher::~ZSHAHasher()
+{
+	EVP_MD_CTX_free((EVP_MD_CTX*)m_pSHA1Ctx);
+	EVP_MD_CTX_free((EVP_MD_CTX*)m_pSHA256Ctx);
+}
+
+void ZSHAHasher::Reset()
+{
+	EVP_DigestInit_ex((EVP_MD_CTX*)m_pSHA1Ctx, EVP_sha1(), NULL);
+	EVP_DigestInit_ex((EVP_MD_CTX*)m_pSHA256Ctx, EVP_sha256(), NULL);
+}
+
+void ZSHAHasher::Update(const uint8_t* data, size_t size)
+{
+	// feed both digests block by block, so large inputs are only pulled into cache once
+	const size_t block = 64 * 1024;
+	for (size_t offset = 0; NULL != data && offset < size; offset += block) {
+		size_t len = min(block, size - offset);
+		EVP_DigestUpdate((EVP_MD_CTX*)m_pSHA1Ctx, data + offset, len);
+		EVP_DigestUpdate((EVP_MD_CTX*)m_pSHA256Ctx, data + offset, len);
+	}
+}
+
+void ZSHAHasher::Update(const string& strData)
+{
+	Update((const uint8_t*)strData.data(), strData.size());
+}
+
+bool ZSHAHasher::Final(string& strSHA1, string& strSHA256)
+{
+	strSHA1.clear();
+	strSHA256.clear();
+
+	uint8_t hash1[20];
+	uint8_t hash256[32];
+	unsigned int len1 = 0;
+	unsigned int len256 = 0;
+	EVP_DigestFinal_ex((EVP_MD_CTX*)m_pSHA1Ctx, hash1, &len1);
+	EVP_DigestFinal_ex((EVP_MD_CTX*)m_pSHA256Ctx, hash256, &len256);
+	Reset();
+
+	strSHA1.append((const char*)hash1, len1);
+	strSHA256.append((const char*)hash256, len256);
+	return (20 == len1 && 32 == len256);
+}
+
+bool ZSHAHasher::FinalBase64(string& strSHA1Base64, string& strSHA256Base64)
+{
+	jbase64 b64;
+	string strSHA1;
+	string strSHA256;
+	bool bRet = Final(strSHA1, strSHA256);
+	strSHA1Base64 = b64.encode(strSHA1);
+	strSHA256Base64 = b64.encode(strSHA256);
+	return bRet;
+}
@@ -10,11 +10,14 @@ public:
 	static bool SHA1(const string& strData, string& strOutput);
 	static bool SHA256(uint8_t* data, size_t size, string& strOutput);
 	static bool SHA256(const string& strData, string& strOutput);
+	static void SHA1(const uint8_t* data, size_t size, uint8_t* pOutput);
+	static void SHA256(const uint8_t* data, size_t size, uint8_t* pOutput);
 	static bool SHA(const string& strData, string& strSHA1, string& strSHA256);
 	static bool SHA1Text(const string& strData, string& strOutput);
 	static bool SHAFile(const char* szFile, string& strSHA1, string& strSHA256);
 	static bool SHABase64(const string& strData, string& strSHA1Base64, string& strSHA256Base64);
 	static bool SHABase64File(const char* szFile, string& strSHA1Base64, string& strSHA256Base64);
+	static bool SHAWriteFile(const char* szFile, const string& strData, string& strSHA1, string& strSHA256);
 	static void Print(const char* prefix, const uint8_t* hash, uint32_t size, const char* suffix = "\n");
 	static void Print(const char* prefix, const string& strSHASum, const char* suffix = "\n");
 	static void PrintData1(const char* prefix, const string& strData, const char* suffix = "\n");
@@ -22,3 +25,21 @@ public:
 	static void PrintData256(const char* prefix, const string& strData, const char* suffix = "\n");
 	static void PrintData256(const char* prefix, uint8_t* data, size_t size, const char* suffix = "\n");
 };
+
+class ZSHAHasher
+{
+public:
+	ZSHAHasher();
+	~ZSHAHasher();
+
+public:
+	void Reset();
+	void Update(const uint8_t* data, size_t size);
+	void Update(const string& strData);
+	bool Final(string& strSHA1, string& strSHA256);
+	bool FinalBase64(string& strSHA1Base64, string& strSHA256Base64);
+
+private:
+	void* m_pSHA1Ctx;
+	void* m_pSHA256Ctx;
+};
@@ -0,0 +1,289 @@
+#include "tree.h"
+#include "pool.h"
+
+#ifdef _WIN32
+const char ZFileTree::s_chSeparator = '\\';
+#else
+const char ZFileTree::s_chSeparator = '/';
+#endif
+
+ZFileTree::ZFileTree()
+{
+	m_bScanned = false;
+}
+
+int64_t ZFileTree::StatFileSize(const string& strPath)
+{
+	int64_t nSize = 0;
+	int64_t nMTime = 0;
+	uint64_t uInode = 0;
+	ZFile::GetFileStat(strPath.c_str(), nSize, nMTime, uInode);
+	return nSize;
+}
+
+bool ZFileTree::IsBundleName(const string& strName)
+{
+	return (ZFile::IsPathSuffix(strName, ".app") ||
+			ZFile::IsPathSuffix(strName, ".appex") ||
+			ZFile::IsPathSuffix(strName, ".framework") ||
+			ZFile::IsPathSuffix(strName, ".xctest"));
+}
+
+bool ZFileTree::Scan(const string& strRoot)
+{
+	unique_lock<recursive_mutex> lock(m_mtxEntries);
+	m_bScanned = false;
+	m_strRoot = strRoot;
+	while (m_strRoot.size() > 1 && ('/' == m_strRoot.back() || '\\' == m_strRoot.back())) {
+		m_strRoot.pop_back();
+	}
+	m_mapEntries.clear();
+	Insert("", true, 0);
+	lock.unlock();
+
+	// folders are listed concurrently, only the insert is serialized
+	bool bRet = ZFile::WalkFolder(m_strRoot.c_str(), true, NULL, [&](const ZFolderEntry& entry) {
+		string strRelPath = entry.GetPath().substr(m_strRoot.size() + 1);
+		ZUtil::StringReplace(strRelPath, "\\", "/");
+		int64_t nSize = entry.IsFolder() ? 0 : entry.GetFileSize();
+		lock_guard<recursive_mutex> lock(m_mtxEntries);
+		Insert(strRelPath, entry.IsFolder(), nSize);
+		return false;
+	}, ZThreadPool::GetThreads());
+
+	lock.lock();
+	m_bScanned = bRet;
+	return bRet;
+}
+
+bool ZFileTree::GetRelativePath(const string& strPath, string& strRelPath) const
+{
+	if (!m_bScanned || 0 != strPath.compare(0, m_strRoot.size(), m_strRoot)) {
+		return false;
+	}
+
+	if (strPath.size() == m_strRoot.size()) {
+		strRelPath.clear();
+		return true;
+	}
+
+	char ch = strPath[m_strRoot.size()];
+	if ('/' != ch && '\\' != ch) {
+		return false;
+	}
+
+	strRelPath = strPath.substr(m_strRoot.size() + 1);
+	ZUtil::StringReplace(strRelPath, "\\", "/");
+	return true;
+}
+
+string ZFileTree::GetFullPath(const string& strRelPath) const
+{
+	if (strRelPath.empty()) {
+		return m_strRoot;
+	}
+
+	string strPath = m_strRoot + s_chSeparator + strRelPath;
+#ifdef _WIN32
+	ZUtil::StringReplace(strPath, "/", "\\");
+#endif
+	return strPath;
+}
+
+bool ZFileTree::Contains(const string& strPath) const
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	return GetRelativePath(strPath, strRelPath) && (m_mapEntries.end() != m_mapEntries.find(strRelPath));
+}
+
+void ZFileTree::Insert(const string& strRelPath, bool bFolder, int64_t nSize)
+{
+	Entry& entry = m_mapEntries[strRelPath];
+	entry.bFolder = bFolder;
+	entry.nSize = nSize;
+	entry.bMagicRead = false;
+	entry.uMagic = 0;
+
+	if (strRelPath.empty()) {
+		entry.bBundle = IsBundleName(m_strRoot);
+		return;
+	}
+
+	entry.bBundle = bFolder && IsBundleName(strRelPath);
+
+	size_t pos = strRelPath.rfind('/');
+	string strParent = (string::npos == pos) ? "" : strRelPath.substr(0, pos);
+	string strName = (string::npos == pos) ? strRelPath : strRelPath.substr(pos + 1);
+	if (m_mapEntries.end() == m_mapEntries.find(strParent)) {
+		Insert(strParent, true, 0);
+	}
+	m_mapEntries[strParent].setChildren.insert(strName);
+}
+
+void ZFileTree::AddFile(const string& strPath)
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	if (GetRelativePath(strPath, strRelPath) && !strRelPath.empty()) {
+		Insert(strRelPath, false, StatFileSize(strPath));
+	}
+}
+
+void ZFileTree::AddFolder(const string& strPath)
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	if (GetRelativePath(strPath, strRelPath) && !strRelPath.empty()) {
+		auto it = m_mapEntries.find(strRelPath);
+		if (m_mapEntries.end() == it || !it->second.bFolder) {
+			Insert(strRelPath, true, 0);
+		}
+	}
+}
+
+void ZFileTree::Remove(const string& strPath)
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	if (!GetRelativePath(strPath, strRelPath) || strRelPath.empty()) {
+		return;
+	}
+
+	auto it = m_mapEntries.find(strRelPath);
+	if (m_mapEntries.end() == it) {
+		return;
+	}
+
+	vector<string> arrChildren(it->second.setChildren.begin(), it->second.setChildren.end());
+	for (const string& strName : arrChildren) {
+		Remove(GetFullPath(strRelPath + "/" + strName));
+	}
+	m_mapEntries.erase(strRelPath);
+
+	size_t pos = strRelPath.rfind('/');
+	string strParent = (string::npos == pos) ? "" : strRelPath.substr(0, pos);
+	string strName = (string::npos == pos) ? strRelPath : strRelPath.substr(pos + 1);
+	auto itParent = m_mapEntries.find(strParent);
+	if (m_mapEntries.end() != itParent) {
+		itParent->second.setChildren.erase(strName);
+	}
+}
+
+bool ZFileTree::IsBundle(const string& strPath) const
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	if (GetRelativePath(strPath, strRelPath)) {
+		auto it = m_mapEntries.find(strRelPath);
+		if (m_mapEntries.end() != it) {
+			return it->second.bBundle;
+		}
+	}
+	return false;
+}
+
+int64_t ZFileTree::GetFileSize(const string& strPath) const
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	if (GetRelativePath(strPath, strRelPath)) {
+		auto it = m_mapEntries.find(strRelPath);
+		if (m_mapEntries.end() != it) {
+			return it->second.nSize;
+		}
+	}
+	return StatFileSize(strPath);
+}
+
+uint32_t ZFileTree::GetMachOMagic(const string& strPath) const
+{
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	string strRelPath;
+	const Entry* pEntry = NULL;
+	if (GetRelativePath(strPath, strRelPath)) {
+		auto it = m_mapEntries.find(strRelPath);
+		if (m_mapEntries.end() != it) {
+			pEntry = &it->second;
+			if (pEntry->bFolder) {
+				return 0;
+			}
+			if (pEntry->bMagicRead) {
+				return pEntry->uMagic;
+			}
+		}
+	}
+
+	// read on first use only, most files are never asked for
+	uint32_t uMagic = 0;
+	FILE* fp = NULL;
+	_fopen64(fp, strPath.c_str(), "rb");
+	if (NULL != fp) {
+		if (1 != fread(&uMagic, sizeof(uMagic), 1, fp)) {
+			uMagic = 0;
+		}
+		fclose(fp);
+	}
+
+	if (NULL != pEntry) {
+		pEntry->uMagic = uMagic;
+		pEntry->bMagicRead = true;
+	}
+	return uMagic;
+}
+
+bool ZFileTree::EnumEntry(const string& strRelPath, bool bRecursive, enum_folder_callback& filter, enum_folder_callback& callback) const
+{
+	auto it = m_mapEntries.find(strRelPath);
+	if (m_mapEntries.end() == it) {
+		return false;
+	}
+
+	for (const string& strName : it->second.setChildren) {
+		string strChildRelPath = strRelPath.empty() ? strName : (strRelPath + "/" + strName);
+		auto itChild = m_mapEntries.find(strChildRelPath);
+		if (m_mapEntries.end() == itChild) {
+			continue;
+		}
+
+		bool bFolder = itChild->second.bFolder;
+		string strPath = GetFullPath(strChildRelPath);
+		if (NULL != filter) {
+			if (filter(bFolder, strPath)) {
+				continue;
+			}
+		}
+
+		if (callback(bFolder, strPath)) {
+			return true;
+		}
+
+		if (bFolder && bRecursive) {
+			if (EnumEntry(strChildRelPath, bRecursive, filter, callback)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool ZFileTree::EnumFolder(const string& strFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback) const
+{
+	string strRelPath;
+	if (NULL == callback) {
+		return false;
+	}
+
+	if (!GetRelativePath(strFolder, strRelPath)) {
+		return ZFile::EnumFolder(strFolder.c_str(), bRecursive, filter, callback);
+	}
+
+	lock_guard<recursive_mutex> lock(m_mtxEntries);
+	auto it = m_mapEntries.find(strRelPath);
+	if (m_mapEntries.end() == it || !it->second.bFolder) {
+		return false;
+	}
+
+	EnumEntry(strRelPath, bRecursive, filter, callback);
+	return true;
+}
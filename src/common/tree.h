@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+
+// In-memory snapshot of a folder tree, scanned once and queried by every stage
+// of a job instead of walking the disk again. Files zsign creates or removes
+// afterwards must be reported through AddFile/AddFolder/Remove. Safe to share
+// between threads; EnumFolder holds the lock while it calls back.
+class ZFileTree
+{
+public:
+	ZFileTree();
+
+public:
+	bool		Scan(const string& strRoot);
+	bool		IsScanned() const { return m_bScanned; }
+	const string& GetRoot() const { return m_strRoot; }
+	bool		Contains(const string& strPath) const;
+
+	// same contract as ZFile::EnumFolder, in sorted order. Paths outside the tree fall back to disk.
+	bool		EnumFolder(const string& strFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback) const;
+
+	bool		IsBundle(const string& strPath) const;
+	int64_t		GetFileSize(const string& strPath) const;
+	uint32_t	GetMachOMagic(const string& strPath) const;
+
+	void		AddFile(const string& strPath);
+	void		AddFolder(const string& strPath);
+	void		Remove(const string& strPath);
+
+	static bool	IsBundleName(const string& strName);
+
+private:
+	struct Entry
+	{
+		bool			bFolder;
+		bool			bBundle;
+		int64_t			nSize;
+		mutable bool	bMagicRead;
+		mutable uint32_t uMagic;
+		set<string>		setChildren;
+	};
+
+private:
+	static int64_t StatFileSize(const string& strPath);
+	bool		GetRelativePath(const string& strPath, string& strRelPath) const;
+	string		GetFullPath(const string& strRelPath) const;
+	void		Insert(const string& strRelPath, bool bFolder, int64_t nSize);
+	bool		EnumEntry(const string& strRelPath, bool bRecursive, enum_folder_callback& filter, enum_folder_callback& callback) const;
+
+private:
+	bool				m_bScanned;
+	string				m_strRoot;
+	map<string, Entry>	m_mapEntries; // by path relative to root, "/" separated, "" is root
+	mutable recursive_mutex m_mtxEntries;
+	static const char	s_chSeparator;
+};
@@ -4,12 +4,14 @@
 #include "openssl.h"
 #include "signing.h"
 #include "macho.h"
+#include "requirement.h"
+#include "pool.h"
 
 ZMachO::ZMachO()
 {
 	m_pBase = NULL;
 	m_sSize = 0;
-	m_bCSRealloced = false;
+	m_bReadOnly = false;
 }
 
 ZMachO::~ZMachO()
@@ -20,6 +22,7 @@ ZMachO::~ZMachO()
 bool ZMachO::Init(const char* szFile)
 {
 	m_strFile = szFile;
+	m_bReadOnly = (0 != (ZFile::GetIOFlags() & ZFile::E_IO_PWRITE));
 	return OpenFile(szFile);
 }
 
@@ -35,10 +38,15 @@ bool ZMachO::Free()
 	return CloseFile();
 }
 
-bool ZMachO::NewArchO(uint8_t* pBase, uint32_t uLength)
+bool ZMachO::NewArchO(uint8_t* pBase, uint64_t uLength)
 {
+	if (uLength > UINT32_MAX) { // LC_CODE_SIGNATURE only has 32-bit offsets
+		ZLog::ErrorV(">>> Mach-O slice larger than 4GB can't be signed! (%llu)\n", (unsigned long long)uLength);
+		return false;
+	}
+
 	ZArchO* archo = new ZArchO();
-	if (archo->Init(pBase, uLength)) {
+	if (archo->Init(pBase, (uint32_t)uLength)) {
 		m_arrArchOes.push_back(archo);
 		return true;
 	}
@@ -46,6 +54,52 @@ bool ZMachO::NewArchO(uint8_t* pBase, uint32_t uLength)
 	return false;
 }
 
+// the arch table of a fat file, fat_arch or fat_arch_64 in either byte order, converted to host order
+bool ZMachO::GetFatArches(vector<fat_arch_64>& arrArches) const
+{
+	arrArches.clear();
+	if (NULL == m_pBase || m_sSize < sizeof(fat_header)) {
+		return false;
+	}
+
+	fat_header* pFatHeader = (fat_header*)m_pBase;
+	bool bSwap = (FAT_CIGAM == pFatHeader->magic || FAT_CIGAM_64 == pFatHeader->magic);
+	bool b64 = (FAT_MAGIC_64 == pFatHeader->magic || FAT_CIGAM_64 == pFatHeader->magic);
+	uint32_t uArches = bSwap ? LE(pFatHeader->nfat_arch) : pFatHeader->nfat_arch;
+	if (sizeof(fat_header) + (uint64_t)uArches * (b64 ? sizeof(fat_arch_64) : sizeof(fat_arch)) > m_sSize) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < uArches; i++) {
+		fat_arch_64 arch = { 0 };
+		if (b64) {
+			arch = *((fat_arch_64*)(m_pBase + sizeof(fat_header) + sizeof(fat_arch_64) * i));
+			if (bSwap) {
+				arch.offset = LE(arch.offset);
+				arch.size = LE(arch.size);
+			}
+		} else {
+			fat_arch arch32 = *((fat_arch*)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i));
+			arch.cputype = arch32.cputype;
+			arch.cpusubtype = arch32.cpusubtype;
+			arch.offset = bSwap ? LE(arch32.offset) : arch32.offset;
+			arch.size = bSwap ? LE(arch32.size) : arch32.size;
+			arch.align = arch32.align;
+		}
+		if (bSwap) {
+			arch.cputype = (cpu_type_t)LE((uint32_t)arch.cputype);
+			arch.cpusubtype = (cpu_subtype_t)LE((uint32_t)arch.cpusubtype);
+			arch.align = LE(arch.align);
+		}
+
+		if (arch.offset > m_sSize || arch.size > m_sSize - arch.offset) {
+			return false;
+		}
+		arrArches.push_back(arch);
+	}
+	return true;
+}
+
 void ZMachO::FreeArchOes()
 {
 	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
@@ -62,23 +116,23 @@ bool ZMachO::OpenFile(const char* szPath)
 	FreeArchOes();
 
 	m_sSize = 0;
-	m_pBase = (uint8_t*)ZFile::MapFile(szPath, 0, 0, &m_sSize, false);
+	m_pBase = (uint8_t*)ZFile::MapFile(szPath, 0, 0, &m_sSize, m_bReadOnly, ZFile::GetIOFlags());
 	if (NULL != m_pBase) {
 		uint32_t magic = *((uint32_t*)m_pBase);
-		if (FAT_CIGAM == magic || FAT_MAGIC == magic) {
-			fat_header* pFatHeader = (fat_header*)m_pBase;
-			int nFatArch = (FAT_MAGIC == magic) ? pFatHeader->nfat_arch : LE(pFatHeader->nfat_arch);
-			for (int i = 0; i < nFatArch; i++) {
-				fat_arch* pFatArch = (fat_arch*)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i);
-				uint8_t* pArchBase = m_pBase + ((FAT_MAGIC == magic) ? pFatArch->offset : LE(pFatArch->offset));
-				uint32_t uArchLength = (FAT_MAGIC == magic) ? pFatArch->size : LE(pFatArch->size);
-				if (!NewArchO(pArchBase, uArchLength)) {
+		if (FAT_CIGAM == magic || FAT_MAGIC == magic || FAT_CIGAM_64 == magic || FAT_MAGIC_64 == magic) {
+			vector<fat_arch_64> arrArches;
+			if (!GetFatArches(arrArches)) {
+				ZLog::ErrorV(">>> Invalid fat mach-o file!\n");
+				return false;
+			}
+			for (const fat_arch_64& arch : arrArches) {
+				if (!NewArchO(m_pBase + arch.offset, arch.size)) {
 					ZLog::ErrorV(">>> Invalid arch file in fat mach-o file!\n");
 					return false;
 				}
 			}
 		} else if (MH_MAGIC == magic || MH_CIGAM == magic || MH_MAGIC_64 == magic || MH_CIGAM_64 == magic) {
-			if (!NewArchO(m_pBase, (uint32_t)m_sSize)) {
+			if (!NewArchO(m_pBase, m_sSize)) {
 				ZLog::ErrorV(">>> Invalid mach-o file!\n");
 				return false;
 			}
@@ -121,78 +175,275 @@ bool ZMachO::CheckSignature() const
 	);
 }
 
-bool ZMachO::Sign(ZSignAsset* pSignAsset, bool bForce, string strBundleId, string strInfoSHA1, string strInfoSHA256, const string& strCodeResourcesData)
+// Summary of a Mach-O file for batch inventory. The file is mapped read-only, nothing is logged and
+// parse errors go to jvInfo["error"]. Returns false if szFile isn't a Mach-O file at all.
+bool ZMachO::Inspect(const char* szFile, jvalue& jvInfo)
+{
+	uint32_t magic = 0;
+	FILE* fp = fopen(szFile, "rb");
+	if (NULL == fp) {
+		jvInfo["path"] = szFile;
+		jvInfo["error"] = "can't open file";
+		return true;
+	}
+	size_t sRead = fread(&magic, 1, sizeof(magic), fp);
+	fclose(fp);
+
+	bool bFat = (FAT_CIGAM == magic || FAT_MAGIC == magic || FAT_CIGAM_64 == magic || FAT_MAGIC_64 == magic);
+	if (sizeof(magic) != sRead || (!bFat && MH_MAGIC != magic && MH_CIGAM != magic && MH_MAGIC_64 != magic && MH_CIGAM_64 != magic)) {
+		return false;
+	}
+
+	FreeArchOes();
+	m_strFile = szFile;
+	m_pBase = (uint8_t*)ZFile::MapFile(szFile, 0, 0, &m_sSize, true);
+	jvInfo["path"] = szFile;
+	if (NULL == m_pBase) {
+		jvInfo["error"] = "can't map file";
+		return true;
+	}
+
+	jvInfo["size"] = (int64_t)m_sSize;
+	jvInfo["fat"] = bFat;
+	jvInfo["arches"] = jvalue(jvalue::E_ARRAY);
+
+	vector<fat_arch_64> arrArches;
+	if (!bFat) {
+		fat_arch_64 arch = { 0 };
+		arch.size = m_sSize;
+		arrArches.push_back(arch);
+	} else if (!GetFatArches(arrArches)) {
+		jvInfo["error"] = "invalid fat header";
+	}
+
+	for (const fat_arch_64& arch : arrArches) {
+		jvalue jvArch;
+		jvArch["offset"] = (int64_t)arch.offset;
+		jvArch["size"] = (int64_t)arch.size;
+
+		ZArchInfo info;
+		if (arch.size > UINT32_MAX || !ZArchO::Parse(m_pBase + arch.offset, (uint32_t)arch.size, info)) {
+			jvArch["error"] = "invalid mach-o slice";
+			jvInfo["arches"].push_back(jvArch);
+			continue;
+		}
+
+		jvArch["arch"] = ZArchO::GetArch(info.uCPUType, info.uCPUSubType);
+		jvArch["cputype"] = (int64_t)info.uCPUType;
+		jvArch["cpusubtype"] = (int64_t)info.uCPUSubType;
+		jvArch["bits"] = info.b64Bit ? 64 : 32;
+		jvArch["big_endian"] = info.bBigEndian;
+		jvArch["filetype"] = ZArchO::GetFileType(info.uFileType);
+		jvArch["encrypted"] = info.bEncrypted;
+		jvArch["signed"] = (info.uCodeSignCommand > 0);
+		jvArch["sign_size"] = (int64_t)info.uSignSize;
+		jvArch["free_space"] = (int64_t)info.uLoadCommandsFreeSpace;
+		jvArch["info_plist"] = (info.uInfoPlistSize > 0);
+
+		if (info.bHasUUID) {
+			const uint8_t* u = info.arrUUID;
+			string strUUID;
+			jvArch["uuid"] = ZUtil::StringFormatV(strUUID, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+				u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+		}
+
+		if (info.uMinOSCommand > 0) {
+			string strMinOS;
+			jvArch["platform"] = ZArchO::GetPlatform(info.uPlatform);
+			jvArch["min_os"] = ZUtil::StringFormatV(strMinOS, "%u.%u.%u", info.uMinOS >> 16, (info.uMinOS >> 8) & 0xff, info.uMinOS & 0xff);
+		}
+
+		if (!info.strInstallName.empty()) {
+			jvArch["install_name"] = info.strInstallName;
+		}
+
+		jvArch["rpaths"] = jvalue(jvalue::E_ARRAY);
+		for (const string& strRPath : info.arrRPaths) {
+			jvArch["rpaths"].push_back(strRPath);
+		}
+
+		if (info.uSignSize >= sizeof(CS_SuperBlob)) {
+			const uint8_t* pCSBase = m_pBase + arch.offset + info.uSignOffset;
+			const CS_SuperBlob* psb = (const CS_SuperBlob*)pCSBase;
+			uint32_t uCount = BE(psb->count);
+			if (CSMAGIC_EMBEDDED_SIGNATURE == BE(psb->magic) && (uint64_t)uCount * sizeof(CS_BlobIndex) <= info.uSignSize - sizeof(CS_SuperBlob)) {
+				const CS_BlobIndex* pbi = (const CS_BlobIndex*)(pCSBase + sizeof(CS_SuperBlob));
+				for (uint32_t i = 0; i < uCount; i++, pbi++) {
+					uint32_t uOffset = BE(pbi->offset);
+					string strRequirements;
+					if (CSSLOT_REQUIREMENTS == BE(pbi->type) && uOffset < info.uSignSize &&
+						ZRequirement::Decompile(pCSBase + uOffset, info.uSignSize - uOffset, strRequirements)) {
+						strRequirements.erase(strRequirements.find_last_not_of('\n') + 1);
+						jvArch["requirements"] = strRequirements;
+					}
+				}
+			}
+		}
+
+		jvArch["dylibs"] = jvalue(jvalue::E_ARRAY);
+		jvArch["weak_dylibs"] = jvalue(jvalue::E_ARRAY);
+		for (const pair<string, bool>& dylib : info.arrDylibs) {
+			jvArch[dylib.second ? "weak_dylibs" : "dylibs"].push_back(dylib.first);
+		}
+
+		jvInfo["arches"].push_back(jvArch);
+	}
+
+	ZFile::UnmapFile(m_pBase, m_sSize);
+	m_pBase = NULL;
+	m_sSize = 0;
+	return true;
+}
+
+bool ZMachO::Sign(ZSignAsset* pSignAsset, 
+					bool bForce, 
+					string strBundleId, 
+					string strInfoSHA1, 
+					string strInfoSHA256, 
+					const string& strCodeResourcesSHA1, 
+					const string& strCodeResourcesSHA256, 
+					ZSHAHasher* pFileHasher)
 {
 	if (NULL == m_pBase || m_arrArchOes.empty()) {
 		return false;
 	}
 
-	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
-		ZArchO* archo = m_arrArchOes[i];
+	ZArchO* pFirstArchO = m_arrArchOes[0];
+	if (strBundleId.empty()) {
+		jvalue jvInfo;
+		jvInfo.read_plist(pFirstArchO->m_strInfoPlist);
+		strBundleId = jvInfo["CFBundleIdentifier"].as_cstr();
 		if (strBundleId.empty()) {
-			jvalue jvInfo;
-			jvInfo.read_plist(archo->m_strInfoPlist);
-			strBundleId = jvInfo["CFBundleIdentifier"].as_cstr();
-			if (strBundleId.empty()) {
-				strBundleId = ZUtil::GetBaseName(m_strFile.c_str());
-			}
+			strBundleId = ZUtil::GetBaseName(m_strFile.c_str());
 		}
+	}
 
-		if (strInfoSHA1.empty() || strInfoSHA256.empty()) {
-			if (archo->m_strInfoPlist.empty()) {
-				strInfoSHA1.append(20, 0);
-				strInfoSHA256.append(32, 0);
-			} else {
-				ZSHA::SHA(archo->m_strInfoPlist, strInfoSHA1, strInfoSHA256);
+	if (strInfoSHA1.empty() || strInfoSHA256.empty()) {
+		if (pFirstArchO->m_strInfoPlist.empty()) {
+			strInfoSHA1.append(20, 0);
+			strInfoSHA256.append(32, 0);
+		} else {
+			ZSHA::SHA(pFirstArchO->m_strInfoPlist, strInfoSHA1, strInfoSHA256);
+		}
+	}
+
+	// a slice whose space clearly can't hold the superblob gets room before any page is hashed.
+	// The others are signed right away and only grown if their real blob turns out too large.
+	size_t uCount = m_arrArchOes.size();
+	vector<uint8_t> arrGrow(uCount, 0);
+	for (size_t i = 0; i < uCount; i++) {
+		ZArchO* archo = m_arrArchOes[i];
+		uint32_t uMinLength = 0;
+		uint32_t uMaxLength = 0;
+		archo->EstimateCodeSignatureLength(pSignAsset, strBundleId, uMinLength, uMaxLength);
+		if (NULL == archo->m_pSignBase || (uint64_t)archo->m_uCodeLength + uMinLength > archo->m_uLength) {
+			arrGrow[i] = 1;
+		}
+	}
+
+	// slices live in disjoint ranges of the mapping, so they are signed concurrently. A slice
+	// without enough room doesn't stop the others: one rewrite then grows only the short slices,
+	// and those plus the slices it had to move are signed again. Each slice is grown at most once.
+	vector<uint8_t> arrSigned(uCount, 0);
+	vector<uint8_t> arrRealloced(uCount, 0);
+	while (true) {
+		if (find(arrGrow.begin(), arrGrow.end(), 1) != arrGrow.end()) {
+			vector<uint8_t> arrMoved;
+			if (!ReallocCodeSignSpace(arrGrow, arrMoved)) {
+				return false;
+			}
+			for (size_t i = 0; i < uCount; i++) {
+				if (arrGrow[i] || arrMoved[i]) {
+					arrSigned[i] = 0;
+				}
+				arrRealloced[i] |= arrGrow[i];
+				arrGrow[i] = 0;
 			}
 		}
 
-		if (!archo->Sign(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesData)) {
-			if (!archo->m_bEnoughSpace && !m_bCSRealloced) {
-				m_bCSRealloced = true;
-				if (ReallocCodeSignSpace()) {
-					return Sign(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesData);
+		ZThreadPool::ParallelFor(uCount, [&](size_t i) {
+			if (!arrSigned[i]) {
+				string strCodeSignBlob;
+				ZArchO* archo = m_arrArchOes[i];
+				if (archo->Sign(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256, strCodeSignBlob)) {
+					arrSigned[i] = WriteCodeSignature(archo, strCodeSignBlob) ? 1 : 0;
 				}
 			}
-			return false;
+			return true;
+		});
+
+		bool bNeedSpace = false;
+		for (size_t i = 0; i < uCount; i++) {
+			if (!arrSigned[i]) {
+				if (m_arrArchOes[i]->m_bEnoughSpace || arrRealloced[i]) { // failed for another reason
+					return false;
+				}
+				arrGrow[i] = 1;
+				bNeedSpace = true;
+			}
+		}
+
+		if (!bNeedSpace) {
+			break;
+		}
+	}
+
+	if (NULL != pFileHasher) { // digest the signed file while it is still mapped
+		const size_t sWindow = 64 * 1024 * 1024;
+		for (size_t sOffset = 0; sOffset < m_sSize; sOffset += sWindow) {
+			size_t sSize = min(sWindow, m_sSize - sOffset);
+			pFileHasher->Update(m_pBase + sOffset, sSize);
+			ZFile::ReleaseMappedPages(m_pBase + sOffset, sSize);
 		}
 	}
 
 	return CloseFile();
 }
 
-bool ZMachO::ReallocCodeSignSpace()
+// grows the slices flagged in arrGrow. A thin file is extended in place; a fat file keeps every
+// slice at its offset while the grown ones still fit, otherwise it is rebuilt in a single pass with
+// the later slices moved. arrMoved tells which slices now start somewhere else.
+bool ZMachO::ReallocCodeSignSpace(const vector<uint8_t>& arrGrow, vector<uint8_t>& arrMoved)
 {
+	arrMoved.assign(m_arrArchOes.size(), 0);
+	if (!MakeWritable()) {
+		return false;
+	}
+
 	ZLog::Warn(">>> Realloc CodeSignature space... \n");
 
+	// the load commands are patched in the mapping before it is closed
 	vector<uint32_t> arrMachOesSizes;
+	vector<uint32_t> arrMachOesLengths;
+	vector<vector<pair<uint32_t, uint32_t>>> arrDirtyRanges;
 	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
-		string strNewArchOFile;
-		ZUtil::StringFormatV(strNewArchOFile, "%s.archo.%d", m_strFile.c_str(), i);
-		uint32_t uNewLength = m_arrArchOes[i]->ReallocCodeSignSpace(strNewArchOFile);
-		if (uNewLength <= 0) {
-			ZLog::Error(">>> Failed!\n");
-			return false;
+		uint32_t uLength = m_arrArchOes[i]->m_uLength;
+		uint32_t uNewLength = uLength;
+		if (arrGrow[i]) {
+			uNewLength = m_arrArchOes[i]->ReallocCodeSignSpace();
+			if (uNewLength <= 0) {
+				ZLog::Error(">>> Failed!\n");
+				return false;
+			}
 		}
 		arrMachOesSizes.push_back(uNewLength);
+		arrMachOesLengths.push_back(uLength);
+		arrDirtyRanges.push_back(m_arrArchOes[i]->m_arrDirtyRanges);
 	}
 	ZLog::Warn(">>> Success!\n");
 
 	if (1 == m_arrArchOes.size()) {
 		CloseFile();
-		ZFile::RemoveFile(m_strFile.c_str());
-		string strNewArchOFile = m_strFile + ".archo.0";
-		if (0 == rename(strNewArchOFile.c_str(), m_strFile.c_str())) {
-			return OpenFile(m_strFile.c_str());
+		// drop anything past the slice, the new tail reads back as zeros
+		if (ZFile::ResizeFile(m_strFile.c_str(), arrMachOesLengths[0]) && ZFile::ResizeFile(m_strFile.c_str(), arrMachOesSizes[0])) {
+			return ReopenFile(arrDirtyRanges);
 		}
 	} else { //fat
-		uint32_t uAlign = 16384;
-		vector<fat_arch> arrArches;
+		uint64_t uAlign = 16384;
+		vector<fat_arch_64> arrArches;
 		fat_header fath = *((fat_header*)m_pBase);
-		int nFatArch = (FAT_MAGIC == fath.magic) ? fath.nfat_arch : LE(fath.nfat_arch);
-		for (int i = 0; i < nFatArch; i++) {
-			fat_arch arch = *((fat_arch*)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i));
-			arrArches.push_back(arch);
+		if (!GetFatArches(arrArches)) {
+			return false;
 		}
 		CloseFile();
 
@@ -200,65 +451,175 @@ bool ZMachO::ReallocCodeSignSpace()
 			return false;
 		}
 
-		uint32_t uFatHeaderSize = sizeof(fat_header) + (uint32_t)arrArches.size() * sizeof(fat_arch);
-		uint32_t uPadding1 = (uAlign - uFatHeaderSize % uAlign);
-		uint32_t uOffset = uFatHeaderSize + uPadding1;
-		for (size_t i = 0; i < arrArches.size(); i++) {
-			fat_arch& arch = arrArches[i];
-			uint32_t& uMachOSize = arrMachOesSizes[i];
-
-			arch.align = (FAT_MAGIC == fath.magic) ? 14 : BE((uint32_t)14);
-			arch.offset = (FAT_MAGIC == fath.magic) ? uOffset : BE(uOffset);
-			arch.size = (FAT_MAGIC == fath.magic) ? uMachOSize : BE(uMachOSize);
+		// a slice stays where it is unless the one before it grew into it. A fat_arch table keeps
+		// its format unless a slice would start past 4GB.
+		bool bSwap = (FAT_CIGAM == fath.magic || FAT_CIGAM_64 == fath.magic);
+		bool b64 = (FAT_MAGIC_64 == fath.magic || FAT_CIGAM_64 == fath.magic);
+		vector<uint64_t> arrNewOffsets;
+		uint64_t uOffset = 0;
+		for (int nPass = 0; nPass < 2; nPass++) {
+			uint64_t uFatHeaderSize = sizeof(fat_header) + arrArches.size() * (b64 ? sizeof(fat_arch_64) : sizeof(fat_arch));
+			uOffset = uFatHeaderSize;
+			arrNewOffsets.clear();
+			for (size_t i = 0; i < arrArches.size(); i++) {
+				if (arrArches[i].offset < uOffset) {
+					uOffset = uOffset + (uAlign - uOffset % uAlign);
+				} else {
+					uOffset = arrArches[i].offset;
+				}
+				arrNewOffsets.push_back(uOffset);
+				uOffset += arrMachOesSizes[i];
+			}
 
-			uOffset += uMachOSize;
-			uOffset = uOffset + (uAlign - uOffset % uAlign);
+			if (b64 || arrNewOffsets.back() + arrMachOesSizes.back() <= UINT32_MAX) {
+				break;
+			}
+			b64 = true;
+			ZLog::Warn(">>> Fat file grows past 4GB, writing a 64-bit arch table.\n");
 		}
 
-		string strNewFatMachOFile = m_strFile + ".fato";
+		uint32_t uMagic = b64 ? FAT_MAGIC_64 : FAT_MAGIC;
+		fath.magic = bSwap ? LE(uMagic) : uMagic;
 
+		bool bInPlace = true;
 		string strFatHeader;
 		strFatHeader.append((const char*)&fath, sizeof(fat_header));
 		for (size_t i = 0; i < arrArches.size(); i++) {
-			fat_arch& arch = arrArches[i];
-			strFatHeader.append((const char*)&arch, sizeof(fat_arch));
+			fat_arch_64 arch = arrArches[i];
+			if (arrNewOffsets[i] != arrArches[i].offset) {
+				arrMoved[i] = 1;
+				bInPlace = false;
+				arch.align = max(arch.align, (uint32_t)14);
+			}
+			arch.offset = arrNewOffsets[i];
+			arch.size = arrMachOesSizes[i];
+			if (bSwap) {
+				arch.cputype = (cpu_type_t)LE((uint32_t)arch.cputype);
+				arch.cpusubtype = (cpu_subtype_t)LE((uint32_t)arch.cpusubtype);
+				arch.align = LE(arch.align);
+			}
+
+			if (b64) {
+				if (bSwap) {
+					arch.offset = LE(arch.offset);
+					arch.size = LE(arch.size);
+				}
+				strFatHeader.append((const char*)&arch, sizeof(fat_arch_64));
+			} else {
+				fat_arch arch32;
+				arch32.cputype = arch.cputype;
+				arch32.cpusubtype = arch.cpusubtype;
+				arch32.offset = bSwap ? LE((uint32_t)arch.offset) : (uint32_t)arch.offset;
+				arch32.size = bSwap ? LE((uint32_t)arch.size) : (uint32_t)arch.size;
+				arch32.align = arch.align;
+				strFatHeader.append((const char*)&arch32, sizeof(fat_arch));
+			}
 		}
 
-		string strPadding1;
-		strPadding1.append(uPadding1, 0);
+		if (bInPlace) { // only the arch table and the grown tails change
+			for (size_t i = 0; i < arrArches.size(); i++) {
+				if (arrMachOesSizes[i] > arrMachOesLengths[i]) {
+					string strZero(arrMachOesSizes[i] - arrMachOesLengths[i], 0);
+					if (!ZFile::WriteFileAt(m_strFile.c_str(), (int64_t)(arrNewOffsets[i] + arrMachOesLengths[i]), strZero.data(), strZero.size())) {
+						return false;
+					}
+				}
+			}
+			if (ZFile::WriteFileAt(m_strFile.c_str(), 0, strFatHeader.data(), strFatHeader.size())) {
+				return ReopenFile(arrDirtyRanges);
+			}
+			return false;
+		}
 
-		ZFile::AppendFile(strNewFatMachOFile.c_str(), strFatHeader);
-		ZFile::AppendFile(strNewFatMachOFile.c_str(), strPadding1);
+		// padding and the grown signature space are left as holes
+		uOffset = uOffset + (uAlign - uOffset % uAlign);
+		string strNewFatMachOFile = m_strFile + ".fato";
+		if (!ZFile::WriteFile(strNewFatMachOFile.c_str(), strFatHeader)) {
+			return false;
+		}
 
 		for (size_t i = 0; i < arrArches.size(); i++) {
-			size_t sSize = 0;
-			string strNewArchOFile = m_strFile + ".archo." + jvalue((int)i).as_string();
-			uint8_t* pData = (uint8_t*)ZFile::MapFile(strNewArchOFile.c_str(), 0, 0, &sSize, true);
-			if (NULL == pData) {
+			if (!ZFile::CopyFileRange(m_strFile.c_str(), arrArches[i].offset, strNewFatMachOFile.c_str(), arrNewOffsets[i], arrMachOesLengths[i])) {
 				ZFile::RemoveFile(strNewFatMachOFile.c_str());
 				return false;
 			}
-			string strPadding;
-			strPadding.append((uAlign - sSize % uAlign), 0);
-
-			ZFile::AppendFile(strNewFatMachOFile.c_str(), (const char*)pData, sSize);
-			ZFile::AppendFile(strNewFatMachOFile.c_str(), strPadding);
+		}
 
-			ZFile::UnmapFile((void*)pData, sSize);
-			ZFile::RemoveFile(strNewArchOFile.c_str());
+		if (!ZFile::ResizeFile(strNewFatMachOFile.c_str(), uOffset)) {
+			ZFile::RemoveFile(strNewFatMachOFile.c_str());
+			return false;
 		}
 
 		ZFile::RemoveFile(m_strFile.c_str());
 		if (0 == rename(strNewFatMachOFile.c_str(), m_strFile.c_str())) {
-			return OpenFile(m_strFile.c_str());
+			return ReopenFile(arrDirtyRanges);
 		}
 	}
 
 	return false;
 }
 
+// maps the rewritten file again, keeping track of what the slices had modified before
+bool ZMachO::ReopenFile(const vector<vector<pair<uint32_t, uint32_t>>>& arrDirtyRanges)
+{
+	if (!OpenFile(m_strFile.c_str()) || m_arrArchOes.size() != arrDirtyRanges.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
+		m_arrArchOes[i]->m_arrDirtyRanges = arrDirtyRanges[i];
+	}
+	return true;
+}
+
+// load commands are patched in place, so a read-only mapping is replaced by a writable one first
+bool ZMachO::MakeWritable()
+{
+	if (!m_bReadOnly) {
+		return true;
+	}
+
+	vector<vector<pair<uint32_t, uint32_t>>> arrDirtyRanges;
+	vector<uint32_t> arrEstimatedSignLengths;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
+		arrDirtyRanges.push_back(m_arrArchOes[i]->m_arrDirtyRanges);
+		arrEstimatedSignLengths.push_back(m_arrArchOes[i]->m_uEstimatedSignLength);
+	}
+
+	CloseFile();
+	m_bReadOnly = false;
+	if (!ReopenFile(arrDirtyRanges)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
+		m_arrArchOes[i]->m_uEstimatedSignLength = arrEstimatedSignLengths[i];
+	}
+	return true;
+}
+
+bool ZMachO::WriteCodeSignature(ZArchO* archo, const string& strCodeSignBlob)
+{
+	if (!m_bReadOnly) {
+		memcpy(archo->m_pBase + archo->m_uCodeLength, strCodeSignBlob.data(), strCodeSignBlob.size());
+		return true;
+	}
+
+	// the shared read-only mapping sees the new bytes through the page cache
+	int64_t nOffset = (int64_t)(archo->m_pBase - m_pBase) + archo->m_uCodeLength;
+	if (!ZFile::WriteFileAt(m_strFile.c_str(), nOffset, strCodeSignBlob.data(), strCodeSignBlob.size())) {
+		ZLog::ErrorV(">>> Write CodeSignature failed! %s\n", m_strFile.c_str());
+		return false;
+	}
+	return true;
+}
+
 bool ZMachO::InjectDylib(bool bWeakInject, const char* szDylibFile)
 {
+	if (!MakeWritable()) {
+		return false;
+	}
+
 	ZLog::WarnV(">>> InjectDylib: %s %s... \n", szDylibFile, bWeakInject ? "(weak)" : "");
 
 	vector<uint32_t> arrMachOesSizes;
@@ -13,26 +13,33 @@ public:
 	bool Free();
 	void PrintInfo();
 	bool CheckSignature() const;
+	bool Inspect(const char* szFile, jvalue& jvInfo);
 	bool Sign(ZSignAsset* pSignAsset,
 				bool bForce, 
 				string strBundleId, 
 				string strInfoSHA1, 
 				string strInfoSHA256, 
-				const string& strCodeResourcesData);
+				const string& strCodeResourcesSHA1,
+				const string& strCodeResourcesSHA256,
+				ZSHAHasher* pFileHasher = NULL);
 	bool InjectDylib(bool bWeakInject, const char* szDylibFile);
 
 private:
 	bool OpenFile(const char* szPath);
 	bool CloseFile();
 
-	bool NewArchO(uint8_t* pBase, uint32_t uLength);
+	bool NewArchO(uint8_t* pBase, uint64_t uLength);
+	bool GetFatArches(vector<fat_arch_64>& arrArches) const;
 	void FreeArchOes();
-	bool ReallocCodeSignSpace();
+	bool ReallocCodeSignSpace(const vector<uint8_t>& arrGrow, vector<uint8_t>& arrMoved);
+	bool ReopenFile(const vector<vector<pair<uint32_t, uint32_t>>>& arrDirtyRanges);
+	bool MakeWritable();
+	bool WriteCodeSignature(ZArchO* archo, const string& strCodeSignBlob);
 
 private:
 	size_t			m_sSize;
 	string			m_strFile;
 	uint8_t*		m_pBase;
-	bool			m_bCSRealloced;
+	bool			m_bReadOnly; // mapped read-only, the signature is written through the file
 	vector<ZArchO*> m_arrArchOes;
 };
@@ -137,7 +137,7 @@ void* ZSignAsset::GenerateASN1Type(const string& value)
 	return ret;
 }
 
-bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHashData, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
+bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const uint8_t* pCDHashData, uint32_t uCDHashDataLength, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
 {
 	if (!pscert || !pspkey) {
 		return CMSError();
@@ -181,7 +181,7 @@ bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHash
 		return CMSError();
 	}
 
-	BIO* in = BIO_new_mem_buf(strCDHashData.c_str(), (int)strCDHashData.size());
+	BIO* in = BIO_new_mem_buf(pCDHashData, (int)uCDHashDataLength);
 	if (!in) {
 		return CMSError();
 	}
@@ -558,9 +558,12 @@ ZSignAsset::ZSignAsset()
 {
 	m_evpPKey = NULL;
 	m_x509Cert = NULL;
+	m_uCMSMinLength = 0;
+	m_uCMSMaxLength = 0;
 	m_bAdhoc = false;
 	m_bSingleBinary = false;
 	m_bSHA256Only = false;
+	m_uVerifyRate = 0;
 }
 
 bool ZSignAsset::Init(
@@ -689,10 +692,63 @@ bool ZSignAsset::Init(
 
 	m_evpPKey = evpPKey;
 	m_x509Cert = x509Cert;
+
+	// DER sizes of what GenerateCMS puts into the SignedData: the certificate chain, the issuer and
+	// serial repeated in the signer info, the signature, the CDHashes plist and the hex sha256 of the
+	// CDHashes2 attribute. OIDs, signing time, message digest and ASN.1 framing stay under 512 bytes.
+	jvalue jvHashes;
+	string strCDHashesPlist;
+	jvHashes["cdhashes"][0].assign_data(string(20, 0).data(), 20);
+	jvHashes["cdhashes"][1].assign_data(string(20, 0).data(), 20);
+	jvHashes.style_write_plist(strCDHashesPlist);
+
+	uint32_t uCACertLength = 0;
+	unsigned long issuerHash = X509_issuer_name_hash(x509Cert);
+	if (0x817d2f7a == issuerHash) {
+		uCACertLength = GetCertDERLength(s_szAppleDevCACert);
+	} else if (0x9b16b75c == issuerHash) {
+		uCACertLength = GetCertDERLength(s_szAppleDevCACertG3);
+	} else { // GenerateCMS fails for an unknown issuer and the slot is left out
+		uCACertLength = max(GetCertDERLength(s_szAppleDevCACert), GetCertDERLength(s_szAppleDevCACertG3));
+	}
+
+	m_uCMSMaxLength = (uint32_t)i2d_X509(x509Cert, NULL) + uCACertLength + GetCertDERLength(s_szAppleRootCACert);
+	m_uCMSMinLength = (0x817d2f7a == issuerHash || 0x9b16b75c == issuerHash) ? m_uCMSMaxLength : 0;
+	m_uCMSMaxLength += (uint32_t)i2d_X509_NAME(X509_get_issuer_name(x509Cert), NULL);
+	m_uCMSMaxLength += (uint32_t)i2d_ASN1_INTEGER(X509_get_serialNumber(x509Cert), NULL);
+	m_uCMSMaxLength += (uint32_t)EVP_PKEY_size(evpPKey);
+	m_uCMSMaxLength += (uint32_t)strCDHashesPlist.size();
+	m_uCMSMaxLength += 64;
+	m_uCMSMaxLength += 512;
 	return true;
 }
 
-bool ZSignAsset::GenerateCMS(const string& strCDHashData, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
+uint32_t ZSignAsset::GetCertDERLength(const char* szCertPEM)
+{
+	uint32_t uLength = 0;
+	BIO* bio = BIO_new_mem_buf(szCertPEM, (int)strlen(szCertPEM));
+	if (NULL != bio) {
+		X509* x509Cert = PEM_read_bio_X509(bio, NULL, 0, NULL);
+		if (NULL != x509Cert) {
+			uLength = (uint32_t)i2d_X509(x509Cert, NULL);
+			X509_free(x509Cert);
+		}
+		BIO_free(bio);
+	}
+	return uLength;
+}
+
+bool ZSignAsset::GenerateCMS(const uint8_t* pCDHashData, uint32_t uCDHashDataLength, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
+{
+	return GenerateCMS((X509*)m_x509Cert, (EVP_PKEY*)m_evpPKey, pCDHashData, uCDHashDataLength, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSOutput);
+}
+
+uint32_t ZSignAsset::GetCMSMaxLength() const
+{
+	return m_uCMSMaxLength;
+}
+
+uint32_t ZSignAsset::GetCMSMinLength() const
 {
-	return GenerateCMS((X509*)m_x509Cert, (EVP_PKEY*)m_evpPKey, strCDHashData, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSOutput);
+	return m_uCMSMinLength;
 }
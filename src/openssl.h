@@ -16,16 +16,22 @@ public:
 				bool bSHA256Only,
 				bool bSingleBinary);
 
-	bool GenerateCMS(const string& strCDHashData, 
+	bool GenerateCMS(const uint8_t* pCDHashData, 
+						uint32_t uCDHashDataLength, 
 						const string& strCDHashesPlist, 
 						const string& strCodeDirectorySlotSHA1, 
 						const string& strAltnateCodeDirectorySlot256, 
 						string& strCMSOutput);
 
+	// bounds of the DER encoded CMS GenerateCMS produces with this identity, fixed once Init is done
+	uint32_t GetCMSMaxLength() const;
+	uint32_t GetCMSMinLength() const;
+
 private:
 	bool GenerateCMS(void* pscert, 
 						void* pspkey, 
-						const string& strCDHashData, 
+						const uint8_t* pCDHashData, 
+						uint32_t uCDHashDataLength, 
 						const string& strCDHashesPlist, 
 						const string& strCodeDirectorySlotSHA1, 
 						const string& strAltnateCodeDirectorySlot256, 
@@ -36,6 +42,7 @@ private:
 
 public:
 	static bool		CMSError();
+	static uint32_t	GetCertDERLength(const char* szCertPEM);
 	static void*	GenerateASN1Type(const string& value);
 	static bool		GetCertInfo(void* pcert, jvalue& jvCertInfo);
 	static bool		GetCMSInfo(uint8_t* pCMSData, uint32_t uCMSLength, jvalue& jvOutput);
@@ -47,6 +54,7 @@ public:
 	bool	m_bAdhoc;
 	bool	m_bSHA256Only;
 	bool	m_bSingleBinary;
+	uint32_t	m_uVerifyRate; // percent of reused page hashes checked on a forced sign, 0 rehashes every page
 	string	m_strTeamId;
 	string	m_strSubjectCN;
 	string	m_strProvData;
@@ -55,6 +63,8 @@ public:
 private:
 	void*	m_evpPKey;
 	void*	m_x509Cert;
+	uint32_t	m_uCMSMinLength; // the certificate chain alone
+	uint32_t	m_uCMSMaxLength; // chain, signer info and attributes
 
 private:
 	static const char* s_szAppleDevCACert;
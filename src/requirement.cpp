@@ -0,0 +1,476 @@
+#include "common.h"
+#include "mach-o.h"
+#include "requirement.h"
+#include <ctype.h>
+#include <time.h>
+
+#define REQ_EXPR_FORM		1			// Requirement::exprForm
+#define REQ_MAX_DEPTH		256
+#define REQ_TIME_OFFSET		978307200	// 2001-01-01, the CFAbsoluteTime epoch
+
+static const char* s_szTypeNames[] = { "invalid", "host", "guest", "designated", "library", "plugin" };
+
+ZRequirement::ZRequirement(const uint8_t* pBase, uint32_t uLength)
+{
+	m_pBase = pBase;
+	m_uLength = uLength;
+	m_uPos = 0;
+	m_uDepth = 0;
+}
+
+bool ZRequirement::Decompile(const uint8_t* pBlob, uint32_t uLength, string& strText)
+{
+	strText.clear();
+	if (NULL == pBlob || uLength < 8) {
+		return false;
+	}
+
+	uint32_t uMagic = BE(*((uint32_t*)pBlob));
+	uint32_t uBlobLength = BE(*((uint32_t*)pBlob + 1));
+	if (uBlobLength < 8 || uBlobLength > uLength) {
+		return false;
+	}
+
+	if (CSMAGIC_REQUIREMENT == uMagic) {
+		ZRequirement req(pBlob, uBlobLength);
+		bool bRet = req.DecompileRequirement(strText);
+		strText += "\n";
+		return bRet;
+	}
+
+	if (CSMAGIC_REQUIREMENTS != uMagic || uBlobLength < 12) {
+		return false;
+	}
+
+	uint32_t uCount = BE(*((uint32_t*)pBlob + 2));
+	if ((uint64_t)uCount * 8 > uBlobLength - 12) {
+		return false;
+	}
+
+	bool bRet = true;
+	for (uint32_t i = 0; i < uCount; i++) {
+		uint32_t uType = BE(*((uint32_t*)pBlob + 3 + i * 2));
+		uint32_t uOffset = BE(*((uint32_t*)pBlob + 4 + i * 2));
+		if (uOffset > uBlobLength - 8 || CSMAGIC_REQUIREMENT != BE(*((uint32_t*)(pBlob + uOffset)))) {
+			return false;
+		}
+
+		uint32_t uReqLength = BE(*((uint32_t*)(pBlob + uOffset) + 1));
+		if (uReqLength < 8 || uReqLength > uBlobLength - uOffset) {
+			return false;
+		}
+
+		string strPrefix;
+		if (uType < sizeof(s_szTypeNames) / sizeof(s_szTypeNames[0])) {
+			ZUtil::StringFormatV(strPrefix, "%s => ", s_szTypeNames[uType]);
+		} else {
+			ZUtil::StringFormatV(strPrefix, "/*unknown type*/ %u => ", uType);
+		}
+
+		string strRequirement;
+		ZRequirement req(pBlob + uOffset, uReqLength);
+		if (!req.DecompileRequirement(strRequirement)) {
+			bRet = false;
+		}
+		strText += strPrefix + strRequirement + "\n";
+	}
+	return bRet;
+}
+
+bool ZRequirement::DecompileRequirement(string& strText)
+{
+	m_uPos = 8;
+	m_strOutput.clear();
+
+	uint32_t uKind = 0;
+	if (!GetUInt32(uKind)) {
+		return false;
+	}
+
+	bool bRet = false;
+	if (REQ_EXPR_FORM == uKind) {
+		bRet = Expr(E_TOP);
+	} else {
+		Print("/* unsupported requirement kind %u */", uKind);
+	}
+
+	strText = (!m_strOutput.empty() && ' ' == m_strOutput[0]) ? m_strOutput.substr(1) : m_strOutput;
+	return bRet;
+}
+
+bool ZRequirement::Expr(eSyntaxLevel eLevel)
+{
+	uint32_t uOp = 0;
+	if (++m_uDepth > REQ_MAX_DEPTH || !GetUInt32(uOp)) {
+		return false;
+	}
+
+	bool bRet = true;
+	switch (uOp & ~opFlagMask) {
+	case opFalse:
+		Print("never");
+		break;
+	case opTrue:
+		Print("always");
+		break;
+	case opIdent:
+		Print("identifier ");
+		bRet = Data();
+		break;
+	case opAppleAnchor:
+		Print("anchor apple");
+		break;
+	case opAppleGenericAnchor:
+		Print("anchor apple generic");
+		break;
+	case opAnchorHash:
+		Print("certificate");
+		bRet = CertSlot();
+		Print(" = ");
+		bRet = bRet && HashData();
+		break;
+	case opInfoKeyValue:
+		Print("info[");
+		bRet = DotString();
+		Print("] = ");
+		bRet = bRet && Data();
+		break;
+	case opAnd:
+	case opOr:
+	{
+		eSyntaxLevel eOpLevel = ((uOp & ~opFlagMask) == opAnd) ? E_AND : E_OR;
+		if (eLevel < eOpLevel) {
+			Print("(");
+		}
+		bRet = Expr(eOpLevel);
+		Print((E_AND == eOpLevel) ? " and " : " or ");
+		bRet = bRet && Expr(eOpLevel);
+		if (eLevel < eOpLevel) {
+			Print(")");
+		}
+	}
+	break;
+	case opNot:
+		Print("! ");
+		bRet = Expr(E_PRIMARY);
+		break;
+	case opCDHash:
+		Print("cdhash ");
+		bRet = HashData();
+		break;
+	case opInfoKeyField:
+		Print("info[");
+		bRet = DotString();
+		Print("]");
+		bRet = bRet && Match();
+		break;
+	case opEntitlementField:
+		Print("entitlement[");
+		bRet = DotString();
+		Print("]");
+		bRet = bRet && Match();
+		break;
+	case opCertField:
+		Print("certificate");
+		bRet = CertSlot();
+		Print("[");
+		bRet = bRet && DotString();
+		Print("]");
+		bRet = bRet && Match();
+		break;
+	case opCertGeneric:
+	case opCertPolicy:
+	case opCertFieldDate:
+	{
+		uint32_t uField = (uOp & ~opFlagMask);
+		Print("certificate");
+		bRet = CertSlot();
+		Print("[");
+		bRet = bRet && OidData((opCertGeneric == uField) ? "field" : ((opCertPolicy == uField) ? "policy" : "timestamp"));
+		Print("]");
+		bRet = bRet && Match();
+	}
+	break;
+	case opTrustedCert:
+		Print("certificate");
+		bRet = CertSlot();
+		Print(" trusted");
+		break;
+	case opTrustedCerts:
+		Print("anchor trusted");
+		break;
+	case opNamedAnchor:
+		Print("anchor apple ");
+		bRet = Data();
+		break;
+	case opNamedCode:
+		Print("(");
+		bRet = Data();
+		Print(")");
+		break;
+	case opPlatform:
+	{
+		uint32_t uPlatform = 0;
+		bRet = GetUInt32(uPlatform);
+		Print("platform = %d", (int32_t)uPlatform);
+	}
+	break;
+	case opNotarized:
+		Print("notarized");
+		break;
+	case opLegacyDevID:
+		Print("legacy");
+		break;
+	default:
+		if (uOp & opGenericFalse) {
+			Print(" false /* opcode %u */", uOp & ~opFlagMask);
+		} else if (uOp & opGenericSkip) {
+			Print(" /* opcode %u */", uOp & ~opFlagMask);
+		} else {
+			Print("OPCODE %u NOT UNDERSTOOD (ending print)", uOp);
+			bRet = false;
+		}
+		break;
+	}
+
+	m_uDepth--;
+	return bRet;
+}
+
+bool ZRequirement::CertSlot()
+{
+	uint32_t uSlot = 0;
+	if (!GetUInt32(uSlot)) {
+		return false;
+	}
+
+	switch ((int32_t)uSlot) {
+	case -1:
+		Print(" root");
+		break;
+	case 0:
+		Print(" leaf");
+		break;
+	default:
+		Print(" %d", (int32_t)uSlot);
+		break;
+	}
+	return true;
+}
+
+bool ZRequirement::Match()
+{
+	uint32_t uMatch = 0;
+	if (!GetUInt32(uMatch)) {
+		return false;
+	}
+
+	switch (uMatch) {
+	case matchExists:
+		Print(" /* exists */");
+		return true;
+	case matchAbsent:
+		Print(" absent ");
+		return true;
+	case matchEqual:
+		Print(" = ");
+		return Data();
+	case matchContains:
+		Print(" ~ ");
+		return Data();
+	case matchBeginsWith:
+	{
+		Print(" = ");
+		bool bRet = Data();
+		Print("*");
+		return bRet;
+	}
+	case matchEndsWith:
+		Print(" = *");
+		return Data();
+	case matchLessThan:
+		Print(" < ");
+		return Data();
+	case matchGreaterEqual:
+		Print(" >= ");
+		return Data();
+	case matchLessEqual:
+		Print(" <= ");
+		return Data();
+	case matchGreaterThan:
+		Print(" > ");
+		return Data();
+	case matchOn:
+		Print(" = ");
+		return Timestamp();
+	case matchBefore:
+		Print(" < ");
+		return Timestamp();
+	case matchAfter:
+		Print(" > ");
+		return Timestamp();
+	case matchOnOrBefore:
+		Print(" <= ");
+		return Timestamp();
+	case matchOnOrAfter:
+		Print(" >= ");
+		return Timestamp();
+	}
+
+	Print("MATCH OPCODE %u NOT UNDERSTOOD", uMatch);
+	return false;
+}
+
+// same quoting rules as the Security framework: bare when alphanumeric, quoted when printable, hex otherwise
+bool ZRequirement::Data(ePrintMode eMode, bool bDotOkay)
+{
+	const uint8_t* pData = NULL;
+	uint32_t uLength = 0;
+	if (!GetData(pData, uLength)) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < uLength; i++) {
+		if (isalnum(pData[i]) || ('.' == pData[i] && bDotOkay)) {
+			if (0 == i && isdigit(pData[i])) { // a bare string can't start with a digit
+				eMode = E_PRINTABLE;
+			}
+		} else if (isgraph(pData[i]) || isspace(pData[i])) {
+			if (E_SIMPLE == eMode) {
+				eMode = E_PRINTABLE;
+			}
+		} else {
+			eMode = E_BINARY;
+			break;
+		}
+	}
+
+	if (0 == uLength && E_SIMPLE == eMode) {
+		eMode = E_PRINTABLE;
+	}
+
+	switch (eMode) {
+	case E_SIMPLE:
+		m_strOutput.append((const char*)pData, uLength);
+		break;
+	case E_PRINTABLE:
+		m_strOutput += '"';
+		for (uint32_t i = 0; i < uLength; i++) {
+			if ('\\' == pData[i] || '"' == pData[i]) {
+				m_strOutput += '\\';
+			}
+			m_strOutput += (char)pData[i];
+		}
+		m_strOutput += '"';
+		break;
+	default:
+		Print("0x");
+		PrintBytes(pData, uLength);
+		break;
+	}
+	return true;
+}
+
+bool ZRequirement::HashData()
+{
+	const uint8_t* pData = NULL;
+	uint32_t uLength = 0;
+	if (!GetData(pData, uLength)) {
+		return false;
+	}
+
+	Print("H\"");
+	PrintBytes(pData, uLength);
+	Print("\"");
+	return true;
+}
+
+// DER encoded OID as dotted decimal
+bool ZRequirement::OidData(const char* szPrefix)
+{
+	const uint8_t* pData = NULL;
+	uint32_t uLength = 0;
+	if (!GetData(pData, uLength)) {
+		return false;
+	}
+
+	Print("%s", szPrefix);
+	uint64_t uArc = 0;
+	bool bFirst = true;
+	for (uint32_t i = 0; i < uLength; i++) {
+		uArc = (uArc << 7) | (pData[i] & 0x7f);
+		if (pData[i] & 0x80) {
+			continue;
+		}
+
+		if (bFirst) {
+			uint64_t uTop = (uArc < 80) ? (uArc / 40) : 2;
+			Print(".%llu.%llu", (unsigned long long)uTop, (unsigned long long)(uArc - uTop * 40));
+			bFirst = false;
+		} else {
+			Print(".%llu", (unsigned long long)uArc);
+		}
+		uArc = 0;
+	}
+	return true;
+}
+
+bool ZRequirement::Timestamp()
+{
+	uint32_t uHigh = 0;
+	uint32_t uLow = 0;
+	if (!GetUInt32(uHigh) || !GetUInt32(uLow)) {
+		return false;
+	}
+
+	time_t tTime = (time_t)((int64_t)(((uint64_t)uHigh << 32) | uLow) + REQ_TIME_OFFSET);
+	struct tm tm = { 0 };
+#ifdef _WIN32
+	gmtime_s(&tm, &tTime);
+#else
+	gmtime_r(&tTime, &tm);
+#endif
+
+	char szTime[64] = { 0 };
+	strftime(szTime, sizeof(szTime), "%Y-%m-%d %H:%M:%S +0000", &tm);
+	Print("<%s>", szTime);
+	return true;
+}
+
+bool ZRequirement::GetUInt32(uint32_t& uValue)
+{
+	if (m_uLength - m_uPos < sizeof(uint32_t)) {
+		return false;
+	}
+	uValue = BE(*((uint32_t*)(m_pBase + m_uPos)));
+	m_uPos += sizeof(uint32_t);
+	return true;
+}
+
+// length prefixed bytes, padded to 4 bytes
+bool ZRequirement::GetData(const uint8_t*& pData, uint32_t& uLength)
+{
+	if (!GetUInt32(uLength) || uLength > m_uLength - m_uPos) {
+		return false;
+	}
+
+	pData = m_pBase + m_uPos;
+	uint64_t uPadded = ((uint64_t)uLength + 3) & ~3ULL;
+	m_uPos = (uPadded > m_uLength - m_uPos) ? m_uLength : m_uPos + (uint32_t)uPadded;
+	return true;
+}
+
+void ZRequirement::Print(const char* szFormat, ...)
+{
+	FORMAT_V(szFormat, szText);
+	m_strOutput += szText;
+}
+
+void ZRequirement::PrintBytes(const uint8_t* pData, uint32_t uLength)
+{
+	static const char* s_szHex = "0123456789abcdef";
+	for (uint32_t i = 0; i < uLength; i++) {
+		m_strOutput += s_szHex[pData[i] >> 4];
+		m_strOutput += s_szHex[pData[i] & 0x0f];
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "common.h"
+
+// Turns a requirement blob (a single requirement or a requirements set) back into the
+// text csreq -t prints, so inspecting a signature never has to spawn /usr/bin/csreq.
+class ZRequirement
+{
+public:
+	static bool Decompile(const uint8_t* pBlob, uint32_t uLength, string& strText);
+
+private:
+	ZRequirement(const uint8_t* pBase, uint32_t uLength);
+
+private:
+	enum eSyntaxLevel
+	{
+		E_PRIMARY = 0,
+		E_AND,
+		E_OR,
+		E_TOP
+	};
+
+	enum ePrintMode
+	{
+		E_SIMPLE = 0,
+		E_PRINTABLE,
+		E_BINARY
+	};
+
+	bool DecompileRequirement(string& strText);
+	bool Expr(eSyntaxLevel eLevel);
+	bool CertSlot();
+	bool Match();
+	bool Data(ePrintMode eMode = E_SIMPLE, bool bDotOkay = false);
+	bool DotString() { return Data(E_SIMPLE, true); }
+	bool HashData();
+	bool OidData(const char* szPrefix);
+	bool Timestamp();
+	bool GetUInt32(uint32_t& uValue);
+	bool GetData(const uint8_t*& pData, uint32_t& uLength);
+	void Print(const char* szFormat, ...);
+	void PrintBytes(const uint8_t* pData, uint32_t uLength);
+
+private:
+	const uint8_t*	m_pBase;
+	uint32_t		m_uLength;
+	uint32_t		m_uPos;
+	uint32_t		m_uDepth;
+	string			m_strOutput;
+};
@@ -3,6 +3,165 @@
 #include "mach-o.h"
 #include "openssl.h"
 #include "signing.h"
+#include "requirement.h"
+#include <unordered_map>
+#include <random>
+
+// pages hashed per window (64M), each window is released once hashed so huge binaries keep a bounded RSS
+static const uint32_t s_uWindowPages = 16384;
+
+ZCodePageMemo::ZCodePageMemo()
+{
+	m_bInited = false;
+	m_uDedupPages = 0;
+	m_uZeroPages = 0;
+}
+
+uint64_t ZCodePageMemo::Fingerprint(const uint8_t* pData, uint32_t uSize, bool& bZero)
+{
+	uint64_t uHash = 0xcbf29ce484222325ULL;
+	uint64_t uBits = 0;
+	uint32_t i = 0;
+	for (; i + 8 <= uSize; i += 8) {
+		uint64_t uWord = 0;
+		memcpy(&uWord, pData + i, 8);
+		uBits |= uWord;
+		uHash = (uHash ^ uWord) * 0x100000001b3ULL;
+		uHash ^= (uHash >> 29);
+	}
+	for (; i < uSize; i++) {
+		uBits |= pData[i];
+		uHash = (uHash ^ pData[i]) * 0x100000001b3ULL;
+	}
+	bZero = (0 == uBits);
+	return uHash;
+}
+
+void ZCodePageMemo::Init(uint8_t* pCodeBase, uint64_t uCodeLength, uint32_t uPageSize)
+{
+	if (m_bInited) {
+		return;
+	}
+	m_bInited = true;
+
+	// Only whole pages take part; the trailing partial page is always hashed.
+	uint32_t uPages = (uint32_t)(uCodeLength / uPageSize);
+	m_arrSourcePages.resize(uPages);
+
+	uint32_t uFirstZeroPage = uPages;
+	unordered_map<uint64_t, uint32_t> mapFirstPages;
+	mapFirstPages.reserve(uPages);
+	for (uint32_t i = 0; i < uPages; i++) {
+		m_arrSourcePages[i] = i;
+		if (i > 0 && 0 == i % s_uWindowPages) {
+			ZFile::ReleaseMappedPages(pCodeBase + (size_t)uPageSize * (i - s_uWindowPages), (size_t)uPageSize * s_uWindowPages);
+		}
+
+		bool bZero = false;
+		uint8_t* pPage = pCodeBase + (size_t)uPageSize * i;
+		uint64_t uFingerprint = Fingerprint(pPage, uPageSize, bZero);
+		if (bZero) { // all-zero pages are identical by definition, no compare needed
+			m_uZeroPages++;
+			if (uFirstZeroPage < uPages) {
+				m_arrSourcePages[i] = uFirstZeroPage;
+				m_uDedupPages++;
+			} else {
+				uFirstZeroPage = i;
+			}
+			continue;
+		}
+
+		auto it = mapFirstPages.find(uFingerprint);
+		if (it == mapFirstPages.end()) {
+			mapFirstPages[uFingerprint] = i;
+		} else if (0 == memcmp(pCodeBase + (size_t)uPageSize * it->second, pPage, uPageSize)) {
+			m_arrSourcePages[i] = it->second;
+			m_uDedupPages++;
+		}
+	}
+}
+
+uint32_t ZCodePageMemo::GetSourcePage(uint32_t uPage) const
+{
+	return (uPage < m_arrSourcePages.size()) ? m_arrSourcePages[uPage] : uPage;
+}
+
+ZSuperBlob::ZSuperBlob(string& strOutput, uint32_t uCount, uint32_t uCapacity) : m_strOutput(strOutput)
+{
+	m_uCount = uCount;
+	m_uAdded = 0;
+
+	uint32_t uHeaderLength = sizeof(CS_SuperBlob) + uCount * sizeof(CS_BlobIndex);
+	m_strOutput.clear();
+	m_strOutput.reserve(max(uCapacity, uHeaderLength));
+	m_strOutput.resize(uHeaderLength, 0);
+}
+
+uint8_t* ZSuperBlob::AddSlot(uint32_t uType, uint32_t uLength)
+{
+	if (m_uAdded >= m_uCount) {
+		return NULL;
+	}
+
+	uint32_t uOffset = (uint32_t)m_strOutput.size();
+	m_strOutput.resize(uOffset + uLength);
+
+	CS_BlobIndex* pbi = (CS_BlobIndex*)(&m_strOutput[0] + sizeof(CS_SuperBlob)) + m_uAdded++;
+	pbi->type = BE(uType);
+	pbi->offset = BE(uOffset);
+	return (uint8_t*)&m_strOutput[uOffset];
+}
+
+bool ZSuperBlob::AddSlot(uint32_t uType, const string& strSlot)
+{
+	uint8_t* pSlot = AddSlot(uType, (uint32_t)strSlot.size());
+	if (NULL == pSlot) {
+		return false;
+	}
+	memcpy(pSlot, strSlot.data(), strSlot.size());
+	return true;
+}
+
+const uint8_t* ZSuperBlob::GetSlot(uint32_t uType, uint32_t& uLength) const
+{
+	uLength = 0;
+	const CS_BlobIndex* pbi = (const CS_BlobIndex*)(m_strOutput.data() + sizeof(CS_SuperBlob));
+	for (uint32_t i = 0; i < m_uAdded; i++) {
+		if (BE(pbi[i].type) == uType) {
+			uint32_t uOffset = BE(pbi[i].offset);
+			uint32_t uEnd = (i + 1 < m_uAdded) ? BE(pbi[i + 1].offset) : (uint32_t)m_strOutput.size();
+			uLength = uEnd - uOffset;
+			return (const uint8_t*)m_strOutput.data() + uOffset;
+		}
+	}
+	return NULL;
+}
+
+bool ZSuperBlob::Finish()
+{
+	if (0 == m_uAdded) {
+		m_strOutput.clear();
+		return false;
+	}
+
+	if (m_uAdded < m_uCount) { // a slot was skipped, drop its index entry
+		uint32_t uUnused = (m_uCount - m_uAdded) * sizeof(CS_BlobIndex);
+		uint32_t uHeaderLength = sizeof(CS_SuperBlob) + m_uAdded * sizeof(CS_BlobIndex);
+		m_strOutput.erase(uHeaderLength, uUnused);
+
+		CS_BlobIndex* pbi = (CS_BlobIndex*)(&m_strOutput[0] + sizeof(CS_SuperBlob));
+		for (uint32_t i = 0; i < m_uAdded; i++) {
+			pbi[i].offset = BE(BE(pbi[i].offset) - uUnused);
+		}
+		m_uCount = m_uAdded;
+	}
+
+	CS_SuperBlob* psb = (CS_SuperBlob*)&m_strOutput[0];
+	psb->magic = BE((uint32_t)CSMAGIC_EMBEDDED_SIGNATURE);
+	psb->length = BE((uint32_t)m_strOutput.size());
+	psb->count = BE(m_uCount);
+	return true;
+}
 
 void ZSign::_DERLength(string& strBlob, uint64_t uLength)
 {
@@ -107,23 +266,13 @@ bool ZSign::SlotParseRequirements(uint8_t* pSlotBase, CS_BlobIndex* pbi)
 		return false;
 	}
 
-#ifndef _WIN32
-	if (ZFile::IsFileExists("/usr/bin/csreq")) {
-		string strTempFile;
-		ZUtil::StringFormatV(strTempFile, "/tmp/Requirements_%llu.blob", ZUtil::GetMicroSecond());
-		ZFile::WriteFile(strTempFile.c_str(), (const char*)pSlotBase, uSlotLength);
-
-		string strCommand;
-		ZUtil::StringFormatV(strCommand, "/usr/bin/csreq -r '%s' -t ", strTempFile.c_str());
-		char result[1024] = { 0 };
-		FILE* cmd = popen(strCommand.c_str(), "r");
-		while (NULL != fgets(result, sizeof(result), cmd)) {
-			printf("\treqtext: \t%s", result);
-		}
-		pclose(cmd);
-		ZFile::RemoveFile(strTempFile.c_str());
+	string strText;
+	ZRequirement::Decompile(pSlotBase, uSlotLength, strText);
+	vector<string> arrLines;
+	ZUtil::StringSplit(strText, "\n", arrLines);
+	for (const string& strLine : arrLines) {
+		ZLog::Print(("\treqtext: \t" + strLine + "\n").c_str()); // can be longer than PrintV's buffer
 	}
-#endif
 
 	SlotParseGeneralTailer(pSlotBase, uSlotLength);
 
@@ -369,9 +518,190 @@ bool ZSign::SlotParseCodeDirectory(uint8_t* pSlotBase, CS_BlobIndex* pbi)
 	return true;
 }
 
+// an empty or all zero hash marks an unused special slot
+static bool IsSpecialSlotUsed(const string* pSHA)
+{
+	if (NULL == pSHA) {
+		return false;
+	}
+	for (size_t i = 0; i < pSHA->size(); i++) {
+		if (0 != (*pSHA)[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// digest a CodeDirectory is specialized on
+struct ZCodeHashSHA1
+{
+	static const uint8_t	uHashSize = 20;
+	static const uint8_t	uHashType = CS_HASHTYPE_SHA1;
+	static void Hash(const uint8_t* pData, size_t sSize, uint8_t* pOutput) { ZSHA::SHA1(pData, sSize, pOutput); }
+};
+
+struct ZCodeHashSHA256
+{
+	static const uint8_t	uHashSize = 32;
+	static const uint8_t	uHashType = CS_HASHTYPE_SHA256;
+	static void Hash(const uint8_t* pData, size_t sSize, uint8_t* pOutput) { ZSHA::SHA256(pData, sSize, pOutput); }
+};
+
+// Writes a CodeDirectory of one version and hash type. The header layout is fixed at compile time
+// and the page loop calls the digest directly, with no per-page hash type or version checks.
+template<class H, uint32_t uVersion>
+class ZCodeDirectoryWriter
+{
+public:
+	static const uint32_t	uPageShift = 12;
+	static const uint32_t	uPageSize = 1U << uPageShift;
+	static const bool		bScatter = (uVersion >= 0x20100);
+	static const bool		bTeam = (uVersion >= 0x20200);
+	static const bool		bCodeLimit64 = (uVersion >= 0x20300);
+	static const bool		bExecSeg = (uVersion >= 0x20400);
+	static const uint32_t	uHeaderLength = 44
+		+ (bScatter ? sizeof(CS_CodeDirectory::scatterOffset) : 0)
+		+ (bTeam ? sizeof(CS_CodeDirectory::teamOffset) : 0)
+		+ (bCodeLimit64 ? sizeof(CS_CodeDirectory::spare3) + sizeof(CS_CodeDirectory::codeLimit64) : 0)
+		+ (bExecSeg ? sizeof(CS_CodeDirectory::execSegBase) + sizeof(CS_CodeDirectory::execSegLimit) + sizeof(CS_CodeDirectory::execSegFlags) : 0);
+	static_assert(uHeaderLength <= sizeof(CS_CodeDirectory), "CodeDirectory version not supported");
+
+	static uint32_t GetCodeSlots(uint64_t uCodeLength)
+	{
+		return (uint32_t)((uCodeLength + uPageSize - 1) >> uPageShift);
+	}
+
+	static uint32_t GetLength(uint64_t uCodeLength, uint32_t uSpecialSlots, const string& strBundleId, const string& strTeamId)
+	{
+		uint32_t uLength = uHeaderLength + (uint32_t)strBundleId.size() + 1;
+		if (bTeam && !strTeamId.empty()) {
+			uLength += (uint32_t)strTeamId.size() + 1;
+		}
+		return uLength + (uSpecialSlots + GetCodeSlots(uCodeLength)) * H::uHashSize;
+	}
+
+	static bool Write(uint8_t* pCodeBase,
+		uint64_t uCodeLength,
+		const uint8_t* pCodeSlotsData,
+		uint32_t uCodeSlotsDataLength,
+		uint64_t execSegLimit,
+		uint64_t execSegFlags,
+		const string& strBundleId,
+		const string& strTeamId,
+		const string* arrSpecialSlots[],
+		uint32_t uSpecialSlots,
+		bool isAdhoc,
+		ZCodePageMemo* pPageMemo,
+		uint32_t uSlotType,
+		ZSuperBlob& superBlob)
+	{
+		// `strTeamId` may be empty for ad-hoc signature; in that case, `cdHeader.teamOffset == 0` and string
+		// data is not serialized below.
+		uint32_t uBundleIDLength = (uint32_t)strBundleId.size() + 1;
+		uint32_t uTeamIDLength = (bTeam && !strTeamId.empty()) ? (uint32_t)strTeamId.size() + 1 : 0;
+		uint32_t uCodeSlots = GetCodeSlots(uCodeLength);
+		uint32_t uHashOffset = uHeaderLength + uBundleIDLength + uTeamIDLength + uSpecialSlots * H::uHashSize;
+		uint32_t uSlotLength = uHashOffset + uCodeSlots * H::uHashSize;
+
+		CS_CodeDirectory cdHeader;
+		memset(&cdHeader, 0, sizeof(cdHeader));
+		cdHeader.magic = BE((uint32_t)CSMAGIC_CODEDIRECTORY);
+		cdHeader.length = BE(uSlotLength);
+		cdHeader.version = BE(uVersion);
+		cdHeader.flags = isAdhoc ? BE(static_cast<uint32_t>(CS_SEC_CODESIGNATURE_ADHOC)) : 0U;
+		cdHeader.hashOffset = BE(uHashOffset);
+		cdHeader.identOffset = BE(uHeaderLength);
+		cdHeader.nSpecialSlots = BE(uSpecialSlots);
+		cdHeader.nCodeSlots = BE(uCodeSlots);
+		cdHeader.codeLimit = BE((uint32_t)min(uCodeLength, (uint64_t)UINT32_MAX));
+		cdHeader.hashSize = H::uHashSize;
+		cdHeader.hashType = H::uHashType;
+		cdHeader.pageSize = uPageShift;
+		if (uTeamIDLength > 0) {
+			cdHeader.teamOffset = BE(uHeaderLength + uBundleIDLength);
+		}
+		if (bCodeLimit64 && uCodeLength > UINT32_MAX) {
+			cdHeader.codeLimit64 = BE(uCodeLength);
+		}
+		if (bExecSeg) {
+			cdHeader.execSegLimit = BE(execSegLimit);
+			cdHeader.execSegFlags = BE(execSegFlags);
+		}
+
+		uint8_t* pSlot = superBlob.AddSlot(uSlotType, uSlotLength);
+		if (NULL == pSlot) {
+			return false;
+		}
+
+		uint8_t* pOutput = pSlot;
+		memcpy(pOutput, &cdHeader, uHeaderLength);
+		pOutput += uHeaderLength;
+		memcpy(pOutput, strBundleId.c_str(), uBundleIDLength);
+		pOutput += uBundleIDLength;
+		if (uTeamIDLength > 0) {
+			memcpy(pOutput, strTeamId.c_str(), uTeamIDLength);
+			pOutput += uTeamIDLength;
+		}
+
+		for (uint32_t i = 0; i < uSpecialSlots; i++) {
+			memset(pOutput, 0, H::uHashSize);
+			if (NULL != arrSpecialSlots[i]) {
+				memcpy(pOutput, arrSpecialSlots[i]->data(), min(arrSpecialSlots[i]->size(), (size_t)H::uHashSize));
+			}
+			pOutput += H::uHashSize;
+		}
+
+		// page hashes go straight into the slot
+		if (NULL != pCodeSlotsData && (uCodeSlotsDataLength == uCodeSlots * H::uHashSize)) { //use exists
+			memcpy(pOutput, pCodeSlotsData, uCodeSlotsDataLength);
+		} else {
+			if (NULL != pPageMemo) {
+				pPageMemo->Init(pCodeBase, uCodeLength, uPageSize);
+			}
+			HashPages(pCodeBase, uCodeLength, pPageMemo, pOutput);
+		}
+		return true;
+	}
+
+private:
+	static void HashPages(uint8_t* pCodeBase, uint64_t uCodeLength, const ZCodePageMemo* pPageMemo, uint8_t* pCodeSlots)
+	{
+		ZCodePageMemo emptyMemo;
+		if (NULL == pPageMemo) {
+			pPageMemo = &emptyMemo;
+		}
+
+		uint32_t uPages = (uint32_t)(uCodeLength >> uPageShift);
+		for (uint32_t uWindow = 0; uWindow < uPages; uWindow += s_uWindowPages) {
+			uint32_t uWindowEnd = min(uPages, uWindow + s_uWindowPages);
+			for (uint32_t i = uWindow; i < uWindowEnd; i++) {
+				uint32_t uSourcePage = pPageMemo->GetSourcePage(i);
+				if (uSourcePage != i) { // same content as a page we already hashed
+					memcpy(pCodeSlots + (size_t)i * H::uHashSize, pCodeSlots + (size_t)uSourcePage * H::uHashSize, H::uHashSize);
+				} else {
+					H::Hash(pCodeBase + ((size_t)i << uPageShift), uPageSize, pCodeSlots + (size_t)i * H::uHashSize);
+				}
+			}
+			if (uWindowEnd < uPages) {
+				ZFile::ReleaseMappedPages(pCodeBase + ((size_t)uWindow << uPageShift), (size_t)s_uWindowPages << uPageShift);
+			}
+		}
+
+		uint32_t uRemain = (uint32_t)(uCodeLength & (uPageSize - 1));
+		if (uRemain > 0) {
+			H::Hash(pCodeBase + ((size_t)uPages << uPageShift), uRemain, pCodeSlots + (size_t)uPages * H::uHashSize);
+		}
+	}
+};
+
+// the CodeDirectory version zsign writes
+static const uint32_t s_uCodeDirectoryVersion = 0x20400;
+typedef ZCodeDirectoryWriter<ZCodeHashSHA1, s_uCodeDirectoryVersion>	ZCodeDirectorySHA1Writer;
+typedef ZCodeDirectoryWriter<ZCodeHashSHA256, s_uCodeDirectoryVersion>	ZCodeDirectorySHA256Writer;
+
 bool ZSign::SlotBuildCodeDirectory(bool bAlternate,
 	uint8_t* pCodeBase,
-	uint32_t uCodeLength,
+	uint64_t uCodeLength,
 	uint8_t* pCodeSlotsData,
 	uint32_t uCodeSlotsDataLength,
 	uint64_t execSegLimit,
@@ -385,149 +715,112 @@ bool ZSign::SlotBuildCodeDirectory(bool bAlternate,
 	const string& strDerEntitlementsSlotSHA,
 	bool isExecuteArch,
 	bool isAdhoc,
-	string& strOutput)
+	ZCodePageMemo* pPageMemo,
+	uint32_t uSlotType,
+	ZSuperBlob& superBlob)
 {
-	strOutput.clear();
 	if (NULL == pCodeBase || uCodeLength <= 0 || strBundleId.empty() || (strTeamId.empty() && !isAdhoc)) {
 		return false;
 	}
 
-	uint32_t uVersion = 0x20400;
-
-	CS_CodeDirectory cdHeader;
-	memset(&cdHeader, 0, sizeof(cdHeader));
-	cdHeader.magic = BE((uint32_t)CSMAGIC_CODEDIRECTORY);
-	cdHeader.length = 0;
-	cdHeader.version = BE(uVersion);
-	cdHeader.flags = isAdhoc ? BE(static_cast<uint32_t>(CS_SEC_CODESIGNATURE_ADHOC)) : 0U;
-	cdHeader.hashOffset = 0;
-	cdHeader.identOffset = 0;
-	cdHeader.nSpecialSlots = 0;
-	cdHeader.nCodeSlots = 0;
-	cdHeader.codeLimit = BE(uCodeLength);
-	cdHeader.hashSize = bAlternate ? 32 : 20;
-	cdHeader.hashType = bAlternate ? 2 : 1;
-	cdHeader.spare1 = 0;
-	cdHeader.pageSize = 12;
-	cdHeader.spare2 = 0;
-	cdHeader.scatterOffset = 0;
-	cdHeader.teamOffset = 0;
-	cdHeader.execSegBase = 0;
-	cdHeader.execSegLimit = BE(execSegLimit);
-	cdHeader.execSegFlags = BE(execSegFlags);
-
-	string strEmptySHA;
-	strEmptySHA.append(cdHeader.hashSize, 0);
-	vector<string> arrSpecialSlots;
-
+	// Special slots have negative indexes and come before code slots, i.e. index -1 is the 'Info.plist'
+	// slot, and -2 is 'Requirements slot'. NULL stands for an unused slot (all zero hash).
+	const string* arrSpecialSlots[7];
+	uint32_t uSpecialSlots = 0;
 	if (isExecuteArch) {
-		arrSpecialSlots.push_back(strDerEntitlementsSlotSHA.empty() ? strEmptySHA : strDerEntitlementsSlotSHA);
-		arrSpecialSlots.push_back(strEmptySHA);
+		arrSpecialSlots[uSpecialSlots++] = &strDerEntitlementsSlotSHA;
+		arrSpecialSlots[uSpecialSlots++] = NULL;
 	}
-	arrSpecialSlots.push_back(strEntitlementsSlotSHA.empty() ? strEmptySHA : strEntitlementsSlotSHA);
-	arrSpecialSlots.push_back(strEmptySHA);
-	arrSpecialSlots.push_back(strCodeResourcesSHA.empty() ? strEmptySHA : strCodeResourcesSHA);
-	arrSpecialSlots.push_back(strRequirementsSlotSHA.empty() ? strEmptySHA : strRequirementsSlotSHA);
-	arrSpecialSlots.push_back(strInfoPlistSHA.empty() ? strEmptySHA : strInfoPlistSHA);
-
-	// Trailing entries whose hash == strEmptySHA in `arrSpecialSlots` can be omitted; erase them.
-	// Special slots have negative indexes and come before code slots, i.e. index -1 is the 'Info.plist'
-	// slot, and -2 is 'Requirements slot'.
-	// Note that in `arrSpecialSlots` is reversed and trailing elements appear at front.
-	auto itLastUsedSpecialSlot = std::find_if(arrSpecialSlots.begin(), arrSpecialSlots.end(),
-		[&](const string& strSHA) { return strSHA != strEmptySHA; });
-	if (itLastUsedSpecialSlot != arrSpecialSlots.begin()) {
-		arrSpecialSlots.erase(arrSpecialSlots.begin(), itLastUsedSpecialSlot);
+	arrSpecialSlots[uSpecialSlots++] = &strEntitlementsSlotSHA;
+	arrSpecialSlots[uSpecialSlots++] = NULL;
+	arrSpecialSlots[uSpecialSlots++] = &strCodeResourcesSHA;
+	arrSpecialSlots[uSpecialSlots++] = &strRequirementsSlotSHA;
+	arrSpecialSlots[uSpecialSlots++] = &strInfoPlistSHA;
+
+	// Leading unused entries (the highest slot indexes) can be omitted.
+	uint32_t uFirstUsed = 0;
+	while (uFirstUsed < uSpecialSlots && !IsSpecialSlotUsed(arrSpecialSlots[uFirstUsed])) {
+		uFirstUsed++;
 	}
 
-	uint32_t uPageSize = (uint32_t)pow(2, cdHeader.pageSize);
-	uint32_t uPages = uCodeLength / uPageSize;
-	uint32_t uRemain = uCodeLength % uPageSize;
-	uint32_t uCodeSlots = uPages + (uRemain > 0 ? 1 : 0);
-
-	uint32_t uHeaderLength = 44;
-	if (uVersion >= 0x20100) {
-		uHeaderLength += sizeof(cdHeader.scatterOffset);
-	}
-	if (uVersion >= 0x20200) {
-		uHeaderLength += sizeof(cdHeader.teamOffset);
+	if (bAlternate) {
+		return ZCodeDirectorySHA256Writer::Write(pCodeBase, uCodeLength, pCodeSlotsData, uCodeSlotsDataLength, execSegLimit, execSegFlags,
+			strBundleId, strTeamId, arrSpecialSlots + uFirstUsed, uSpecialSlots - uFirstUsed, isAdhoc, pPageMemo, uSlotType, superBlob);
 	}
-	if (uVersion >= 0x20300) {
-		uHeaderLength += sizeof(cdHeader.spare3);
-		uHeaderLength += sizeof(cdHeader.codeLimit64);
-	}
-	if (uVersion >= 0x20400) {
-		uHeaderLength += sizeof(cdHeader.execSegBase);
-		uHeaderLength += sizeof(cdHeader.execSegLimit);
-		uHeaderLength += sizeof(cdHeader.execSegFlags);
-	}
-
-	uint32_t uBundleIDLength = (uint32_t)strBundleId.size() + 1;
-	uint32_t uTeamIDLength = (uint32_t)strTeamId.size() + 1;
-	uint32_t uSpecialSlotsLength = (uint32_t)arrSpecialSlots.size() * cdHeader.hashSize;
-	uint32_t uCodeSlotsLength = uCodeSlots * cdHeader.hashSize;
+	return ZCodeDirectorySHA1Writer::Write(pCodeBase, uCodeLength, pCodeSlotsData, uCodeSlotsDataLength, execSegLimit, execSegFlags,
+		strBundleId, strTeamId, arrSpecialSlots + uFirstUsed, uSpecialSlots - uFirstUsed, isAdhoc, pPageMemo, uSlotType, superBlob);
+}
 
-	uint32_t uSlotLength = uHeaderLength + uBundleIDLength + uSpecialSlotsLength + uCodeSlotsLength;
-	if (uVersion >= 0x20100) {
-		//todo
-	}
-	if (uVersion >= 0x20200 && !strTeamId.empty()) {
-		uSlotLength += uTeamIDLength;
+bool ZSign::ReuseCodeSlots(uint8_t* pCodeBase,
+	uint64_t uCodeLength,
+	const uint8_t* pCodeSlotsData,
+	uint32_t uCodeSlotsDataLength,
+	uint32_t uHashSize,
+	const set<uint32_t>& setDirtyPages,
+	uint32_t uVerifyPages,
+	uint32_t uVerifyRate,
+	string& strOutput)
+{
+	strOutput.clear();
+	const uint32_t uPageSize = 4096;
+	const uint32_t uMaxSamples = 16;
+	uint32_t uCodeSlots = (uint32_t)((uCodeLength + uPageSize - 1) / uPageSize);
+	if (NULL == pCodeBase || NULL == pCodeSlotsData || 0 == uCodeSlots || uCodeSlotsDataLength != uCodeSlots * uHashSize) {
+		return false;
 	}
 
-	cdHeader.length = BE(uSlotLength);
-	cdHeader.identOffset = BE(uHeaderLength);
-	cdHeader.nSpecialSlots = BE((uint32_t)arrSpecialSlots.size());
-	cdHeader.nCodeSlots = BE(uCodeSlots);
-
-	uint32_t uHashOffset = uHeaderLength + uBundleIDLength + uSpecialSlotsLength;
-	if (uVersion >= 0x20100) {
-		//todo
-	}
-	// `strTeamId` may be empty for ad-hoc signature; in that case, `cdHeader.teamOffset == 0` and string
-	// data is not serialized below.
-	if (uVersion >= 0x20200 && !strTeamId.empty()) {
-		uHashOffset += uTeamIDLength;
-		cdHeader.teamOffset = BE(uHeaderLength + uBundleIDLength);
+	set<uint32_t> setSamples;
+	for (uint32_t i = 0; i < uVerifyPages && i < uCodeSlots; i++) {
+		setSamples.insert(i);
 	}
-	cdHeader.hashOffset = BE(uHashOffset);
-
-	strOutput.append((const char*)&cdHeader, uHeaderLength);
-	strOutput.append(strBundleId.data(), strBundleId.size() + 1);
-	if (uVersion >= 0x20100) {
-		//todo
+	uint32_t uStep = (uCodeSlots > uMaxSamples) ? (uCodeSlots / uMaxSamples) : 1;
+	for (uint32_t i = 0; i < uCodeSlots; i += uStep) {
+		setSamples.insert(i);
 	}
-	if (uVersion >= 0x20200 && !strTeamId.empty()) {
-		strOutput.append(strTeamId.data(), strTeamId.size() + 1);
+	setSamples.insert(uCodeSlots - 1);
+	if (uVerifyRate > 0) {
+		minstd_rand rng(random_device{}());
+		for (uint32_t i = 0; i < uCodeSlots; i++) {
+			if (rng() % 100 < uVerifyRate) {
+				setSamples.insert(i);
+			}
+		}
 	}
 
-	for (uint32_t i = 0; i < LE(cdHeader.nSpecialSlots); i++) {
-		strOutput.append(arrSpecialSlots[i].data(), arrSpecialSlots[i].size());
-	}
+	strOutput.assign((const char*)pCodeSlotsData, uCodeSlotsDataLength);
+	for (uint32_t i : setSamples) {
+		if (setDirtyPages.count(i) > 0) {
+			continue;
+		}
 
-	if (NULL != pCodeSlotsData && (uCodeSlotsDataLength == uCodeSlots * cdHeader.hashSize)) { //use exists
-		strOutput.append((const char*)pCodeSlotsData, uCodeSlotsDataLength);
-	} else {
-		for (uint32_t i = 0; i < uPages; i++) {
-			string strSHASum;
-			if (1 == cdHeader.hashType) {
-				ZSHA::SHA1(pCodeBase + uPageSize * i, uPageSize, strSHASum);
-			} else  {
-				ZSHA::SHA256(pCodeBase + uPageSize * i, uPageSize, strSHASum);
-			} 
-			strOutput.append(strSHASum.data(), strSHASum.size());
+		uint32_t uSize = (i == uCodeSlots - 1) ? (uint32_t)(uCodeLength - (uint64_t)i * uPageSize) : uPageSize;
+		string strSHASum;
+		if (20 == uHashSize) {
+			ZSHA::SHA1(pCodeBase + (size_t)i * uPageSize, uSize, strSHASum);
+		} else {
+			ZSHA::SHA256(pCodeBase + (size_t)i * uPageSize, uSize, strSHASum);
 		}
-		if (uRemain > 0) {
-			string strSHASum;
-			if (1 == cdHeader.hashType) {
-				ZSHA::SHA1(pCodeBase + uPageSize * uPages, uRemain, strSHASum);
-			} else {
-				ZSHA::SHA256(pCodeBase + uPageSize * uPages, uRemain, strSHASum);
-			}
-			strOutput.append(strSHASum.data(), strSHASum.size());
+
+		if (strSHASum.size() != uHashSize || 0 != memcmp(strSHASum.data(), pCodeSlotsData + i * uHashSize, uHashSize)) {
+			strOutput.clear();
+			return false;
 		}
 	}
 
+	for (uint32_t i : setDirtyPages) {
+		if (i >= uCodeSlots) {
+			break;
+		}
+
+		uint32_t uSize = (i == uCodeSlots - 1) ? (uint32_t)(uCodeLength - (uint64_t)i * uPageSize) : uPageSize;
+		string strSHASum;
+		if (20 == uHashSize) {
+			ZSHA::SHA1(pCodeBase + (size_t)i * uPageSize, uSize, strSHASum);
+		} else {
+			ZSHA::SHA256(pCodeBase + (size_t)i * uPageSize, uSize, strSHASum);
+		}
+		strOutput.replace(i * uHashSize, uHashSize, strSHASum);
+	}
 	return true;
 }
 
@@ -588,24 +881,35 @@ bool ZSign::SlotParseCMSSignature(uint8_t* pSlotBase, CS_BlobIndex* pbi)
 	return true;
 }
 
-bool ZSign::SlotBuildCMSSignature(ZSignAsset* pSignAsset,
-	const string& strCodeDirectorySlot,
-	const string& strAltnateCodeDirectorySlot,
-	string& strOutput)
+uint32_t ZSign::GetCodeDirectoryLength(uint64_t uCodeLength, uint32_t uHashSize, uint32_t uSpecialSlots, const string& strBundleId, const string& strTeamId)
+{
+	if (ZCodeHashSHA256::uHashSize == uHashSize) {
+		return ZCodeDirectorySHA256Writer::GetLength(uCodeLength, uSpecialSlots, strBundleId, strTeamId);
+	}
+	return ZCodeDirectorySHA1Writer::GetLength(uCodeLength, uSpecialSlots, strBundleId, strTeamId);
+}
+
+bool ZSign::SlotBuildCMSSignature(ZSignAsset* pSignAsset, ZSuperBlob& superBlob)
 {
-	strOutput.clear();
 	if (pSignAsset->m_bAdhoc) { // The empty CSSLOT_SIGNATURESLOT
 		uint8_t ldid[] = { 0xfa, 0xde, 0x0b, 0x01, 0x00, 0x00, 0x00, 0x08 };
-		strOutput.append((const char*)ldid, sizeof(ldid));
-		return true;
+		return superBlob.AddSlot(CSSLOT_SIGNATURESLOT, string((const char*)ldid, sizeof(ldid)));
+	}
+
+	uint32_t uCodeDirectorySlotLength = 0;
+	uint32_t uAltnateCodeDirectorySlotLength = 0;
+	const uint8_t* pCodeDirectorySlot = superBlob.GetSlot(CSSLOT_CODEDIRECTORY, uCodeDirectorySlotLength);
+	const uint8_t* pAltnateCodeDirectorySlot = superBlob.GetSlot(CSSLOT_ALTERNATE_CODEDIRECTORIES, uAltnateCodeDirectorySlotLength);
+	if (NULL == pCodeDirectorySlot) {
+		return false;
 	}
 
 	jvalue jvHashes;
 	string strCDHashesPlist;
 	string strCodeDirectorySlotSHA1;
 	string strAltnateCodeDirectorySlot256;
-	ZSHA::SHA1(strCodeDirectorySlot, strCodeDirectorySlotSHA1);
-	ZSHA::SHA256(strAltnateCodeDirectorySlot, strAltnateCodeDirectorySlot256);
+	ZSHA::SHA1((uint8_t*)pCodeDirectorySlot, uCodeDirectorySlotLength, strCodeDirectorySlotSHA1);
+	ZSHA::SHA256((uint8_t*)pAltnateCodeDirectorySlot, uAltnateCodeDirectorySlotLength, strAltnateCodeDirectorySlot256);
 
 	size_t cdHashSize = strCodeDirectorySlotSHA1.size();
 	jvHashes["cdhashes"][0].assign_data(strCodeDirectorySlotSHA1.data(), cdHashSize);
@@ -613,16 +917,20 @@ bool ZSign::SlotBuildCMSSignature(ZSignAsset* pSignAsset,
 	jvHashes.style_write_plist(strCDHashesPlist);
 
 	string strCMSData;
-	if (!pSignAsset->GenerateCMS(strCodeDirectorySlot, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSData)) {
+	if (!pSignAsset->GenerateCMS(pCodeDirectorySlot, uCodeDirectorySlotLength, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSData)) {
+		return false;
+	}
+
+	uint8_t* pSlot = superBlob.AddSlot(CSSLOT_SIGNATURESLOT, (uint32_t)strCMSData.size() + 8);
+	if (NULL == pSlot) {
 		return false;
 	}
 
 	uint32_t uMagic = BE((uint32_t)CSMAGIC_BLOBWRAPPER);
 	uint32_t uLength = BE((uint32_t)strCMSData.size() + 8);
-
-	strOutput.append((const char*)&uMagic, sizeof(uMagic));
-	strOutput.append((const char*)&uLength, sizeof(uLength));
-	strOutput.append(strCMSData.data(), strCMSData.size());
+	memcpy(pSlot, &uMagic, sizeof(uMagic));
+	memcpy(pSlot + 4, &uLength, sizeof(uLength));
+	memcpy(pSlot + 8, strCMSData.data(), strCMSData.size());
 	return true;
 }
 
@@ -700,6 +1008,7 @@ bool ZSign::SlotGetCodeSlotsData(uint8_t* pSlotBase, uint8_t*& pCodeSlots, uint3
 }
 
 bool ZSign::GetCodeSignatureExistsCodeSlotsData(uint8_t* pCSBase,
+	uint64_t uCodeLength,
 	uint8_t*& pCodeSlots1Data,
 	uint32_t& uCodeSlots1DataLength,
 	uint8_t*& pCodeSlots256Data,
@@ -714,32 +1023,32 @@ bool ZSign::GetCodeSignatureExistsCodeSlotsData(uint8_t* pCSBase,
 		return false;
 	}
 
+	// slots are only usable when the directory covers the same code with 4K pages,
+	// they are picked by hash type whichever blob they are stored in.
 	CS_BlobIndex* pbi = (CS_BlobIndex*)(pCSBase + sizeof(CS_SuperBlob));
 	for (uint32_t i = 0; i < LE(psb->count); i++, pbi++) {
-		uint8_t* pSlotBase = pCSBase + LE(pbi->offset);
-		switch (LE(pbi->type)) {
-		case CSSLOT_CODEDIRECTORY:
-		{
-			CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
-			if (LE(cdHeader.length) > 8) {
-				pCodeSlots1Data = pSlotBase + LE(cdHeader.hashOffset);
-				uCodeSlots1DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
-			}
+		uint32_t uType = LE(pbi->type);
+		if (CSSLOT_CODEDIRECTORY != uType && (uType < CSSLOT_ALTERNATE_CODEDIRECTORIES || uType >= CSSLOT_ALTERNATE_CODEDIRECTORY_LIMIT)) {
+			continue;
 		}
-		break;
-		case CSSLOT_ALTERNATE_CODEDIRECTORIES:
-		{
-			CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
-			if (LE(cdHeader.length) > 8) {
-				pCodeSlots256Data = pSlotBase + LE(cdHeader.hashOffset);
-				uCodeSlots256DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
-			}
+
+		uint8_t* pSlotBase = pCSBase + LE(pbi->offset);
+		CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
+		uint32_t uCodeSlotsLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
+		uint64_t uCodeLimit = (LE(cdHeader.version) >= 0x20300 && 0 != cdHeader.codeLimit64) ? LE(cdHeader.codeLimit64) : LE(cdHeader.codeLimit);
+		if (CSMAGIC_CODEDIRECTORY != LE(cdHeader.magic) || 12 != cdHeader.pageSize || uCodeLength != uCodeLimit
+			|| LE(cdHeader.hashOffset) + uCodeSlotsLength > LE(cdHeader.length)) {
+			continue;
 		}
-		break;
-		default:
-			break;
+
+		if (1 == cdHeader.hashType && 20 == cdHeader.hashSize) {
+			pCodeSlots1Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots1DataLength = uCodeSlotsLength;
+		} else if (2 == cdHeader.hashType && 32 == cdHeader.hashSize) {
+			pCodeSlots256Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots256DataLength = uCodeSlotsLength;
 		}
 	}
 
-	return ((NULL != pCodeSlots1Data) && (NULL != pCodeSlots256Data) && uCodeSlots1DataLength > 0 && uCodeSlots256DataLength > 0);
+	return ((NULL != pCodeSlots1Data) || (NULL != pCodeSlots256Data));
 }
@@ -1,6 +1,49 @@
 #pragma once
 #include "openssl.h"
 
+class ZCodePageMemo
+{
+public:
+	ZCodePageMemo();
+
+public:
+	void		Init(uint8_t* pCodeBase, uint64_t uCodeLength, uint32_t uPageSize);
+	bool		IsInited() const { return m_bInited; }
+	uint32_t	GetSourcePage(uint32_t uPage) const;
+	uint32_t	GetDedupPages() const { return m_uDedupPages; }
+	uint32_t	GetZeroPages() const { return m_uZeroPages; }
+
+private:
+	static uint64_t Fingerprint(const uint8_t* pData, uint32_t uSize, bool& bZero);
+
+private:
+	bool				m_bInited;
+	uint32_t			m_uDedupPages;
+	uint32_t			m_uZeroPages;
+	vector<uint32_t>	m_arrSourcePages;
+};
+
+// Assembles a CS_SuperBlob in one buffer. The slot count is fixed up front so the index can be laid
+// out first, then every slot is appended and written in place. A pointer AddSlot returns is only
+// valid until the next AddSlot; GetSlot looks a slot up again. Finish drops the index entries of
+// slots that were never added.
+class ZSuperBlob
+{
+public:
+	ZSuperBlob(string& strOutput, uint32_t uCount, uint32_t uCapacity);
+
+public:
+	uint8_t*		AddSlot(uint32_t uType, uint32_t uLength);
+	bool			AddSlot(uint32_t uType, const string& strSlot);
+	const uint8_t*	GetSlot(uint32_t uType, uint32_t& uLength) const;
+	bool			Finish();
+
+private:
+	string&		m_strOutput;
+	uint32_t	m_uCount;
+	uint32_t	m_uAdded;
+};
+
 class ZSign
 {
 public:
@@ -11,7 +54,7 @@ public:
 	static bool SlotBuildRequirements(const string& strBundleID, const string& strSubjectCN, string& strOutput);
 	static bool SlotBuildCodeDirectory(bool bAlternate,
 										uint8_t* pCodeBase,
-										uint32_t uCodeLength,
+										uint64_t uCodeLength,
 										uint8_t* pCodeSlotsData,
 										uint32_t uCodeSlotsDataLength,
 										uint64_t execSegLimit,
@@ -25,12 +68,15 @@ public:
 										const string& strDerEntitlementsSlotSHA,
 										bool isExecuteArch,
 										bool isAdhoc,
-										string& strOutput);
+										ZCodePageMemo* pPageMemo,
+										uint32_t uSlotType,
+										ZSuperBlob& superBlob);
 	
-	static bool SlotBuildCMSSignature(ZSignAsset* pSignAsset,
-										const string& strCodeDirectorySlot,
-										const string& strAltnateCodeDirectorySlot,
-										string& strOutput);
+	// length of the blob SlotBuildCodeDirectory produces, without hashing anything
+	static uint32_t GetCodeDirectoryLength(uint64_t uCodeLength, uint32_t uHashSize, uint32_t uSpecialSlots, const string& strBundleId, const string& strTeamId);
+
+	// signs the code directories already in superBlob and appends the CMS slot
+	static bool SlotBuildCMSSignature(ZSignAsset* pSignAsset, ZSuperBlob& superBlob);
 
 	static bool GetCodeSignatureCodeSlotsData(uint8_t* pCSBase, 
 												uint8_t*& pCodeSlots1, 
@@ -38,12 +84,27 @@ public:
 												uint8_t*& pCodeSlots256, 
 												uint32_t& uCodeSlots256Length);
 	static bool GetCodeSignatureExistsCodeSlotsData(uint8_t* pCSBase,
+													uint64_t uCodeLength,
 													uint8_t*& pCodeSlots1Data,
 													uint32_t& uCodeSlots1DataLength,
 													uint8_t*& pCodeSlots256Data,
 													uint32_t& uCodeSlots256DataLength);
 	static uint32_t GetCodeSignatureLength(uint8_t* pCSBase);
 
+	// Copies code slots taken from an existing signature and rehashes the pages in setDirtyPages. The first
+	// uVerifyPages pages (the executable segment) are always checked, the rest are spot-checked: the last
+	// one, a few in between and uVerifyRate percent at random. Any mismatch fails the whole copy and the
+	// caller has to rehash everything.
+	static bool ReuseCodeSlots(uint8_t* pCodeBase,
+								uint64_t uCodeLength,
+								const uint8_t* pCodeSlotsData,
+								uint32_t uCodeSlotsDataLength,
+								uint32_t uHashSize,
+								const set<uint32_t>& setDirtyPages,
+								uint32_t uVerifyPages,
+								uint32_t uVerifyRate,
+								string& strOutput);
+
 	static string _DER(const jvalue& data);
 	static void _DERLength(string& strBlob, uint64_t uLength);
 
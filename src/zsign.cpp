@@ -4,6 +4,7 @@
 #include "openssl.h"
 #include "timer.h"
 #include "archive.h"
+#include "pool.h"
 
 #ifdef _WIN32
 #include "common_win32.h"
@@ -33,6 +34,11 @@ const struct option options[] = {
 	{"install", no_argument, NULL, 'i'},
 	{"check", no_argument, NULL, 'C'},
 	{"quiet", no_argument, NULL, 'q'},
+	{"threads", required_argument, NULL, 'j'},
+	{"sub_bundle", required_argument, NULL, 's'},
+	{"verify_rate", required_argument, NULL, 'R'},
+	{"info_json", no_argument, NULL, 'I'},
+	{"io_strategy", required_argument, NULL, 'O'},
 	{"help", no_argument, NULL, 'h'},
 	{}
 };
@@ -62,12 +68,75 @@ int usage()
 	ZLog::Print("-2, --sha256_only\tSerialize a single code directory that uses SHA256.\n");
 	ZLog::Print("-C, --check\t\tCheck if the file is signed.\n");
 	ZLog::Print("-q, --quiet\t\tQuiet operation.\n");
+	ZLog::Print("-j, --threads\t\tNumber of worker threads. (default: number of CPUs)\n");
+	ZLog::Print("-s, --sub_bundle\tRe-sign only this nested bundle (path inside the app) and update its parents.\n");
+	ZLog::Print("-R, --verify_rate\tReuse the existing page hashes when force signing, verifying __TEXT and this percent of the rest. (0-100, default: 0 = rehash all)\n");
+	ZLog::Print("-I, --info_json\t\tPrint one JSON line per Mach-O file found in the given files and folders.\n");
+	ZLog::Print("-O, --io_strategy\tHow Mach-O files are mapped and written: default, mmap, or a list of seq,willneed,populate,thp,pwrite.\n");
 	ZLog::Print("-v, --version\t\tShows version.\n");
 	ZLog::Print("-h, --help\t\tShows help (this message).\n");
 
 	return -1;
 }
 
+// -I: inspects every Mach-O file under the arguments in parallel, printing the results in input order
+int info_json(int argc, char* argv[])
+{
+	vector<pair<string, bool>> arrFiles; // (path, named on the command line)
+	for (int i = 0; i < argc; i++) {
+		string strPath = ZFile::GetFullPath(argv[i]);
+		if (ZFile::IsFolder(strPath.c_str())) {
+			bool bEnum = ZFile::EnumFolder(strPath.c_str(), true, NULL, [&](bool bFolder, const string& strFile) {
+				if (!bFolder) {
+					arrFiles.push_back(make_pair(strFile, false));
+				}
+				return false;
+			});
+			if (!bEnum) {
+				return -1;
+			}
+		} else {
+			arrFiles.push_back(make_pair(strPath, true));
+		}
+	}
+
+	mutex mtxOutput;
+	size_t uNextOutput = 0;
+	vector<string> arrOutputs(arrFiles.size());
+	vector<bool> arrDone(arrFiles.size(), false);
+	atomic<size_t> uErrors(0);
+	ZThreadPool::ParallelFor(arrFiles.size(), [&](size_t i) {
+		jvalue jvInfo;
+		ZMachO macho;
+		if (macho.Inspect(arrFiles[i].first.c_str(), jvInfo)) {
+			if (jvInfo.has("error")) {
+				uErrors++;
+			}
+			jvInfo.write(arrOutputs[i]);
+			arrOutputs[i] += "\n";
+		} else if (arrFiles[i].second) {
+			jvInfo["path"] = arrFiles[i].first;
+			jvInfo["error"] = "not a mach-o file";
+			jvInfo.write(arrOutputs[i]);
+			arrOutputs[i] += "\n";
+			uErrors++;
+		}
+
+		// flush the finished prefix so memory stays bounded on huge trees
+		lock_guard<mutex> lock(mtxOutput);
+		arrDone[i] = true;
+		while (uNextOutput < arrDone.size() && arrDone[uNextOutput]) {
+			fwrite(arrOutputs[uNextOutput].data(), 1, arrOutputs[uNextOutput].size(), stdout);
+			string().swap(arrOutputs[uNextOutput]);
+			uNextOutput++;
+		}
+		return true;
+	});
+	fflush(stdout);
+
+	return (uErrors > 0) ? -1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
 	ZTimer atimer;
@@ -79,7 +148,9 @@ int main(int argc, char* argv[])
 	bool bAdhoc = false;
 	bool bSHA256Only = false;
 	bool bCheckSignature = false;
+	bool bInfoJson = false;
 	uint32_t uZipLevel = 0;
+	uint32_t uVerifyRate = 0;
 
 	string strCertFile;
 	string strPKeyFile;
@@ -90,12 +161,13 @@ int main(int argc, char* argv[])
 	string strOutputFile;
 	string strDisplayName;
 	string strEntitleFile;
+	string strSubBundle;
 	vector<string> arrDylibFiles;
 	string strTempFolder = ZFile::GetTempFolder();
 
 	int opt = 0;
 	int argslot = -1;
-	while (-1 != (opt = getopt_long(argc, argv, "dfva2hiqwCc:k:m:o:p:e:b:n:z:l:t:r:",
+	while (-1 != (opt = getopt_long(argc, argv, "dfva2hiqwCIc:k:m:o:p:e:b:n:z:l:t:r:j:s:R:O:",
 		options, &argslot))) {
 		switch (opt) {
 		case 'd':
@@ -155,9 +227,27 @@ int main(int argc, char* argv[])
 		case 'C':
 			bCheckSignature = true;
 			break;
+		case 'I':
+			bInfoJson = true;
+			break;
 		case 'q':
 			ZLog::SetLogLever(ZLog::E_NONE);
 			break;
+		case 'j':
+			ZThreadPool::SetThreads((uint32_t)atoi(optarg));
+			break;
+		case 's':
+			strSubBundle = optarg;
+			break;
+		case 'R':
+			uVerifyRate = (uint32_t)max(0, min(atoi(optarg), 100));
+			break;
+		case 'O':
+			if (!ZFile::SetIOStrategy(optarg)) {
+				ZLog::ErrorV(">>> Invalid io strategy! %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'v': {
 			printf("version: %s\n", ZSIGN_VERSION);
 			return 0;
@@ -176,6 +266,10 @@ int main(int argc, char* argv[])
 		return usage();
 	}
 
+	if (bInfoJson) {
+		return info_json(argc - optind, argv + optind);
+	}
+
 	if (!ZFile::IsFolder(strTempFolder.c_str())) {
 		ZLog::ErrorV(">>> Invalid temp folder! %s\n", strTempFolder.c_str());
 		return -1;
@@ -220,6 +314,7 @@ int main(int argc, char* argv[])
 		if (!zsa.Init(strCertFile, strPKeyFile, strProvFile, strEntitleFile, strPassword, bAdhoc, bSHA256Only, true)) {
 			return -1;
 		}
+		zsa.m_uVerifyRate = uVerifyRate;
 
 		if (!arrDylibFiles.empty()) {
 			for (string dyLibFile : arrDylibFiles) {
@@ -229,12 +324,17 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		if (bForce && uVerifyRate > 0 && uVerifyRate < 100) {
+			ZLog::Warn(">>> Reused page hashes outside __TEXT are only spot-checked, use -R 100 to verify all of them.\n");
+		}
+
 		atimer.Reset();
 		ZLog::PrintV(">>> Signing:\t%s %s\n", strPath.c_str(), (bAdhoc ? " (Ad-hoc)" : ""));
 		string strInfoSHA1;
 		string strInfoSHA256;
-		string strCodeResourcesData;
-		bool bRet = macho->Sign(&zsa, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesData);
+		string strCodeResourcesSHA1;
+		string strCodeResourcesSHA256;
+		bool bRet = macho->Sign(&zsa, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256);
 		atimer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
 		return bRet ? 0 : -1;
 	}
@@ -255,6 +355,7 @@ int main(int argc, char* argv[])
 	if (!zsa.Init(strCertFile, strPKeyFile, strProvFile, strEntitleFile, strPassword, bAdhoc, bSHA256Only, false)) {
 		return -1;
 	}
+	zsa.m_uVerifyRate = uVerifyRate;
 
 	//extract
 	bool bTempFolder = false;
@@ -273,10 +374,14 @@ int main(int argc, char* argv[])
 		atimer.PrintResult(true, ">>> Unzip OK!");
 	}
 
+	if (bForce && uVerifyRate > 0 && uVerifyRate < 100) {
+		ZLog::Warn(">>> Reused page hashes outside __TEXT are only spot-checked, use -R 100 to verify all of them.\n");
+	}
+
 	//sign
 	atimer.Reset();
 	ZBundle bundle;
-	bool bRet = bundle.SignFolder(&zsa, strFolder, strBundleId, strBundleVersion, strDisplayName, arrDylibFiles, bForce, bWeakInject, bEnableCache);
+	bool bRet = bundle.SignFolder(&zsa, strFolder, strBundleId, strBundleVersion, strDisplayName, arrDylibFiles, strSubBundle, bForce, bWeakInject, bEnableCache);
 	atimer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
 
 	//archive
@@ -286,7 +391,7 @@ int main(int argc, char* argv[])
 			atimer.Reset();
 			ZLog::PrintV(">>> Archiving: \t%s ... \n", strOutputFile.c_str());
 			string strBaseFolder = bundle.m_strAppFolder.substr(0, pos - 1);
-			if (!Zip::Archive(strBaseFolder.c_str(), strOutputFile.c_str(), uZipLevel)) {
+			if (!Zip::Archive(strBaseFolder.c_str(), strOutputFile.c_str(), uZipLevel, &bundle.m_tree)) {
 				ZLog::Error(">>> Archive failed!\n");
 				bRet = false;
 			} else {
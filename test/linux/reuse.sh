@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Patches a __DATA page of a signed dylib and force signs it again. The rebuilt code directory
+# has to match the one of a fresh sign of the same bytes, so no stale page hash is carried over.
+# The dylib is padded to 77 pages first, so the patched page is one spot checks would skip.
+# usage: ./reuse.sh
+
+ZSIGN="../../bin/zsign"
+DYLIB="../dylib/bin/demo1.dylib"
+PAD_PAGES=64
+PATCH_PAGE=9
+WORK=$(mktemp -d)
+
+trap 'rm -rf "$WORK"' EXIT
+
+read_u32() {
+    od -An -tu4 -j "$2" -N4 "$1" | tr -d ' '
+}
+
+write_u32() {
+    local v=$3
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $((v & 255)) $((v >> 8 & 255)) $((v >> 16 & 255)) $((v >> 24 & 255)))" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# moves the signature PAD_PAGES pages further into __LINKEDIT, so the old one no longer fits
+pad_dylib() {
+    local src="$1" dst="$2" pad=$((PAD_PAGES * 4096))
+    local ncmds=$(read_u32 "$src" 16) off=32 linkedit=0 codesign=0
+    for i in $(seq 1 "$ncmds"); do
+        local cmd=$(read_u32 "$src" $off)
+        if [ "$cmd" -eq 25 ] && [ "$(dd if="$src" bs=1 skip=$((off + 8)) count=16 status=none | tr -d '\0')" = "__LINKEDIT" ]; then
+            linkedit=$off
+        elif [ "$cmd" -eq 29 ]; then
+            codesign=$off
+        fi
+        off=$((off + $(read_u32 "$src" $((off + 4)))))
+    done
+    [ "$linkedit" -gt 0 ] && [ "$codesign" -gt 0 ] || return 1
+
+    local sigoff=$(read_u32 "$src" $((codesign + 8)))
+    head -c "$sigoff" "$src" > "$dst"
+    head -c "$pad" /dev/zero >> "$dst"
+    tail -c +$((sigoff + 1)) "$src" >> "$dst"
+
+    local filesize=$(( $(read_u32 "$src" $((linkedit + 48))) + pad ))
+    write_u32 "$dst" $((linkedit + 32)) $(( (filesize + 16383) / 16384 * 16384 ))
+    write_u32 "$dst" $((linkedit + 48)) $filesize
+    write_u32 "$dst" $((codesign + 8)) $((sigoff + pad))
+}
+
+patch_page() {
+    local off=$((PATCH_PAGE * 4096 + 100))
+    local byte=$(od -An -tu1 -j $off -N1 "$1" | tr -d ' ')
+    printf "$(printf '\\%03o' $((byte ^ 255)))" | dd of="$1" bs=1 seek=$off conv=notrunc status=none
+}
+
+if ! pad_dylib "$DYLIB" "$WORK/padded.dylib"; then
+    echo -e "\033[31m!!!FAILED!!! (can't pad $DYLIB)\033[0m"
+    exit 1
+fi
+
+# signed once, then patched: a forced sign must rehash the patched page
+mkdir -p "$WORK/resigned" "$WORK/fresh"
+cp "$WORK/padded.dylib" "$WORK/resigned/demo.dylib"
+"$ZSIGN" -q -a -f "$WORK/resigned/demo.dylib" || exit 1
+patch_page "$WORK/resigned/demo.dylib"
+"$ZSIGN" -q -a -f "$WORK/resigned/demo.dylib" || exit 1
+
+# the same bytes signed while the old signature is unusable, so every page is hashed
+cp "$WORK/padded.dylib" "$WORK/fresh/demo.dylib"
+patch_page "$WORK/fresh/demo.dylib"
+"$ZSIGN" -q -a -f "$WORK/fresh/demo.dylib" || exit 1
+
+echo -n "patched __DATA page $PATCH_PAGE: "
+if cmp -s "$WORK/resigned/demo.dylib" "$WORK/fresh/demo.dylib"; then
+    echo -e "\033[32mOK.\033[0m"
+else
+    echo -e "\033[31m!!!FAILED!!! (code directory differs from a fresh sign)\033[0m"
+    exit 1
+fi
@@ -0,0 +1,120 @@
+#!/bin/bash
+
+# Signs an app with many frameworks and dylibs concurrently, using a zsign built with
+# ThreadSanitizer. Fails on a non-zero exit code, on any data race report, or when a bundle
+# was sealed before the bundles and dylibs nested in it were final. Each round signs with -f,
+# then swaps the dylibs of the nested frameworks and signs again from the cache.
+# usage: ./stress.sh [rounds] [threads]
+
+ROUNDS=${1:-3}
+THREADS=${2:-8}
+SRC="../../src"
+DYLIB1="../dylib/bin/demo1.dylib"
+DYLIB2="../dylib/bin/demo2.dylib"
+WORK=$(mktemp -d)
+ZSIGN="$WORK/zsign"
+
+trap 'rm -rf "$WORK"' EXIT
+
+write_info() {
+    cat > "$1/Info.plist" <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>CFBundleIdentifier</key>
+	<string>$2</string>
+	<key>CFBundleExecutable</key>
+	<string>$3</string>
+	<key>CFBundleVersion</key>
+	<string>1.0</string>
+</dict>
+</plist>
+EOF
+}
+
+make_app() {
+    local app="$1/Payload/Stress.app"
+    mkdir -p "$app/Frameworks" "$app/PlugIns"
+    write_info "$app" "com.zsign.stress" "Stress"
+    cp "$DYLIB1" "$app/Stress"
+    for i in $(seq 1 24); do
+        cp "$DYLIB2" "$app/Frameworks/libStress$i.dylib"
+        mkdir -p "$app/Frameworks/F$i.framework"
+        write_info "$app/Frameworks/F$i.framework" "com.zsign.stress.f$i" "F$i"
+        cp "$DYLIB1" "$app/Frameworks/F$i.framework/F$i"
+        head -c $((i * 4096)) /dev/urandom > "$app/Frameworks/F$i.framework/data.bin"
+    done
+    for i in $(seq 1 4); do
+        mkdir -p "$app/PlugIns/E$i.appex"
+        write_info "$app/PlugIns/E$i.appex" "com.zsign.stress.e$i" "E$i"
+        cp "$DYLIB2" "$app/PlugIns/E$i.appex/E$i"
+        mkdir -p "$app/PlugIns/E$i.appex/Frameworks/N$i.framework"
+        write_info "$app/PlugIns/E$i.appex/Frameworks/N$i.framework" "com.zsign.stress.e$i.n" "N$i"
+        cp "$DYLIB1" "$app/PlugIns/E$i.appex/Frameworks/N$i.framework/N$i"
+        cp "$DYLIB2" "$app/PlugIns/E$i.appex/Frameworks/N$i.framework/libN$i.dylib"
+    done
+}
+
+# every bundle has to list the final digests of the executables, CodeResources and dylibs
+# of the bundles nested in it
+check_nested() {
+    local bundle nested file hash
+    local stale=0
+    while read -r bundle; do
+        while read -r nested; do
+            local name=$(basename "$nested")
+            for file in "$nested/${name%.*}" "$nested/_CodeSignature/CodeResources" "$nested"/*.dylib; do
+                [ -f "$file" ] || continue
+                hash=$(openssl dgst -sha256 -binary "$file" | base64)
+                if ! grep -qF "$hash" "$bundle/_CodeSignature/CodeResources"; then
+                    echo "stale: $(basename "$bundle") lists an old ${file#$bundle/}"
+                    stale=1
+                fi
+            done
+        done < <(find "$bundle" -mindepth 1 -type d \( -name "*.appex" -o -name "*.framework" \))
+    done < <(find "$1" -type d \( -name "*.app" -o -name "*.appex" -o -name "*.framework" \))
+    return $stale
+}
+
+run_zsign() {
+    # run inside $WORK, so the cache of the second pass stays there
+    (cd "$WORK" && TSAN_OPTIONS="halt_on_error=0" "$ZSIGN" -a -j "$THREADS" "$@" "$WORK/app/Payload" > "$WORK/log.txt" 2>&1)
+    RET=$?
+    RACES=$(grep -c "WARNING: ThreadSanitizer" "$WORK/log.txt")
+    if [ $RET -ne 0 ] || [ "$RACES" -ne 0 ]; then
+        echo -e "\033[31m!!!FAILED!!! (exit: $RET, races: $RACES)\033[0m"
+        grep -A 20 "WARNING: ThreadSanitizer" "$WORK/log.txt" | head -60
+        return 1
+    fi
+    if ! check_nested "$WORK/app/Payload"; then
+        echo -e "\033[31m!!!FAILED!!! (stale nested digests)\033[0m"
+        return 1
+    fi
+    return 0
+}
+
+echo ">>> Building zsign with ThreadSanitizer..."
+g++ -std=c++11 -O1 -g -fsanitize=thread -pthread -Wno-unused-result \
+    -I$SRC -I$SRC/common $(pkg-config --cflags openssl minizip) \
+    $SRC/*.cpp $SRC/common/*.cpp \
+    $(pkg-config --libs openssl minizip) -o "$ZSIGN" || exit 1
+
+FAILED=0
+for round in $(seq 1 "$ROUNDS"); do
+    rm -rf "$WORK/app" "$WORK/.zsign_cache" && make_app "$WORK/app"
+    echo -n "round $round: "
+
+    if run_zsign -f; then
+        for dylib in "$WORK"/app/Payload/Stress.app/PlugIns/*.appex/Frameworks/*.framework/*.dylib; do
+            cp "$DYLIB1" "$dylib"
+        done
+        if run_zsign; then
+            echo -e "\033[32mOK.\033[0m"
+            continue
+        fi
+    fi
+    FAILED=1
+done
+
+exit $FAILED
@@ -1,19 +1,383 @@
 #!/bin/bash
 
+# Signs every ipa in ../ipa with the test assets, then runs the fixture checks below on an app
+# built from ../dylib. Golden digests were taken from the same fixture signed by the original
+# serial signer, so any change to the CodeDirectory, superblob or CodeResources layout shows up.
+# usage: ./test.sh
+
+ZSIGN="$(cd ../../bin && pwd)/zsign"
 PACKAGES="../ipa"
 PRIVATE_KEY="../assets/test.p12"
 MOBILE_PROVISION="../assets/test.mobileprovision"
+DYLIB1="$(cd ../dylib/bin && pwd)/demo1.dylib"
+DYLIB2="$(cd ../dylib/bin && pwd)/demo2.dylib"
+WORK=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$WORK"' EXIT
 
 for file in "$PACKAGES"/*.ipa; do
     [ -e "$file" ] || continue
 
     echo -n "$file: "
-    
-    ../../bin/zsign -q -i -k $PRIVATE_KEY -m $MOBILE_PROVISION "$file" &>/dev/null 2>&1
-    
+
+    $ZSIGN -q -i -k $PRIVATE_KEY -m $MOBILE_PROVISION "$file" &>/dev/null 2>&1
+
     if [ $? -eq 0 ]; then
         echo -e "\033[32mOK.\033[0m"
     else
         echo -e "\033[31m!!!FAILED!!!\033[0m"
+        FAILED=1
     fi
 done
+
+report() {
+    if [ "$2" -eq 0 ]; then
+        echo -e "$1: \033[32mOK.\033[0m"
+    else
+        echo -e "$1: \033[31m!!!FAILED!!!\033[0m"
+        FAILED=1
+    fi
+}
+
+be32() {
+    local v=$1
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $((v >> 24 & 255)) $((v >> 16 & 255)) $((v >> 8 & 255)) $((v & 255)))"
+}
+
+read_be32() {
+    od -An -tu1 -j "$2" -N4 "$1" | awk '{ printf "%.0f\n", $1 * 16777216 + $2 * 65536 + $3 * 256 + $4 }'
+}
+
+# fat file of both demo dylibs as arm64 and arm64e, 16K aligned. $2 is 32 or 64 bit offsets.
+make_fat() {
+    local out="$1" bits="$2" off=16384 i=0
+    {
+        if [ "$bits" -eq 64 ]; then be32 $((0xcafebabf)); else be32 $((0xcafebabe)); fi
+        be32 2
+        for dylib in "$DYLIB1" "$DYLIB2"; do
+            local size=$(stat -c %s "$dylib")
+            be32 $((0x100000c)); be32 $((i * 2))
+            if [ "$bits" -eq 64 ]; then be32 0; fi
+            be32 $off
+            if [ "$bits" -eq 64 ]; then be32 0; fi
+            be32 $size; be32 14
+            if [ "$bits" -eq 64 ]; then be32 0; fi
+            off=$((off + (size + 16383) / 16384 * 16384))
+            i=$((i + 1))
+        done
+    } > "$out"
+    for dylib in "$DYLIB1" "$DYLIB2"; do
+        truncate -s $(( ($(stat -c %s "$out") + 16383) / 16384 * 16384 )) "$out"
+        cat "$dylib" >> "$out"
+    done
+}
+
+# writes every slice of fat file $1 to $2.0, $2.1, ...
+split_fat() {
+    local magic=$(read_be32 "$1" 0) count=$(read_be32 "$1" 4) entry=20 hi=0
+    [ "$magic" -eq $((0xcafebabf)) ] && entry=32 && hi=4
+    for i in $(seq 0 $((count - 1))); do
+        local base=$((8 + i * entry))
+        local off=$(read_be32 "$1" $((base + 8 + hi)))
+        local size=$(read_be32 "$1" $((base + 12 + hi * 2)))
+        tail -c +$((off + 1)) "$1" | head -c "$size" > "$2.$i"
+    done
+}
+
+write_info() {
+    cat > "$1/Info.plist" <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>CFBundleIdentifier</key>
+	<string>$2</string>
+	<key>CFBundleExecutable</key>
+	<string>$3</string>
+	<key>CFBundleName</key>
+	<string>$3</string>
+	<key>CFBundleVersion</key>
+	<string>1.0</string>
+</dict>
+</plist>
+EOF
+}
+
+# same bytes on every run: no random data, no timestamps
+make_app() {
+    local app="$1/Payload/Test.app"
+    mkdir -p "$app/res" "$app/en.lproj" "$app/Frameworks" "$app/PlugIns/Ext.appex/Frameworks/N.framework"
+    write_info "$app" "com.zsign.test" "Test"
+    cp "$DYLIB1" "$app/Test"
+    printf 'APPL????' > "$app/PkgInfo"
+    printf '"hello" = "world";\n' > "$app/en.lproj/Localizable.strings"
+    for i in $(seq 1 40); do
+        seq 1 $((i * 97)) > "$app/res/file$i.txt"
+    done
+    head -c 50000 /dev/zero > "$app/res/zero.bin"
+    : > "$app/res/empty.txt"
+    cp "$DYLIB2" "$app/Frameworks/libTest.dylib"
+    make_fat "$app/Frameworks/libFat.dylib" 32
+    for fw in A B; do
+        mkdir -p "$app/Frameworks/$fw.framework"
+        write_info "$app/Frameworks/$fw.framework" "com.zsign.test.$fw" "$fw"
+        cp "$DYLIB2" "$app/Frameworks/$fw.framework/$fw"
+        seq 1 500 | sed "s/^/$fw /" > "$app/Frameworks/$fw.framework/data.txt"
+    done
+    write_info "$app/PlugIns/Ext.appex" "com.zsign.test.ext" "Ext"
+    cp "$DYLIB1" "$app/PlugIns/Ext.appex/Ext"
+    printf 'extension' > "$app/PlugIns/Ext.appex/x.txt"
+    write_info "$app/PlugIns/Ext.appex/Frameworks/N.framework" "com.zsign.test.ext.n" "N"
+    cp "$DYLIB2" "$app/PlugIns/Ext.appex/Frameworks/N.framework/N"
+    cp "$DYLIB1" "$app/PlugIns/Ext.appex/Frameworks/N.framework/libN.dylib"
+}
+
+# $2 levels of $3 folders each below $1, one file per folder
+make_folders() {
+    [ "$2" -gt 0 ] || return 0
+    for i in $(seq 1 "$3"); do
+        mkdir -p "$1/d$i"
+        printf '%s' "$1/d$i" > "$1/d$i/f.txt"
+        make_folders "$1/d$i" $(($2 - 1)) "$3"
+    done
+}
+
+# sha1 of every file below $1, by relative path
+tree_digests() {
+    (cd "$1" && find . -type f | LC_ALL=C sort | xargs sha1sum)
+}
+
+# signs a fresh fixture in $WORK/$1 with the given arguments, run from there so the cache stays in it
+sign_app() {
+    local dir="$WORK/$1"
+    shift
+    rm -rf "$dir" && mkdir -p "$dir" && make_app "$dir"
+    (cd "$dir" && "$ZSIGN" -q -a "$@" Payload)
+}
+
+resign_app() {
+    local dir="$WORK/$1"
+    shift
+    (cd "$dir" && "$ZSIGN" -q -a "$@" Payload)
+}
+
+GOLDEN_ADHOC="$WORK/golden_adhoc.txt"
+cat > "$GOLDEN_ADHOC" <<'EOF'
+9aebea445e9d079bc7d9335d8545586dc999fe01  ./Test.app/Frameworks/A.framework/A
+b136d91e97e96d3960739cdc237c21f8ff8fece2  ./Test.app/Frameworks/A.framework/Info.plist
+81ce9d7d00830c081bff153a2d27fa98e7f63b27  ./Test.app/Frameworks/A.framework/_CodeSignature/CodeResources
+54777718487190fcc19ba9af24846dfec01db77a  ./Test.app/Frameworks/A.framework/data.txt
+21cfb28b84e69b991743d924b035dba8a74c53ad  ./Test.app/Frameworks/B.framework/B
+c636e147d5da252461a1858c1a1639fd16ad9923  ./Test.app/Frameworks/B.framework/Info.plist
+9b566812fb7e755ddc140634bfa60c2e1f216a39  ./Test.app/Frameworks/B.framework/_CodeSignature/CodeResources
+26663a160fd62c058ec56fa6b9ccd1463907e103  ./Test.app/Frameworks/B.framework/data.txt
+b5be3c5501467e66dd53599f70c0942025ac69ba  ./Test.app/Frameworks/libFat.dylib
+4e970c0f30faea984dfdee7c4ebd68fec3a8c628  ./Test.app/Frameworks/libTest.dylib
+8d1db49492f0d858e22ac277123892fcb35bdef9  ./Test.app/Info.plist
+9f9eea0cfe2d65f2c3d6b092e375b40782d08f31  ./Test.app/PkgInfo
+b42c9164fbb50f5815cf340acc3aa9e116c8bd5b  ./Test.app/PlugIns/Ext.appex/Ext
+db909862b9934faea8ec33fad5d0928d2bf28a3d  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/Info.plist
+44097be2c3bd713c896e71ab2345ee7d3f7fbdf8  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/N
+7e4531914e1c13471b5dffdea845108fdc504b45  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/_CodeSignature/CodeResources
+792cedbcb54bd242944a0c4834a69b546a8aff68  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/libN.dylib
+b3a45465b12d0329d426dca8b5d4c89745226a35  ./Test.app/PlugIns/Ext.appex/Info.plist
+0dbe93899f9e5ebca4a4c54bb7df46d5ec1aab12  ./Test.app/PlugIns/Ext.appex/_CodeSignature/CodeResources
+f98961015a0ac393630f4eda3749d644a716da64  ./Test.app/PlugIns/Ext.appex/x.txt
+75a54df0ada24f7c2c7178c431bb78e8386f4a2c  ./Test.app/Test
+bc15f8f81551ffd3125b5940e7f81689851ca46a  ./Test.app/_CodeSignature/CodeResources
+1d5af1d6180b8fd8457ae759ab9e2dda685d2ed7  ./Test.app/en.lproj/Localizable.strings
+da39a3ee5e6b4b0d3255bfef95601890afd80709  ./Test.app/res/empty.txt
+0752ce0dc4449ed0918b4aefc159a6c4895ec6bf  ./Test.app/res/file1.txt
+9fb45c0496fedb5d4a9edff1a5500cbfd8c250fc  ./Test.app/res/file10.txt
+f875d69d2d3a6609c55c9df63926f5723fd20bb8  ./Test.app/res/file11.txt
+7f323a57bbc328f20effb7e7031943daf892db39  ./Test.app/res/file12.txt
+422e39d86ac25019dcbdd28fc19db8c901a24da1  ./Test.app/res/file13.txt
+68bfc1afc415efb27f6a29cee78dd529bd246afb  ./Test.app/res/file14.txt
+1bd45508785e9f5cbbdeecd801d32d693c579b7c  ./Test.app/res/file15.txt
+9b34508db2e624704543c8b36139b106303214bb  ./Test.app/res/file16.txt
+c4d59af64fab38f50e497433665ad343f80e9d2f  ./Test.app/res/file17.txt
+fdc8b0c151e69488575fd783925ef1d8b82683f7  ./Test.app/res/file18.txt
+d2a1c816f8d15da2c5036ce3fa48403765df2410  ./Test.app/res/file19.txt
+1d903c4abafc7598120f002c8675dad18c03e27b  ./Test.app/res/file2.txt
+2f28d3ea931e1f84f8e9e6c4616c41c5acd8292a  ./Test.app/res/file20.txt
+639b7d9a288c89df57988b8d63ce88d2d1848ce8  ./Test.app/res/file21.txt
+e240413a434f7d163b5aac0036e67cb050f2f485  ./Test.app/res/file22.txt
+ce12076ffb9c2bb67b4cfcf6bb03c9d8331fc386  ./Test.app/res/file23.txt
+42c6497d5331124b8c89fa8d75a4f606885d5bec  ./Test.app/res/file24.txt
+ec734ee4351c09e7a3d0e27c2ffc9e875898da2a  ./Test.app/res/file25.txt
+6102c3efc96bdf9a1b26e5d6f9af8f956773e597  ./Test.app/res/file26.txt
+aa792d9cc32bee423b6460f24fc29c170e70f8c4  ./Test.app/res/file27.txt
+04778609c5d38c6989dfcd3175b0318f5194848e  ./Test.app/res/file28.txt
+3686f9383fd9b1ec589df1fd8ab5b2e5b77697a2  ./Test.app/res/file29.txt
+b7ba2bc1e7adcb0ae8f862c4b9b250ba1cefb187  ./Test.app/res/file3.txt
+404a84f0cdc981f661e00e53e969c5d5877bb6ae  ./Test.app/res/file30.txt
+09f8d7f4fa955b7f01c5f113c9ed229e391aef9e  ./Test.app/res/file31.txt
+c14176546ba15de7d5a444d178a102cb601ec7d9  ./Test.app/res/file32.txt
+0ae4128c2d3e68764016e46aee8ec5da99ce96e8  ./Test.app/res/file33.txt
+70eb9eba1d00e680f7220b69d059b1ef9cabf881  ./Test.app/res/file34.txt
+2e71830f191369688962b9419d192b8167446b62  ./Test.app/res/file35.txt
+f8a6aa9df7216142e5390813ff22a273c7417334  ./Test.app/res/file36.txt
+947da7fe00ee24a810fca9ab5f27156962cecd53  ./Test.app/res/file37.txt
+0b08e67c36c4fc58756d8094598e65b8a38ddd0c  ./Test.app/res/file38.txt
+e099dd4f1df2bb78d7a3a57b3280b49446d0662d  ./Test.app/res/file39.txt
+9f1c0f47d3419021ed97bd75d997c6e2fe9ae64e  ./Test.app/res/file4.txt
+42dd1df99c0877dc291235e4d7b9ce3d98824db4  ./Test.app/res/file40.txt
+3cae481caed304cb724b48a2358897c086f80bf0  ./Test.app/res/file5.txt
+5f2954b11f14947b46926d3611d9eef3a70eb400  ./Test.app/res/file6.txt
+4215087e4bad9fe3b1efa150c8fbbd0c43357aec  ./Test.app/res/file7.txt
+f523ea77f1d562af269c05431dda4f204bea4ec6  ./Test.app/res/file8.txt
+aaf379deb50c81c218a7ef6c61cf8ad1ec3495ba  ./Test.app/res/file9.txt
+887b5b7352cd40b462e83c86a7f166210ab5cd47  ./Test.app/res/zero.bin
+EOF
+
+GOLDEN_SHA256="$WORK/golden_sha256.txt"
+cat > "$GOLDEN_SHA256" <<'EOF'
+191cd28af9581f862e66966b3d3051093a23b392  ./Test.app/Frameworks/A.framework/A
+b136d91e97e96d3960739cdc237c21f8ff8fece2  ./Test.app/Frameworks/A.framework/Info.plist
+81ce9d7d00830c081bff153a2d27fa98e7f63b27  ./Test.app/Frameworks/A.framework/_CodeSignature/CodeResources
+54777718487190fcc19ba9af24846dfec01db77a  ./Test.app/Frameworks/A.framework/data.txt
+69fa8e2b1398690df2a4f5521ffcb48473427b25  ./Test.app/Frameworks/B.framework/B
+c636e147d5da252461a1858c1a1639fd16ad9923  ./Test.app/Frameworks/B.framework/Info.plist
+9b566812fb7e755ddc140634bfa60c2e1f216a39  ./Test.app/Frameworks/B.framework/_CodeSignature/CodeResources
+26663a160fd62c058ec56fa6b9ccd1463907e103  ./Test.app/Frameworks/B.framework/data.txt
+c4615d93384136c1b02c97338d9096ac326f9aad  ./Test.app/Frameworks/libFat.dylib
+c0c552c1b0a6c46aa559b74aa56895a69a5b64dc  ./Test.app/Frameworks/libTest.dylib
+8d1db49492f0d858e22ac277123892fcb35bdef9  ./Test.app/Info.plist
+9f9eea0cfe2d65f2c3d6b092e375b40782d08f31  ./Test.app/PkgInfo
+d785ec360692327fc5636fa9c3ea8e401ad03d00  ./Test.app/PlugIns/Ext.appex/Ext
+db909862b9934faea8ec33fad5d0928d2bf28a3d  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/Info.plist
+f43c020f3893916095b0cb2d8a3dd05a1411b944  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/N
+4052bd8e3b1431a51c357a2a75dc55742563353e  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/_CodeSignature/CodeResources
+e52406ad0afb582a7736a8d3abd286b695691131  ./Test.app/PlugIns/Ext.appex/Frameworks/N.framework/libN.dylib
+b3a45465b12d0329d426dca8b5d4c89745226a35  ./Test.app/PlugIns/Ext.appex/Info.plist
+06d7ed3621b3551f18a3fa731f23c321b76914ba  ./Test.app/PlugIns/Ext.appex/_CodeSignature/CodeResources
+f98961015a0ac393630f4eda3749d644a716da64  ./Test.app/PlugIns/Ext.appex/x.txt
+ecc9aaeb575fcf591247745713048aad6b6d7658  ./Test.app/Test
+fad8a91864a230ee7344dde4ccd3e88134709e56  ./Test.app/_CodeSignature/CodeResources
+1d5af1d6180b8fd8457ae759ab9e2dda685d2ed7  ./Test.app/en.lproj/Localizable.strings
+da39a3ee5e6b4b0d3255bfef95601890afd80709  ./Test.app/res/empty.txt
+0752ce0dc4449ed0918b4aefc159a6c4895ec6bf  ./Test.app/res/file1.txt
+9fb45c0496fedb5d4a9edff1a5500cbfd8c250fc  ./Test.app/res/file10.txt
+f875d69d2d3a6609c55c9df63926f5723fd20bb8  ./Test.app/res/file11.txt
+7f323a57bbc328f20effb7e7031943daf892db39  ./Test.app/res/file12.txt
+422e39d86ac25019dcbdd28fc19db8c901a24da1  ./Test.app/res/file13.txt
+68bfc1afc415efb27f6a29cee78dd529bd246afb  ./Test.app/res/file14.txt
+1bd45508785e9f5cbbdeecd801d32d693c579b7c  ./Test.app/res/file15.txt
+9b34508db2e624704543c8b36139b106303214bb  ./Test.app/res/file16.txt
+c4d59af64fab38f50e497433665ad343f80e9d2f  ./Test.app/res/file17.txt
+fdc8b0c151e69488575fd783925ef1d8b82683f7  ./Test.app/res/file18.txt
+d2a1c816f8d15da2c5036ce3fa48403765df2410  ./Test.app/res/file19.txt
+1d903c4abafc7598120f002c8675dad18c03e27b  ./Test.app/res/file2.txt
+2f28d3ea931e1f84f8e9e6c4616c41c5acd8292a  ./Test.app/res/file20.txt
+639b7d9a288c89df57988b8d63ce88d2d1848ce8  ./Test.app/res/file21.txt
+e240413a434f7d163b5aac0036e67cb050f2f485  ./Test.app/res/file22.txt
+ce12076ffb9c2bb67b4cfcf6bb03c9d8331fc386  ./Test.app/res/file23.txt
+42c6497d5331124b8c89fa8d75a4f606885d5bec  ./Test.app/res/file24.txt
+ec734ee4351c09e7a3d0e27c2ffc9e875898da2a  ./Test.app/res/file25.txt
+6102c3efc96bdf9a1b26e5d6f9af8f956773e597  ./Test.app/res/file26.txt
+aa792d9cc32bee423b6460f24fc29c170e70f8c4  ./Test.app/res/file27.txt
+04778609c5d38c6989dfcd3175b0318f5194848e  ./Test.app/res/file28.txt
+3686f9383fd9b1ec589df1fd8ab5b2e5b77697a2  ./Test.app/res/file29.txt
+b7ba2bc1e7adcb0ae8f862c4b9b250ba1cefb187  ./Test.app/res/file3.txt
+404a84f0cdc981f661e00e53e969c5d5877bb6ae  ./Test.app/res/file30.txt
+09f8d7f4fa955b7f01c5f113c9ed229e391aef9e  ./Test.app/res/file31.txt
+c14176546ba15de7d5a444d178a102cb601ec7d9  ./Test.app/res/file32.txt
+0ae4128c2d3e68764016e46aee8ec5da99ce96e8  ./Test.app/res/file33.txt
+70eb9eba1d00e680f7220b69d059b1ef9cabf881  ./Test.app/res/file34.txt
+2e71830f191369688962b9419d192b8167446b62  ./Test.app/res/file35.txt
+f8a6aa9df7216142e5390813ff22a273c7417334  ./Test.app/res/file36.txt
+947da7fe00ee24a810fca9ab5f27156962cecd53  ./Test.app/res/file37.txt
+0b08e67c36c4fc58756d8094598e65b8a38ddd0c  ./Test.app/res/file38.txt
+e099dd4f1df2bb78d7a3a57b3280b49446d0662d  ./Test.app/res/file39.txt
+9f1c0f47d3419021ed97bd75d997c6e2fe9ae64e  ./Test.app/res/file4.txt
+42dd1df99c0877dc291235e4d7b9ce3d98824db4  ./Test.app/res/file40.txt
+3cae481caed304cb724b48a2358897c086f80bf0  ./Test.app/res/file5.txt
+5f2954b11f14947b46926d3611d9eef3a70eb400  ./Test.app/res/file6.txt
+4215087e4bad9fe3b1efa150c8fbbd0c43357aec  ./Test.app/res/file7.txt
+f523ea77f1d562af269c05431dda4f204bea4ec6  ./Test.app/res/file8.txt
+aaf379deb50c81c218a7ef6c61cf8ad1ec3495ba  ./Test.app/res/file9.txt
+887b5b7352cd40b462e83c86a7f166210ab5cd47  ./Test.app/res/zero.bin
+EOF
+
+# CodeDirectory, superblob and CodeResources layout, serial and parallel
+sign_app serial -f -j 1 && tree_digests "$WORK/serial/Payload" > "$WORK/serial.txt"
+diff -q "$GOLDEN_ADHOC" "$WORK/serial.txt" > /dev/null
+report "ad-hoc layout (-j 1)" $?
+
+sign_app parallel -f -j 8 && tree_digests "$WORK/parallel/Payload" > "$WORK/parallel.txt"
+diff -q "$GOLDEN_ADHOC" "$WORK/parallel.txt" > /dev/null
+report "ad-hoc layout (-j 8)" $?
+
+sign_app sha256 -f -2 -j 8 && tree_digests "$WORK/sha256/Payload" > "$WORK/sha256.txt"
+diff -q "$GOLDEN_SHA256" "$WORK/sha256.txt" > /dev/null
+report "sha256-only layout" $?
+
+# fat64 slices are signed exactly like the same slices in a fat32 file
+mkdir -p "$WORK/fat32" "$WORK/fat64"
+make_fat "$WORK/fat32/libFat.dylib" 32
+make_fat "$WORK/fat64/libFat.dylib" 64
+"$ZSIGN" -q -a -f "$WORK/fat32/libFat.dylib" && "$ZSIGN" -q -a -f "$WORK/fat64/libFat.dylib" &&
+    split_fat "$WORK/fat32/libFat.dylib" "$WORK/fat32/slice" && split_fat "$WORK/fat64/libFat.dylib" "$WORK/fat64/slice" &&
+    cmp -s "$WORK/fat32/slice.0" "$WORK/fat64/slice.0" && cmp -s "$WORK/fat32/slice.1" "$WORK/fat64/slice.1"
+report "fat64 input" $?
+
+# manifest: unchanged files are reused, a same-size file swapped in with the old mtime is not
+swap_file() {
+    local file="$1/Payload/Test.app/res/file3.txt"
+    seq 1 291 | tr '0-9' '9876543210' > "$file.new"
+    touch -r "$file" "$file.new"
+    mv "$file.new" "$file"
+    printf 'changed' >> "$1/Payload/Test.app/PlugIns/Ext.appex/x.txt"
+}
+sign_app cached && swap_file "$WORK/cached" && resign_app cached -b com.zsign.renamed &&
+    sign_app full && swap_file "$WORK/full" && resign_app full -f -b com.zsign.renamed &&
+    diff -q <(tree_digests "$WORK/cached/Payload") <(tree_digests "$WORK/full/Payload") > /dev/null
+report "manifest reuse and invalidation" $?
+
+# re-signing one nested bundle gives the same app as re-signing everything
+sign_app sub -f && printf 'changed' >> "$WORK/sub/Payload/Test.app/PlugIns/Ext.appex/x.txt" &&
+    resign_app sub -s PlugIns/Ext.appex &&
+    sign_app subfull -f && printf 'changed' >> "$WORK/subfull/Payload/Test.app/PlugIns/Ext.appex/x.txt" &&
+    resign_app subfull -f &&
+    diff -q <(tree_digests "$WORK/sub/Payload") <(tree_digests "$WORK/subfull/Payload") > /dev/null
+report "sub-bundle (-s)" $?
+
+# requirements read back in csreq's text format
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -keyout "$WORK/key.pem" -out "$WORK/cert.pem" \
+    -subj "/CN=iPhone Distribution: zsign test (TEAM123456)/OU=TEAM123456/O=zsign" > /dev/null 2>&1
+cat > "$WORK/prov.plist" <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>Entitlements</key>
+	<dict>
+		<key>application-identifier</key>
+		<string>TEAM123456.com.zsign.req</string>
+	</dict>
+	<key>TeamIdentifier</key>
+	<array>
+		<string>TEAM123456</string>
+	</array>
+</dict>
+</plist>
+EOF
+openssl cms -sign -in "$WORK/prov.plist" -signer "$WORK/cert.pem" -inkey "$WORK/key.pem" \
+    -outform DER -nodetach -binary -out "$WORK/test.mobileprovision" > /dev/null 2>&1
+cp "$DYLIB1" "$WORK/req.dylib"
+REQUIREMENTS='designated => identifier \"com.zsign.req\" and anchor apple generic and certificate leaf[subject.CN] = \"iPhone Distribution: zsign test (TEAM123456)\" and certificate 1[field.1.2.840.113635.100.6.2.1] /* exists */'
+"$ZSIGN" -q -k "$WORK/key.pem" -c "$WORK/cert.pem" -m "$WORK/test.mobileprovision" -b com.zsign.req "$WORK/req.dylib" &&
+    "$ZSIGN" -I "$WORK/req.dylib" | grep -qF "\"requirements\":\"$REQUIREMENTS\""
+report "requirement text" $?
+
+# an app with more folders than open files allowed
+rm -rf "$WORK/many" && mkdir -p "$WORK/many" && make_app "$WORK/many"
+make_folders "$WORK/many/Payload/Test.app/deep" 5 4
+cp -r "$WORK/many" "$WORK/manyref"
+(cd "$WORK/manyref" && "$ZSIGN" -q -a -f -j 16 Payload) &&
+    (cd "$WORK/many" && ulimit -n 64 && "$ZSIGN" -q -a -f -j 16 Payload) &&
+    diff -q <(tree_digests "$WORK/many/Payload") <(tree_digests "$WORK/manyref/Payload") > /dev/null
+report "many folders (ulimit -n 64)" $?
+
+exit $FAILED